@@ -16,17 +16,26 @@ using namespace Upp;
 Value ReadFileTool(McpServer& server, const Value& args_v) {
     if(!args_v.Is<ValueMap>()) throw Exc("ums-readfile: 'args' must be a JSON object.");
     ValueMap args = args_v.Get<ValueMap>();
-    server.Log("ums-readfile invoked. Args: " + StoreAsJson(args_v, true));
+    server.Log("ums-readfile invoked. Args: " + McpServer::Brief(args_v));
     if(!server.GetPermissions().allowReadFiles) throw Exc("Perm denied: Read Files for 'ums-readfile'.");
     String path = args.Get("path", "").ToString(); if(path.IsEmpty()) throw Exc("Arg err: 'path' required for 'ums-readfile'.");
-    server.EnforceSandbox(path); String content = LoadFile(path);
+    server.EnforceSandbox(path); String content = server.ReadFile(path);
     if(content.IsVoid()) throw Exc("File err: Could not read file '"+path+"'.");
     server.Log("ums-readfile success: "+path); return content;
 }
+Value ReadFileStreamTool(McpServer& server, const Value& args_v, ToolSink& sink) { // "stream": true, for files of any size
+    if(!args_v.Is<ValueMap>()) throw Exc("ums-readfile: 'args' must be a JSON object.");
+    ValueMap args = args_v.Get<ValueMap>();
+    if(!server.GetPermissions().allowReadFiles) throw Exc("Perm denied: Read Files for 'ums-readfile'.");
+    String path = args.Get("path", "").ToString(); if(path.IsEmpty()) throw Exc("Arg err: 'path' required for 'ums-readfile'.");
+    server.EnforceSandbox(path); int64 size = server.StreamFile(path, sink);
+    if(size < 0) throw Exc("File err: Could not read file '"+path+"'.");
+    server.Log("ums-readfile streamed "+AsString(size)+" bytes: "+path); return ValueMap("path",path)("size",size);
+}
 Value CalculateTool(McpServer& server, const Value& args_v) {
     if(!args_v.Is<ValueMap>()) throw Exc("ums-calc: 'args' must be a JSON object.");
     ValueMap args = args_v.Get<ValueMap>();
-    server.Log("ums-calc invoked. Args: " + StoreAsJson(args_v, true));
+    server.Log("ums-calc invoked. Args: " + McpServer::Brief(args_v));
     Value va=args.Get("a"),vb=args.Get("b"); String op=args.Get("operation","").ToString();
     if(!va.IsNumber())throw Exc("Arg err: 'a' num for 'ums-calc'."); if(!vb.IsNumber())throw Exc("Arg err: 'b' num for 'ums-calc'.");
     if(op.IsEmpty())throw Exc("Arg err: 'operation' for 'ums-calc'."); double a=va.To<double>(),b=vb.To<double>();
@@ -37,7 +46,7 @@ Value CalculateTool(McpServer& server, const Value& args_v) {
 Value CreateDirTool(McpServer& server, const Value& args_v) {
     if(!args_v.Is<ValueMap>()) throw Exc("ums-createdir: 'args' must be a JSON object.");
     ValueMap args = args_v.Get<ValueMap>();
-    server.Log("ums-createdir invoked. Args: " + StoreAsJson(args_v, true));
+    server.Log("ums-createdir invoked. Args: " + McpServer::Brief(args_v));
     if(!server.GetPermissions().allowCreateDirs)throw Exc("Perm denied: Create Dirs for 'ums-createdir'.");
     String p=args.Get("path","").ToString(); if(p.IsEmpty())throw Exc("Arg err: 'path' for 'ums-createdir'.");
     server.EnforceSandbox(p); if(DirectoryExists(p)){server.Log("Dir '"+p+"' exists.");return true;}
@@ -47,23 +56,23 @@ Value CreateDirTool(McpServer& server, const Value& args_v) {
 Value ListDirTool(McpServer& server, const Value& args_v) {
     if(!args_v.Is<ValueMap>() && !args_v.IsVoid()) throw Exc("ums-listdir: 'args' must be a JSON object or null/void."); // Allow empty call for default path
     ValueMap args = args_v.Is<ValueMap>() ? args_v.Get<ValueMap>() : ValueMap(); // Handle void args_v for default path
-    server.Log("ums-listdir invoked. Args: " + StoreAsJson(args_v, true));
+    server.Log("ums-listdir invoked. Args: " + McpServer::Brief(args_v));
     if(!server.GetPermissions().allowSearchDirs)throw Exc("Perm denied: Search Dirs for 'ums-listdir'.");
     String pa=args.Get("path",".").ToString(),ep=pa;
-    if(pa=="."){if(!server.GetSandboxRoots().IsEmpty())ep=server.GetSandboxRoots()[0]; else {server.Log("Warn: listdir '.' no sandbox, CWD.");ep=GetCurrentDirectory();}}
+    if(pa=="."){Vector<String> roots=server.GetSandboxRoots(); if(roots.GetCount())ep=roots[0]; else {server.Log("Warn: listdir '.' no sandbox, CWD.");ep=GetCurrentDirectory();}}
     server.EnforceSandbox(ep);ValueArray ra;FindFile ff(AppendFileName(ep,"*.*"));
-    while(ff){ValueMap fe;fe.Add("name",ff.GetName()).Add("is_dir",ff.IsDirectory()).Add("is_file",ff.IsFile());
+    while(ff){McpServer::CurrentCancel().Check();ValueMap fe;fe.Add("name",ff.GetName()).Add("is_dir",ff.IsDirectory()).Add("is_file",ff.IsFile());
               if(ff.IsFile())fe.Add("size",ff.GetLength());ra.Add(Value(fe));ff.Next();}
     server.Log("listdir success '"+ep+"', "+AsString(ra.GetCount())+" items.");return Value(ra);
 }
 Value WriteFileTool(McpServer& server, const Value& args_v) {
     if(!args_v.Is<ValueMap>()) throw Exc("ums-writefile: 'args' must be a JSON object.");
     ValueMap args = args_v.Get<ValueMap>();
-    server.Log("ums-writefile invoked. Args: " + StoreAsJson(args_v, true));
+    server.Log("ums-writefile invoked. Args: " + McpServer::Brief(args_v));
     if(!server.GetPermissions().allowWriteFiles)throw Exc("Perm denied: Write Files for 'ums-writefile'.");
     String p=args.Get("path","").ToString();if(p.IsEmpty())throw Exc("Arg err: 'path' for 'ums-writefile'.");
     if(args.Find("data")<0)throw Exc("Arg err: 'data' for 'ums-writefile'.");String d=args.Get("data","").ToString();
-    server.EnforceSandbox(p);if(!SaveFile(p,d))throw Exc("FS err: Failed save '"+p+"'.");
+    server.EnforceSandbox(p);if(!server.WriteFile(p,d))throw Exc("FS err: Failed save '"+p+"'.");
     server.Log("Data saved '"+p+"'.");return true;
 }
 
@@ -80,39 +89,64 @@ public:
         mcpServer.SetPort(currentConfig.serverPort);mcpServer.ConfigureBind(currentConfig.bindAllInterfaces);
         mcpServer.SetPathPrefix(currentConfig.ws_path_prefix.IsEmpty()?"/mcp":currentConfig.ws_path_prefix);
         mcpServer.SetTls(currentConfig.use_tls,currentConfig.tls_cert_path,currentConfig.tls_key_path);
+        mcpServer.SetReactorThreads(currentConfig.reactorThreads);
+        Upp::Ws::DeflateOptions dopt;dopt.enabled=currentConfig.deflate;dopt.min_size=currentConfig.deflateMinSize;
+        dopt.server_max_window_bits=currentConfig.deflateWindowBits;dopt.server_no_context_takeover=dopt.client_no_context_takeover=currentConfig.deflateNoContextTakeover;
+        mcpServer.SetDeflate(dopt);
+        mcpServer.SetMaxMessageSize(currentConfig.maxMessageMB << 20);
+        mcpServer.SetWaterMarks(currentConfig.outHighWaterKB << 10, currentConfig.outLowWaterKB << 10);
+        mcpServer.SetUnixSocket(currentConfig.unixSocketPath, currentConfig.unixSocketOwnerOnly);
+        mcpServer.SetAdmission(currentConfig.maxConnections, currentConfig.maxConnectionsPerIp, currentConfig.acceptBatch);
+        mcpServer.SetIoUring(currentConfig.ioUring);
+        mcpServer.SetToolThreads(currentConfig.toolThreads);
+        mcpServer.SetTimeouts(currentConfig.handshakeTimeoutSec * 1000, currentConfig.pingIntervalSec * 1000,
+                              currentConfig.pongTimeoutSec * 1000, currentConfig.idleTimeoutSec * 1000);
         mcpServer.Log("McpApp init. Log cb conf.");
         RegisterTools();
         Ctrl::Initialize();Ctrl::SetLanguage(LNG_ENGLISH);
-        mainWindow.Create(mcpServer,currentConfig);pumpingTimer.Set(-30,THISBACK(PeriodicServerPump));
-        mainWindow.Sizeable().Zoomable().CenterScreen();mainWindow.Run();pumpingTimer.Kill();
+        mainWindow.Create(mcpServer,currentConfig); // McpServer drives its own reactor thread, no pumping timer needed
+        mainWindow.Sizeable().Zoomable().CenterScreen();mainWindow.Run();
         if(mcpServer.IsListening())mcpServer.StopServer();
+        FlushLog(); // the event loop is gone, write what is still queued
     }
     ~McpApplication(){RLOG("McpApp shutting down.");}
 private:
-    void PeriodicServerPump(){mcpServer.PumpEvents();}
     void RegisterTools(){
-        auto Register=[this](const String&name,const String&desc,const Value&params_v,auto func){
-            ToolDefinition def;def.description=desc;def.parameters=params_v;
+        // thread_safe: may run on several tool workers at once (mutating tools are serialized)
+        // max_concurrent: cap for thread_safe tools (0 = none); light: scheduled ahead of heavy calls
+        // timeout_ms: default deadline of a call (0 = none); stream: variant for calls that ask for chunks
+        auto Register=[this](const String&name,const String&desc,const Value&params_v,auto func,bool thread_safe,int max_concurrent=0,bool light=false,int timeout_ms=0,StreamToolFunc stream=StreamToolFunc()){
+            ToolDefinition def;def.description=desc;def.parameters=params_v;def.thread_safe=thread_safe;def.max_concurrent=max_concurrent;def.light=light;def.timeout_ms=timeout_ms;def.stream=stream;
             def.func=[this,func](const Value&args_v)->Value{return func(this->mcpServer,args_v);};
             mcpServer.AddTool(name,def);
         };
         ValueMap params_map;
         params_map.Clear();params_map.Add("path",Value(ValueMap("type","string")("description","Full path to text file.")));
-        Register("ums-readfile","Reads file. Needs Read Files & sandbox.",Value(params_map),ReadFileTool);
+        Register("ums-readfile","Reads file. Needs Read Files & sandbox.",Value(params_map),ReadFileTool,true,0,false,0,
+                 [this](const Value&args_v,ToolSink&sink){return ReadFileStreamTool(mcpServer,args_v,sink);});
         params_map.Clear();params_map.Add("a",ValueMap("type","number")("description","First op")) .Add("b",ValueMap("type","number")("description","Second op")) .Add("operation",ValueMap("type","string")("description","add|sub|mul|div"));
-        Register("ums-calc","Basic arithmetic.",Value(params_map),CalculateTool);
+        Register("ums-calc","Basic arithmetic.",Value(params_map),CalculateTool,true,0,true);
         params_map.Clear();params_map.Add("path",Value(ValueMap("type","string")("description","New folder path.")));
-        Register("ums-createdir","Creates dir. Needs Create Dirs & sandbox.",Value(params_map),CreateDirTool);
+        Register("ums-createdir","Creates dir. Needs Create Dirs & sandbox.",Value(params_map),CreateDirTool,false);
         params_map.Clear();params_map.Add("path",Value(ValueMap("type","string")("optional",true)("description","Dir path (default .).")));
-        Register("ums-listdir","Lists dir. Needs Search Dirs & sandbox.",Value(params_map),ListDirTool);
+        Register("ums-listdir","Lists dir. Needs Search Dirs & sandbox.",Value(params_map),ListDirTool,true,2,false,30000);
         params_map.Clear();params_map.Add("path",Value(ValueMap("type","string")("description","File path"))).Add("data",Value(ValueMap("type","string")("description","Text content")));
-        Register("ums-writefile","Writes text to file. Needs Write Files & sandbox.",Value(params_map),WriteFileTool);
+        Register("ums-writefile","Writes text to file. Needs Write Files & sandbox.",Value(params_map),WriteFileTool,false);
         mcpServer.Log("Std tools registered with Value-based params for main server.");
     }
     void ProcessServerLogMessage(const String&msg){
-        String tsMsg="["+FormatIso8601(GetSysTime())+"] [S] "+msg;RLOG(tsMsg);
-        if(mainWindow.IsOpen())mainWindow.AppendLog(msg);FileAppend logFile(logFilePath);
-        if(logFile.IsOpen()){logFile.PutLine(tsMsg);logFile.Close();}else{StdLog().Put("CRIT log fail: "+logFilePath+" Msg: "+tsMsg+"");} // Removed newline from log
+        // Called from reactor and tool threads as well as the GUI thread. Never takes the GUI
+        // lock: StopServer() runs on the GUI thread and joins reactors that are still logging.
+        LogLine l;l.msg=msg;l.stamped="["+FormatIso8601(GetSysTime())+"] [S] "+msg;RLOG(l.stamped);
+        bool post;{Mutex::Lock __(logLock);post=pendingLog.IsEmpty();pendingLog.Add(pick(l));}
+        if(post)PostCallback([this]{FlushLog();});
+    }
+    void FlushLog(){ // GUI thread: window, log file and rotation
+        Array<LogLine> lines;{Mutex::Lock __(logLock);lines=pick(pendingLog);}
+        if(lines.IsEmpty())return;
+        if(mainWindow.IsOpen())for(const LogLine&l:lines)mainWindow.AppendLog(l.msg);
+        FileAppend logFile(logFilePath); // one open for the whole batch
+        if(logFile.IsOpen()){for(const LogLine&l:lines)logFile.PutLine(l.stamped);logFile.Close();}else{for(const LogLine&l:lines)StdLog().Put("CRIT log fail: "+logFilePath+" Msg: "+l.stamped+"");}
         int64 sz=GetFileLength(logFilePath);if(sz>(int64)currentConfig.maxLogSizeMB*1024*1024&&sz>0){
         String tt=FormatTime(GetSysTime(),"YYYYMMDD_HHMMSS");String ab=NormalizePath(AppendFileName(logDir,"mcpserver_"+tt+".log"));
         RLOG("Log rotate. Sz:"+AsString(sz)+"B. Max:"+AsString(currentConfig.maxLogSizeMB)+"MB.");
@@ -121,6 +155,8 @@ private:
             else{RLOG("Fail compress log: "+ab);if(mainWindow.IsOpen())mainWindow.AppendLog("Fail compress rotated: "+ab);}}
         else{RLOG("Fail rename log for rotate: "+logFilePath);if(mainWindow.IsOpen())mainWindow.AppendLog("Fail rename log for rotate.");}
         FileOut nl(logFilePath);if(nl.IsOpen()){nl.PutLine("["+FormatIso8601(GetSysTime())+"] [S] Log rotated. Prev log archived ("+AsString(sz>>20)+"MB).");nl.Close();}}}
-    String installPath,cfgDir,logDir,cfgPath,logFilePath;Config currentConfig;McpServer mcpServer;McpServerWindow mainWindow;Timer pumpingTimer;
+    struct LogLine{String msg,stamped;};
+    Mutex logLock;Array<LogLine> pendingLog; // server log lines waiting for FlushLog() on the GUI thread
+    String installPath,cfgDir,logDir,cfgPath,logFilePath;Config currentConfig;McpServer mcpServer;McpServerWindow mainWindow;
 };
 CONSOLE_APP_MAIN{StdLogSetup(LOG_FILE|LOG_TIMESTAMP|LOG_APPEND,NormalizePath(AppendFileName(GetExeFolder(),"mcpserver_startup.log")));SetExitCode(0);RLOG("App starting...");McpApplication mcp_app;RLOG("App main finished. Exit: "+AsString(GetExitCode()));}
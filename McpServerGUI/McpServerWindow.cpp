@@ -83,9 +83,8 @@ void McpServerWindow::OnStartServer() {
     if(server_ref.logCallback) server_ref.logCallback("Configuration saved by GUI to " + configFilePath);
     server_ref.SetPort(current_config_ref.serverPort);
     server_ref.ConfigureBind(current_config_ref.bindAllInterfaces);
-    server_ref.GetPermissions() = current_config_ref.permissions;
-    server_ref.GetSandboxRoots().Clear();
-    for(const String& root : current_config_ref.sandboxRoots) { server_ref.AddSandboxRoot(root); }
+    server_ref.SetPermissions(current_config_ref.permissions);
+    server_ref.SetSandboxRoots(current_config_ref.sandboxRoots);
     Vector<String> allKnownTools = server_ref.GetAllToolNames();
     for(const String& toolName : allKnownTools) {
         if(current_config_ref.enabledTools.Find(toolName) >= 0) { server_ref.EnableTool(toolName); }
@@ -137,7 +136,9 @@ void McpServerWindow::UpdateStatusDisplay() {
         // The minimal server implementation does not provide GetListenHost().
         // Determine the host from our bind setting instead.
         String actual_host_display = server_ref.GetBindAllInterfaces() ? "0.0.0.0" : "127.0.0.1";
-        lblStatus = "Status: Running on " + actual_host_display + ":" + AsString(server_ref.GetPort());
+        lblStatus = "Status: Running on " + actual_host_display + ":" + AsString(server_ref.GetPort())
+                    + "  (queued " + AsString(server_ref.GetQueuedBytes() >> 10) + " KB, "
+                    + AsString(server_ref.GetPausedClients()) + " throttled)";
     } else {
         lblStatus = "Status: Stopped";
     }
@@ -0,0 +1,82 @@
+#include "../../include/McpServer.h"
+#include <Core/Core.h>
+#include <chrono>
+
+// Round-trip latency of a tool_call against an in-process McpServer: over TCP
+// loopback, over the AF_UNIX socket, and over the shared-memory rings negotiated
+// on that socket. Usage: ShmLatency [iterations]
+
+static const char *CALL = "{\"type\":\"tool_call\",\"tool\":\"echo\",\"args\":{\"text\":\"ping\"}}";
+
+static bool RoundTrips(Ws::Client& c, int count, Vector<double> *us)
+{
+    int replies = 0;
+    c.WhenText = [&](String s) { if(s.Find("\"tool_response\"") >= 0) replies++; };
+    for(int i = 0; i < count; i++) {
+        auto t0 = std::chrono::steady_clock::now();
+        int want = replies + 1;
+        int start = msecs();
+        if(!c.SendText(CALL))
+            return false;
+        while(replies < want)
+            if(!c.Wait(1000) || msecs(start) > 5000)
+                return false;
+        if(us)
+            us->Add(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+    }
+    return true;
+}
+
+static void Measure(const char *name, Ws::Client& c, int count)
+{
+    Vector<double> us;
+    if(!RoundTrips(c, 200, NULL) || !RoundTrips(c, count, &us)) { // warm up caches and the server thread first
+        Cout() << name << ": connection failed\n";
+        return;
+    }
+    Sort(us);
+    double sum = 0;
+    for(double x : us)
+        sum += x;
+    Cout() << Format("%-6s %d calls  mean %.1f us  p50 %.1f us  p99 %.1f us  max %.1f us\n", name, us.GetCount(),
+                     sum / us.GetCount(), us[us.GetCount() / 2], us[us.GetCount() * 99 / 100], us.Top());
+}
+
+CONSOLE_APP_MAIN
+{
+#ifdef PLATFORM_LINUX
+    const Vector<String>& cmd = CommandLine();
+    int count = cmd.GetCount() ? max(ScanInt(cmd[0]), 1) : 10000;
+    String unix_path = AppendFileName(GetTempPath(), "mcp-shm-latency.sock");
+
+    McpServer server(5090, "/mcp");
+    server.SetLogCallback([](const String&) {}); // logging would dominate the numbers
+    server.SetUnixSocket(unix_path);
+    ToolDefinition td;
+    td.description = "echo: returns its 'text' argument.";
+    td.parameters = ValueMap()("text", ValueMap()("type", "string"));
+    td.func = [](const Value& args) -> Value { return args["text"]; };
+    td.thread_safe = true;
+    server.AddTool("echo", td);
+    server.EnableTool("echo");
+    if(!server.StartServer()) {
+        Cout() << "Server start failed\n";
+        SetExitCode(1);
+        return;
+    }
+
+    Ws::Client tcp, uds, shm;
+    if(tcp.Connect("ws://127.0.0.1:5090/mcp"))
+        Measure("tcp", tcp, count);
+    if(uds.ConnectUnix(unix_path, "/mcp"))
+        Measure("unix", uds, count);
+    if(shm.ConnectUnix(unix_path, "/mcp") && shm.AttachShm("{\"type\":\"shm_attach\"}"))
+        Measure("shm", shm, count);
+    else
+        Cout() << "shm: attach failed\n";
+
+    server.StopServer();
+#else
+    Cout() << "The shared-memory transport needs Linux\n";
+#endif
+}
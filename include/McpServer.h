@@ -1,5 +1,7 @@
 #pragma once
 #include <Core/Core.h>
+#include <atomic>
+#include <memory>
 #include "../mcp_server_lib/WebSocket.h"
 
 // Current application version
@@ -18,10 +20,47 @@ struct Permissions { /* ... remains same ... */
 // ToolFunc now takes and returns Value. Args should be a ValueMap. Result can be any valid JSON Value.
 using ToolFunc = std::function<Value(const Value& args)>; // Args Value is expected to be a ValueMap
 
+// Lets a tool call notice that its result is no longer wanted: the client went
+// away or cancelled it, or its deadline passed. Long-running tools should poll it.
+class CancelToken {
+public:
+    bool IsCancelled() const  { return state->cancelled || IsExpired(); }
+    bool IsExpired() const    { return state->timed && msecs(state->deadline) >= 0; }
+    void Check() const        { if(state->cancelled) throw Exc("Cancelled."); if(IsExpired()) throw Exc("Deadline exceeded."); }
+    int  GetRemaining() const { return state->timed ? max(-msecs(state->deadline), 0) : INT_MAX; } // ms
+    void Cancel() const       { state->cancelled = true; }
+    void SetTimeout(int ms)   { state->timed = ms > 0; state->deadline = msecs() + ms; } // before the token is shared
+
+private:
+    struct State {
+        std::atomic<bool> cancelled{false};
+        bool timed = false;
+        int  deadline = 0;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+};
+
+// Where a streaming tool writes its result. Write() blocks while the client is
+// behind, so only a few chunks are ever held in memory, and returns false once
+// the call is cancelled or the client is gone.
+class ToolSink {
+public:
+    virtual bool Write(const String& chunk) = 0;
+    virtual ~ToolSink() {}
+};
+// Streams its output to the sink; the returned Value closes the call (e.g. a summary).
+using StreamToolFunc = std::function<Value(const Value& args, ToolSink& sink)>;
+
 struct ToolDefinition {
     ToolFunc func;
     String description;
     Value parameters; // Expected to be a ValueMap representing JSON schema object
+    bool thread_safe = false; // may run concurrently with itself; if not, its calls are serialized
+    int  max_concurrent = 0;  // thread_safe tools: at most this many calls at once, 0 = no limit
+    bool light = false;       // cheap call: scheduled ahead of the queued heavy ones
+    int  timeout_ms = 0;      // deadline of a call unless the request sets its own, 0 = none
+    StreamToolFunc stream;    // used for calls that ask for "stream"; without func it also serves
+                              // the others, with the chunks joined into the result
 };
 
 class McpServer {
@@ -36,13 +75,21 @@ public:
     bool IsToolEnabled(const String& toolName) const;
     Value GetToolManifest() const; // Returns Value (a ValueMap for the "tools" object)
 
-    Permissions& GetPermissions();
-    const Permissions& GetPermissions() const;
-    Vector<String>& GetSandboxRoots();
-    const Vector<String>& GetSandboxRoots() const;
+    // Tools read these on worker threads while the GUI may change them, so both
+    // are handed out as copies and replaced whole.
+    Permissions GetPermissions() const;
+    void SetPermissions(const Permissions& p);
+    Vector<String> GetSandboxRoots() const;
+    void SetSandboxRoots(const Vector<String>& roots); // normalized; no moment without roots in between
     void AddSandboxRoot(const String& root);
     void RemoveSandboxRoot(const String& root);
     void EnforceSandbox(const String& path) const;
+    // File access for tools: through a per-thread io_uring (several chunks in
+    // flight) when enabled and available, LoadFile/SaveFile otherwise.
+    String ReadFile(const String& path) const; // void String on failure
+    bool WriteFile(const String& path, const String& data) const;
+    int64 StreamFile(const String& path, ToolSink& sink, int chunk = 256 << 10) const; // bytes sent, -1 on failure
+    static const CancelToken& CurrentCancel(); // of the tool call running on this thread (never cancelled outside one)
 
     void ConfigureBind(bool allInterfaces);
     bool GetBindAllInterfaces() const { return bindAll; }
@@ -51,18 +98,105 @@ public:
     void SetPathPrefix(const String& path);
     String GetPathPrefix() const { return ws_path_prefix; }
     void SetTls(bool use_tls, const String& cert_path = "", const String& key_path = "");
+    void SetDeflate(const Upp::Ws::DeflateOptions& o); // permessage-deflate offered to new clients
+    const Upp::Ws::DeflateOptions& GetDeflate() const { return deflate_opts; }
+    void SetReactorThreads(int n);   // >1 shards endpoints over n SO_REUSEPORT listeners (Linux)
+    int  GetReactorThreads() const { return reactor_threads; }
+    void SetMaxMessageSize(int bytes); // larger incoming messages are refused with close code 1009
+    int  GetMaxMessageSize() const { return max_message; }
+    void SetTimeouts(int handshake_ms, int ping_ms, int pong_ms, int idle_ms); // ping/idle 0 = off
+    void SetUnixSocket(const String& path, bool owner_only = true); // also serve local agents on AF_UNIX (Linux), "" = off
+    void SetAdmission(int max_conns, int max_per_ip, int accept_batch); // 0 = unlimited
+    void SetWaterMarks(int high, int low); // per-client output bytes: stop reading above high, resume at low
+    void SetToolThreads(int n);      // tool calls run on n worker threads, 0 = inline on the reactor thread
+    int  GetToolThreads() const { return tool_threads; }
+    void SetIoUring(bool on);        // io_uring for socket and tool file I/O where the kernel allows it (Linux)
+    bool IsIoUringActive() const;    // at least one shard got a ring
+    int64 GetQueuedBytes() const;     // output queued for all clients
+    int  GetPausedClients() const;    // clients currently held back by backpressure
+    int64 GetWritesSaved() const;     // frames that went out together with others in one write
+    ValueMap GetToolQueueStats() const; // per tool: calls, avg_wait_ms, max_wait_ms, running, queued
 
-    bool StartServer();
+    bool StartServer();              // also starts the reactor threads that drive the shards
     bool StopServer();
     bool IsListening() const { return is_listening; }
-    void PumpEvents();
-    void SetLogCallback(std::function<void(const String&)> cb);
+    void SetLogCallback(std::function<void(const String&)> cb); // cb may be called from any reactor thread
     void Log(const String& message);
+    static String Brief(const Value& v); // for logs: shape, sizes and the start of strings, never a whole payload
 
     std::function<void(const String&)> logCallback;
 
 private:
-    Upp::Ws::Server ws_server;
+    Array<Upp::Ws::Server> shards;   // one per reactor thread, each owns a disjoint set of endpoints
+    Array<Thread> reactors;
+    int reactor_threads = 1;
+    Upp::Ws::DeflateOptions deflate_opts;
+    int max_message = 64 << 20;
+    int high_water = 4 << 20, low_water = 1 << 20;
+    int max_conns = 0, max_per_ip = 0, accept_batch = 64;
+    String unix_socket_path; bool unix_owner_only = true;
+    bool use_io_uring = true;
+
+    struct Batch {                   // replies of one batch message; touched on its reactor thread only
+        Vector<Value> replies;
+        int  pending = 0;
+        bool stream = false;         // legacy batches may ask for each item as it completes
+    };
+    struct CallRef {                 // how a tool call is answered
+        bool rpc = false;            // JSON-RPC 2.0, else the legacy tool_response/error envelope
+        bool notify = false;         // JSON-RPC notification: run it, reply nothing
+        Value id;
+        std::shared_ptr<Batch> batch; // set for the items of a batch
+        int  slot = 0;
+        bool stream = false;         // the client takes tool_chunk messages before the reply
+    };
+    class StreamSink;
+    struct ToolJob {
+        String tool;
+        ToolDefinition def;
+        Value args;
+        CallRef ref;
+        Ptr<Upp::Ws::Endpoint> client; // only dereferenced on its reactor thread, it may be gone by then
+        Upp::Ws::Server *shard = nullptr;
+        String client_ip;
+        int queued_at = 0;
+        CancelToken cancel;
+        const Upp::Ws::Endpoint *owner = nullptr; // job_clients key, also for cancelling; compared only, never dereferenced
+    };
+    struct ToolStats {
+        int64 calls = 0, wait_ms = 0;
+        int max_wait_ms = 0, running = 0, queued = 0;
+    };
+    struct ClientJobs;
+    struct JobQueue {                // one client's queued calls of one tool, oldest first
+        String tool;
+        bool light = false;
+        ClientJobs *client = nullptr;
+        BiArray<ToolJob> jobs;
+    };
+    struct ClientJobs {              // a connection's queues; its ready heavy ones take turns
+        ArrayMap<String, JobQueue> tools;
+        BiVector<JobQueue*> ready;
+    };
+    int tool_threads = 4;
+    Array<Thread> tool_workers;
+    mutable Mutex jobs_lock;         // the queues below, tool_stats, running_jobs, jobs_stop
+    ConditionVariable jobs_cv;
+    // Every non-empty queue is in exactly one place: ready_light, its client's ready
+    // list, or blocked under its tool while that tool is at its concurrency limit.
+    ArrayMap<const Upp::Ws::Endpoint*, ClientJobs> job_clients; // keyed by connection, so clients behind one address or uid are still told apart
+    BiVector<JobQueue*> ready_light; // light tools go ahead of everything else
+    BiVector<ClientJobs*> ready_clients; // clients with a ready heavy queue, served round-robin so a flood cannot starve the others
+    ArrayMap<String, BiVector<JobQueue*>> blocked; // per tool: queues waiting for one of its calls to finish
+    VectorMap<String, ToolStats> tool_stats;
+    Vector<ToolJob*> running_jobs;   // owned by the workers running them
+    bool jobs_stop = false;
+    int handshake_timeout = 5000, ping_interval = 30000, pong_timeout = 10000, idle_timeout = 0;
+    std::atomic<bool> reactor_stop{false};
+    mutable RWMutex tools_lock;      // allTools, enabledTools, perms, sandboxRoots
+    Mutex manifest_lock;             // manifest_text, manifest_frame; taken before tools_lock, never inside it
+    String manifest_text, manifest_frame; // greeting of new connections, empty until built after a tool change
+    mutable Mutex clients_lock;      // active_clients
     uint16 serverPort; String ws_path_prefix;
     bool bindAll; bool use_tls = false; String tls_cert_path; String tls_key_path;
     bool is_listening = false;
@@ -71,13 +205,31 @@ private:
     Permissions perms; Vector<String> sandboxRoots;
     Index<Upp::Ws::Endpoint*> active_clients;
 
+    void ReactorLoop(Upp::Ws::Server& shard);
+    void ToolWorker();
+    JobQueue *NextJob();             // queue whose head starts next, taken off its ready list; null if none may; jobs_lock held
+    bool CanStart(const ToolJob& job) const;
+    void Ready(JobQueue& q);         // jobs_lock held
+    void ProcessRpc(Upp::Ws::Endpoint* client_endpoint, const ValueMap& msg, const String& client_ip, CallRef ref = CallRef());
+    void ProcessBatch(Upp::Ws::Endpoint* client_endpoint, const ValueArray& calls, bool rpc, bool stream, const String& client_ip);
+    void DispatchTool(Upp::Ws::Endpoint* client_endpoint, const String& toolName, const Value& args, const String& client_ip, const CallRef& ref, int timeout_ms);
+    bool InvokeTool(const String& toolName, const ToolDefinition& def, const Value& args, const String& client_ip, const CancelToken& cancel, ToolSink *sink, Value& result); // false: result is the error text
+    static Value ChunkMessage(const CallRef& ref, int seq, const String& data); // void if nothing is to be sent
+    void CancelCalls(const Upp::Ws::Endpoint* ep, const Value& id = Value()); // all calls of ep, or the one with this request id
+    static Value ToolReply(const CallRef& ref, bool ok, const Value& result); // void if nothing is to be sent
+    void SendCallResult(Upp::Ws::Endpoint* ep, const CallRef& ref, const Value& result);
+    void SendCallError(Upp::Ws::Endpoint* ep, const CallRef& ref, int rpc_code, const String& message);
+    void Answer(Upp::Ws::Endpoint* ep, const CallRef& ref, const Value& reply); // reactor thread only
+    void ConfigureShard(Upp::Ws::Server& shard, int i, int n);
     void OnWsAccept(Upp::Ws::Endpoint& client_endpoint);
-    void OnWsText(Upp::Ws::Endpoint* client_endpoint, String msg);
+    void SendManifest(Upp::Ws::Endpoint& client_endpoint);
+    void InvalidateManifest();
+    void OnWsText(Upp::Ws::Endpoint* client_endpoint, const char* msg, int len); // msg is a view into the receive buffer
     void OnWsBinary(Upp::Ws::Endpoint* client_endpoint, String data);
     bool OnWsClientClose(Upp::Ws::Endpoint* client_endpoint, int code, const String& reason);
     void OnWsClientError(Upp::Ws::Endpoint* client_endpoint, int error_code);
 
     static bool PathUnderRoot(const String& parent, const String& child);
     void SendJsonResponse(Upp::Ws::Endpoint* client, const Value& jsonData);
-    void ProcessMcpMessage(Upp::Ws::Endpoint* client_endpoint, const String& message_text);
+    void ProcessMcpMessage(Upp::Ws::Endpoint* client_endpoint, const char* message_text, int len); // message_text NUL-terminated
 };
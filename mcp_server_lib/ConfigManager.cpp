@@ -89,6 +89,54 @@ bool ConfigManager::Load(const String& path, Config& out) {
         v = root.Get("tls_key_path", default_cfg.tls_key_path);
         out.tls_key_path = v.ToString();
 
+        v = root.Get("reactorThreads", default_cfg.reactorThreads);
+        out.reactorThreads = max(v.To<int>(), 1);
+
+        v = root.Get("deflate", default_cfg.deflate);
+        out.deflate = v.To<bool>();
+
+        v = root.Get("deflateMinSize", default_cfg.deflateMinSize);
+        out.deflateMinSize = max(v.To<int>(), 0);
+
+        v = root.Get("deflateWindowBits", default_cfg.deflateWindowBits);
+        out.deflateWindowBits = minmax(v.To<int>(), 9, 15);
+
+        v = root.Get("deflateNoContextTakeover", default_cfg.deflateNoContextTakeover);
+        out.deflateNoContextTakeover = v.To<bool>();
+
+        v = root.Get("maxMessageMB", default_cfg.maxMessageMB);
+        out.maxMessageMB = minmax(v.To<int>(), 1, 1024);
+
+        v = root.Get("outHighWaterKB", default_cfg.outHighWaterKB);
+        out.outHighWaterKB = minmax(v.To<int>(), 4, 1 << 20);
+        v = root.Get("outLowWaterKB", default_cfg.outLowWaterKB);
+        out.outLowWaterKB = minmax(v.To<int>(), 0, out.outHighWaterKB);
+
+        v = root.Get("handshakeTimeoutSec", default_cfg.handshakeTimeoutSec);
+        out.handshakeTimeoutSec = minmax(v.To<int>(), 1, 300);
+        v = root.Get("pingIntervalSec", default_cfg.pingIntervalSec);
+        out.pingIntervalSec = minmax(v.To<int>(), 0, 86400);
+        v = root.Get("pongTimeoutSec", default_cfg.pongTimeoutSec);
+        out.pongTimeoutSec = minmax(v.To<int>(), 1, 3600);
+        v = root.Get("idleTimeoutSec", default_cfg.idleTimeoutSec);
+        out.idleTimeoutSec = minmax(v.To<int>(), 0, 30 * 86400);
+
+        v = root.Get("maxConnections", default_cfg.maxConnections);
+        out.maxConnections = max(v.To<int>(), 0);
+        v = root.Get("maxConnectionsPerIp", default_cfg.maxConnectionsPerIp);
+        out.maxConnectionsPerIp = max(v.To<int>(), 0);
+        v = root.Get("acceptBatch", default_cfg.acceptBatch);
+        out.acceptBatch = minmax(v.To<int>(), 1, 4096);
+
+        v = root.Get("unixSocketPath", default_cfg.unixSocketPath);
+        out.unixSocketPath = v.ToString();
+        v = root.Get("unixSocketOwnerOnly", default_cfg.unixSocketOwnerOnly);
+        out.unixSocketOwnerOnly = v.To<bool>();
+        v = root.Get("toolThreads", default_cfg.toolThreads);
+        out.toolThreads = minmax(v.To<int>(), 0, 256);
+        v = root.Get("ioUring", default_cfg.ioUring);
+        out.ioUring = v.To<bool>();
+
         if(out.ws_path_prefix.IsEmpty()||!out.ws_path_prefix.StartsWith("/")){
             LOG("ConfigManager::Load - ws_path_prefix '"+out.ws_path_prefix+"' invalid, reset to default.");
             out.ws_path_prefix=default_cfg.ws_path_prefix;
@@ -113,7 +161,18 @@ void ConfigManager::Save(const String& path, const Config& cfg) {
     ValueArray roots_va; for(const auto&r:cfg.sandboxRoots)roots_va.Add(r); root_map.Add("sandboxRoots",Value(roots_va));
     root_map.Add("serverPort",cfg.serverPort).Add("bindAllInterfaces",cfg.bindAllInterfaces).Add("maxLogSizeMB",cfg.maxLogSizeMB)
             .Add("ws_path_prefix",cfg.ws_path_prefix).Add("use_tls",cfg.use_tls)
-            .Add("tls_cert_path",cfg.tls_cert_path).Add("tls_key_path",cfg.tls_key_path);
+            .Add("tls_cert_path",cfg.tls_cert_path).Add("tls_key_path",cfg.tls_key_path)
+            .Add("reactorThreads",cfg.reactorThreads)
+            .Add("deflate",cfg.deflate).Add("deflateMinSize",cfg.deflateMinSize)
+            .Add("deflateWindowBits",cfg.deflateWindowBits).Add("deflateNoContextTakeover",cfg.deflateNoContextTakeover)
+            .Add("maxMessageMB",cfg.maxMessageMB)
+            .Add("outHighWaterKB",cfg.outHighWaterKB).Add("outLowWaterKB",cfg.outLowWaterKB)
+            .Add("handshakeTimeoutSec",cfg.handshakeTimeoutSec).Add("pingIntervalSec",cfg.pingIntervalSec)
+            .Add("pongTimeoutSec",cfg.pongTimeoutSec).Add("idleTimeoutSec",cfg.idleTimeoutSec)
+            .Add("maxConnections",cfg.maxConnections).Add("maxConnectionsPerIp",cfg.maxConnectionsPerIp)
+            .Add("acceptBatch",cfg.acceptBatch)
+            .Add("unixSocketPath",cfg.unixSocketPath).Add("unixSocketOwnerOnly",cfg.unixSocketOwnerOnly)
+            .Add("toolThreads",cfg.toolThreads).Add("ioUring",cfg.ioUring);
     String json_output=StoreAsJson(Value(root_map),true);
     String dir=GetFileFolder(path); if(!DirectoryExists(dir)){if(!RealizeDirectory(dir)){LOG("ConfigManager::Save - CRIT: Failed create dir: "+dir);return;}}
     if(!SaveFile(path,json_output)){LOG("ConfigManager::Save - CRIT: Failed save file: "+path);return;}
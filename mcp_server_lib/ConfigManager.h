@@ -16,6 +16,25 @@ struct Config {
     bool             use_tls          = false;
     String           tls_cert_path;
     String           tls_key_path;
+    int              reactorThreads   = 1;   // >1 shards connections over SO_REUSEPORT listeners
+    bool             deflate          = false; // offer permessage-deflate (RFC 7692)
+    int              deflateMinSize   = 256;   // bytes; smaller messages are sent as-is
+    int              deflateWindowBits = 15;   // 9..15, server side LZ77 window
+    bool             deflateNoContextTakeover = false; // trade ratio for per-connection memory
+    int              maxMessageMB     = 64;    // reassembled message limit, larger ones are refused
+    int              outHighWaterKB   = 4096;  // per-client queued output at which reading stops
+    int              outLowWaterKB    = 1024;  // ... and resumes
+    int              handshakeTimeoutSec = 5;  // TLS + HTTP upgrade must finish within this
+    int              pingIntervalSec  = 30;    // silence before a keepalive ping, 0 = off
+    int              pongTimeoutSec   = 10;    // pinged peer must answer within this
+    int              idleTimeoutSec   = 0;     // close clients sending no messages this long, 0 = never
+    int              maxConnections   = 0;     // above this new clients get 503, 0 = unlimited
+    int              maxConnectionsPerIp = 0;  // per source address, 0 = unlimited
+    int              acceptBatch      = 64;    // accepts per reactor pass
+    String           unixSocketPath;           // also listen here for local agents (Linux), empty = off
+    bool             unixSocketOwnerOnly = true; // only peers running as our uid (SO_PEERCRED)
+    int              toolThreads      = 4;     // workers running tool calls, 0 = on the reactor thread
+    bool             ioUring          = true;  // io_uring for sockets and tool file I/O when available (Linux)
 
     // Default constructor to initialize new fields like ws_path_prefix
     Config() {
@@ -0,0 +1,262 @@
+#include "JsonEnvelope.h"
+#include <Core/Json.h>
+
+using namespace Upp;
+
+namespace {
+
+struct JsonScan { // JSON syntax checked exactly, but nothing is built
+    const char *p, *e;
+    int         depth = 0;
+
+    enum { MAX_DEPTH = 64 }; // deeper nesting is left to the general path
+
+    JsonScan(const char *b, const char *e) : p(b), e(e) {}
+
+    void Ws()        { while(p < e && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++; }
+    bool Eat(char c) { Ws(); if(p < e && *p == c) { p++; return true; } return false; }
+    bool AtEnd()     { Ws(); return p == e; }
+    bool Digits()    { const char *b = p; while(p < e && IsDigit(*p)) p++; return p > b; }
+    bool Literal(const char *s, int n);
+    bool SkipString();
+    bool SkipNumber();
+    bool SkipValue();
+    // member(key, key_len, value, value_end) for each member, false from it gives up
+    template <class F> bool Members(F member);
+};
+
+bool JsonScan::Literal(const char *s, int n)
+{
+    if(e - p < n || memcmp(p, s, n))
+        return false;
+    p += n;
+    return true;
+}
+
+bool JsonScan::SkipString()
+{
+    if(p >= e || *p != '"')
+        return false;
+    for(p++; p < e; p++) {
+        if(*p == '"') {
+            p++;
+            return true;
+        }
+        if((byte)*p < 0x20)
+            return false;
+        if(*p == '\\') {
+            if(++p == e)
+                return false;
+            if(*p == 'u') {
+                for(int i = 0; i < 4; i++)
+                    if(++p == e || !IsXDigit(*p))
+                        return false;
+            }
+            else
+            if(!*p || !strchr("\"\\/bfnrt", *p))
+                return false;
+        }
+    }
+    return false;
+}
+
+bool JsonScan::SkipNumber()
+{
+    if(p < e && *p == '-')
+        p++;
+    if(p < e && *p == '0')
+        p++;
+    else
+    if(!Digits())
+        return false;
+    if(p < e && *p == '.') {
+        p++;
+        if(!Digits())
+            return false;
+    }
+    if(p < e && (*p == 'e' || *p == 'E')) {
+        p++;
+        if(p < e && (*p == '+' || *p == '-'))
+            p++;
+        if(!Digits())
+            return false;
+    }
+    return true;
+}
+
+bool JsonScan::SkipValue()
+{
+    Ws();
+    if(p >= e)
+        return false;
+    switch(*p) {
+    case '"': return SkipString();
+    case 't': return Literal("true", 4);
+    case 'f': return Literal("false", 5);
+    case 'n': return Literal("null", 4);
+    case '{': return Members([](const char *, int, const char *, const char *) { return true; });
+    case '[':
+        if(depth == MAX_DEPTH)
+            return false;
+        depth++;
+        p++;
+        if(!Eat(']')) {
+            do
+                if(!SkipValue())
+                    return false;
+            while(Eat(','));
+            if(!Eat(']'))
+                return false;
+        }
+        depth--;
+        return true;
+    }
+    return SkipNumber();
+}
+
+template <class F>
+bool JsonScan::Members(F member)
+{
+    if(!Eat('{') || depth == MAX_DEPTH)
+        return false;
+    depth++;
+    if(Eat('}')) {
+        depth--;
+        return true;
+    }
+    do {
+        Ws();
+        const char *k = p;
+        if(!SkipString())
+            return false;
+        int kn = int(p - k) - 2;
+        if(!Eat(':'))
+            return false;
+        Ws();
+        const char *v = p;
+        if(!SkipValue() || !member(k + 1, kn, v, p))
+            return false;
+    }
+    while(Eat(','));
+    depth--;
+    return Eat('}');
+}
+
+bool Is(const char *k, int n, const char *name)
+{
+    return n == (int)strlen(name) && memcmp(k, name, n) == 0;
+}
+
+bool Str(const char *v, const char *ve, String& out) // a JSON string, unescaped
+{
+    if(*v != '"')
+        return false;
+    if(!memchr(v, '\\', ve - v)) {
+        out = String(v + 1, int(ve - v) - 2);
+        return true;
+    }
+    Value s = ParseJSON(String(v, ve));
+    out = s.ToString();
+    return IsString(s);
+}
+
+bool Number(const char *v, const char *ve, Value& out)
+{
+    out = ParseJSON(String(v, ve));
+    return IsNumber(out);
+}
+
+bool IsTrue(const char *v, const char *ve)
+{
+    return ve - v == 4 && memcmp(v, "true", 4) == 0;
+}
+
+}
+
+bool McpEnvelope::Parse(const char *text, int len)
+{
+    rpc = has_id = stream = false;
+    tool.Clear();
+    id = timeout_ms = Value();
+    args = nullptr;
+    args_len = 0;
+
+    String type, jsonrpc, method;
+    bool has_jsonrpc = false;
+    const char *params = nullptr, *params_end = nullptr;
+    JsonScan top(text, text + len);
+    bool ok = top.Members([&](const char *k, int n, const char *v, const char *ve) {
+        if(Is(k, n, "jsonrpc")) {
+            has_jsonrpc = true;
+            return Str(v, ve, jsonrpc);
+        }
+        if(Is(k, n, "type"))
+            return Str(v, ve, type);
+        if(Is(k, n, "method"))
+            return Str(v, ve, method);
+        if(Is(k, n, "id")) {
+            has_id = true;
+            id = ParseJSON(String(v, ve));
+            return !id.IsError();
+        }
+        if(Is(k, n, "params")) {
+            params = v;
+            params_end = ve;
+            return true;
+        }
+        // legacy call fields; a JSON-RPC call has them in params
+        if(Is(k, n, "tool"))
+            return Str(v, ve, tool);
+        if(Is(k, n, "args")) {
+            args = v;
+            args_len = int(ve - v);
+            return true;
+        }
+        if(Is(k, n, "stream")) {
+            stream = IsTrue(v, ve);
+            return true;
+        }
+        if(Is(k, n, "timeout_ms"))
+            return Number(v, ve, timeout_ms) || ParseJSON(String(v, ve)).IsVoid(); // null as if absent
+        return true;
+    }) && top.AtEnd();
+    if(!ok)
+        return false;
+    if(!has_jsonrpc)
+        return type == "tool_call" && tool.GetCount();
+
+    rpc = true;
+    if(jsonrpc != "2.0" || method != "tools/call" || !params || *params != '{')
+        return false;
+    tool.Clear();
+    args = nullptr;
+    args_len = 0;
+    stream = false;
+    timeout_ms = Value();
+    JsonScan sub(params, params_end);
+    ok = sub.Members([&](const char *k, int n, const char *v, const char *ve) {
+        if(Is(k, n, "name"))
+            return Str(v, ve, tool);
+        if(Is(k, n, "arguments")) {
+            args = v;
+            args_len = int(ve - v);
+            return true;
+        }
+        if(Is(k, n, "stream")) {
+            stream = IsTrue(v, ve);
+            return true;
+        }
+        if(Is(k, n, "timeout_ms"))
+            return Number(v, ve, timeout_ms) || ParseJSON(String(v, ve)).IsVoid();
+        return true;
+    }) && sub.AtEnd();
+    return ok && tool.GetCount();
+}
+
+Value McpEnvelope::GetArgs() const
+{
+    if(!args)
+        return ValueMap();
+    Value v = ParseJSON(String(args, args_len));
+    return rpc && v.IsVoid() ? Value(ValueMap()) : v; // "arguments": null counts as none
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <Core/Core.h>
+
+using namespace Upp;
+
+// Envelope of an MCP tool call, pulled out of the message text in one pass
+// without building a Value tree. Both shapes are recognised:
+//   {"type":"tool_call","tool":...,"args":{...}}                 (legacy)
+//   {"jsonrpc":"2.0","method":"tools/call","params":{"name":...,"arguments":{...}}}
+// Only the envelope strings are copied out; the arguments stay a span of the
+// original text until GetArgs() parses them, so the only Value built is theirs.
+struct McpEnvelope {
+    bool   rpc = false;
+    String tool;
+    Value  id;                // as sent; void when absent (legacy: no id, JSON-RPC: notification)
+    bool   has_id = false;
+    bool   stream = false;    // "stream": true
+    Value  timeout_ms;        // number as sent, void when absent
+
+    // false unless text is a well-formed single object of one of the shapes above
+    // with the fields typed as expected; the caller then takes the general path.
+    bool   Parse(const char *text, int len);
+    // The arguments object (an empty ValueMap when absent), or an error Value.
+    Value  GetArgs() const;
+
+private:
+    const char *args = nullptr;
+    int         args_len = 0;
+};
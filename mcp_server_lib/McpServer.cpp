@@ -1,4 +1,5 @@
 #include "../include/McpServer.h"
+#include "JsonEnvelope.h"
 #include <Core/Json.h>     // For ParseJSON, StoreAsJson
 #include <Core/ValueUtil.h>  // For AsJson, GetErrorText (Value::ToString for errors)
 
@@ -11,17 +12,41 @@ McpServer::McpServer(int initial_port, const String& initial_path_prefix)
     Log("McpServer object created. Initial port: " + AsString(serverPort) + ", path: " + this->ws_path_prefix);
 }
 McpServer::~McpServer() {
-    Log("McpServer destructor called."); if (is_listening) StopServer(); active_clients.Clear();
+    Log("McpServer destructor called."); if (is_listening) StopServer(); Mutex::Lock __(clients_lock); active_clients.Clear();
 }
+String McpServer::Brief(const Value& v) {
+    const int MAX_KEYS = 8, MAX_TEXT = 48;
+    if(IsString(v)) {
+        String s = v;
+        return s.GetCount() <= MAX_TEXT ? StoreAsJson(v, false) : StoreAsJson(Value(s.Left(MAX_TEXT)), false) + "... (" + AsString(s.GetCount()) + " bytes)";
+    }
+    if(v.Is<ValueMap>()) {
+        ValueMap m = v;
+        String r = "{";
+        for(int i = 0; i < m.GetCount() && i < MAX_KEYS; i++) {
+            const Value& x = m.GetValue(i);
+            r << (i ? ", " : "") << m.GetKey(i) << ": " << (x.Is<ValueMap>() ? String("{...}") : Brief(x)); // one level deep
+        }
+        if(m.GetCount() > MAX_KEYS)
+            r << ", ... (" << m.GetCount() << " keys)";
+        return r + "}";
+    }
+    if(v.Is<ValueArray>())
+        return "[" + AsString(v.GetCount()) + " items]";
+    return AsString(v);
+}
+
 void McpServer::Log(const String& message) { if (logCallback) logCallback(message); else RLOG("McpServer: " + message); }
-void McpServer::AddTool(const String& toolName, const ToolDefinition& toolDef) { allTools.GetAdd(toolName) = toolDef; Log("Tool added: " + toolName); }
-Vector<String> McpServer::GetAllToolNames() const { return allTools.GetKeys(); }
-void McpServer::EnableTool(const String& toolName) { if (allTools.FindPtr(toolName)) { enabledTools.Add(toolName); Log("Tool enabled: " + toolName); } else { Log("Warning: Attempt to enable non-existent tool: " + toolName); }}
-void McpServer::DisableTool(const String& toolName) { enabledTools.RemoveKey(toolName); Log("Tool disabled: " + toolName); }
-bool McpServer::IsToolEnabled(const String& toolName) const { return enabledTools.Find(toolName) >= 0; }
+void McpServer::AddTool(const String& toolName, const ToolDefinition& toolDef) { { RWMutex::WriteLock __(tools_lock); allTools.GetAdd(toolName) = toolDef; } InvalidateManifest(); Log("Tool added: " + toolName); }
+Vector<String> McpServer::GetAllToolNames() const { RWMutex::ReadLock __(tools_lock); return clone(allTools.GetKeys()); }
+void McpServer::EnableTool(const String& toolName) { bool found; { RWMutex::WriteLock __(tools_lock); found = allTools.FindPtr(toolName); if(found) enabledTools.FindAdd(toolName); } if(found) { InvalidateManifest(); Log("Tool enabled: " + toolName); } else Log("Warning: Attempt to enable non-existent tool: " + toolName); }
+void McpServer::DisableTool(const String& toolName) { { RWMutex::WriteLock __(tools_lock); enabledTools.RemoveKey(toolName); } InvalidateManifest(); Log("Tool disabled: " + toolName); }
+void McpServer::InvalidateManifest() { Mutex::Lock __(manifest_lock); manifest_text.Clear(); manifest_frame.Clear(); }
+bool McpServer::IsToolEnabled(const String& toolName) const { RWMutex::ReadLock __(tools_lock); return enabledTools.Find(toolName) >= 0; }
 
 Value McpServer::GetToolManifest() const {
     Log("GetToolManifest() constructing 'tools' ValueMap.");
+    RWMutex::ReadLock __(tools_lock);
     ValueMap tools_payload_map;
     for(const String& tool_name : enabledTools) {
         const ToolDefinition* def = allTools.FindPtr(tool_name);
@@ -35,13 +60,94 @@ Value McpServer::GetToolManifest() const {
     return Value(tools_payload_map);
 }
 
-Permissions& McpServer::GetPermissions() { return perms; }
-const Permissions& McpServer::GetPermissions() const { return perms; }
-Vector<String>& McpServer::GetSandboxRoots() { return sandboxRoots; }
-const Vector<String>& McpServer::GetSandboxRoots() const { return sandboxRoots; }
-void McpServer::AddSandboxRoot(const String& root) { String nr=NormalizePath(root); if(nr.IsEmpty())return; if(sandboxRoots.Find(nr)<0)sandboxRoots.Add(nr); Log("Sandbox root added: "+nr); }
-void McpServer::RemoveSandboxRoot(const String& root) { if(sandboxRoots.RemoveKey(NormalizePath(root)) > 0) Log("Sandbox root removed: "+NormalizePath(root));}
-void McpServer::EnforceSandbox(const String& path) const { if(sandboxRoots.IsEmpty()){Log("Warn: EnforceSandbox no roots for '"+path+"'.");return;} String np=NormalizePath(path); for(const String&r:sandboxRoots){if(PathUnderRoot(r,np))return;} throw Exc("Sandbox violation: Path '"+np+"' outside roots.");}
+Permissions McpServer::GetPermissions() const { RWMutex::ReadLock __(tools_lock); return perms; }
+void McpServer::SetPermissions(const Permissions& p) { RWMutex::WriteLock __(tools_lock); perms = p; }
+Vector<String> McpServer::GetSandboxRoots() const { RWMutex::ReadLock __(tools_lock); return clone(sandboxRoots); }
+void McpServer::SetSandboxRoots(const Vector<String>& roots) {
+    Vector<String> nrs;
+    for(const String& r : roots) { String nr=NormalizePath(r); if(nr.GetCount() && FindIndex(nrs, nr)<0) nrs.Add(nr); }
+    int n = nrs.GetCount();
+    { RWMutex::WriteLock __(tools_lock); sandboxRoots = pick(nrs); }
+    Log("Sandbox roots set: "+AsString(n));
+}
+void McpServer::AddSandboxRoot(const String& root) { String nr=NormalizePath(root); if(nr.IsEmpty())return; { RWMutex::WriteLock __(tools_lock); if(FindIndex(sandboxRoots, nr)<0)sandboxRoots.Add(nr); } Log("Sandbox root added: "+nr); }
+void McpServer::RemoveSandboxRoot(const String& root) { String nr=NormalizePath(root); int i; { RWMutex::WriteLock __(tools_lock); i=FindIndex(sandboxRoots, nr); if(i>=0)sandboxRoots.Remove(i); } if(i >= 0) Log("Sandbox root removed: "+nr);}
+void McpServer::EnforceSandbox(const String& path) const {
+    String np=NormalizePath(path);
+    {
+        RWMutex::ReadLock __(tools_lock);
+        if(sandboxRoots.GetCount()) { for(const String&r:sandboxRoots){if(PathUnderRoot(r,np))return;} throw Exc("Sandbox violation: Path '"+np+"' outside roots."); }
+    }
+    Log("Warn: EnforceSandbox no roots for '"+path+"'.");
+}
+
+#ifdef WS_URING
+static Upp::Ws::Uring *ThreadUring() { // one ring per thread running tools: a tool worker, or a reactor running them inline
+    thread_local Upp::Ws::Uring ring;
+    thread_local bool tried = false;
+    if(!tried) { tried = true; ring.Open(32); }
+    return ring.IsOpen() ? &ring : nullptr;
+}
+#endif
+
+static thread_local const CancelToken *tls_cancel;
+
+const CancelToken& McpServer::CurrentCancel() {
+    static CancelToken none;
+    return tls_cancel ? *tls_cancel : none;
+}
+
+static int TimeoutOf(const Value& v) { return v.IsNumber() ? (int)minmax((double)v, 0.0, 86400000.0) : 0; }
+
+String McpServer::ReadFile(const String& path) const {
+    CurrentCancel().Check(); // abandoned calls stop before their next file
+#ifdef WS_URING
+    if(Upp::Ws::Uring *ring = use_io_uring ? ThreadUring() : nullptr)
+        return ring->LoadFile(path);
+#endif
+    return LoadFile(path);
+}
+
+bool McpServer::WriteFile(const String& path, const String& data) const {
+    CurrentCancel().Check();
+#ifdef WS_URING
+    if(Upp::Ws::Uring *ring = use_io_uring ? ThreadUring() : nullptr)
+        return ring->SaveFile(path, data);
+#endif
+    return SaveFile(path, data);
+}
+
+int64 McpServer::StreamFile(const String& path, ToolSink& sink, int chunk) const {
+    CurrentCancel().Check();
+    FileIn in(path);
+    if(!in)
+        return -1;
+    int64 sent = 0;
+    String carry; // incomplete UTF-8 sequence at the end of the last chunk
+    while(!in.IsEof() && !in.IsError()) {
+        String data = carry + in.Get(chunk);
+        int n = data.GetCount(), k = n;
+        while(k > 0 && n - k < 3 && ((byte)data[k - 1] & 0xC0) == 0x80)
+            k--;
+        if(k > 0 && n - k < 3 && (byte)data[k - 1] >= 0xC0) { // lead byte: is its sequence whole?
+            int need = (byte)data[k - 1] >= 0xF0 ? 4 : (byte)data[k - 1] >= 0xE0 ? 3 : 2;
+            k = n - (k - 1) < need ? k - 1 : n;
+        }
+        else
+            k = n;
+        carry = data.Mid(k);
+        data.Trim(k);
+        if(data.GetCount() && !sink.Write(data)) {
+            CurrentCancel().Check();
+            return -1;
+        }
+        sent += data.GetCount();
+    }
+    if(carry.GetCount() && !sink.Write(carry))
+        return -1;
+    return in.IsError() ? -1 : sent + carry.GetCount();
+}
+
 bool McpServer::PathUnderRoot(const String&p,const String&c){String np=NormalizePath(p),nc=NormalizePath(c); if(nc==np)return true; String pp=np; if(pp.GetCount()>0&&pp.Last()!=DIR_SEPARATOR&&pp.Last()!='\\' && pp.Last()!='/')pp.Cat(DIR_SEPARATOR); return nc.StartsWith(pp);}
 
 void McpServer::ConfigureBind(bool all){if(is_listening){Log("Err: Bind change while running.");return;}bindAll=all;Log("BindAll: "+AsString(all));}
@@ -49,77 +155,650 @@ void McpServer::SetPort(uint16 port){if(is_listening){Log("Err: Port change whil
 void McpServer::SetPathPrefix(const String&path){if(is_listening){Log("Err: Path change while running.");return;}ws_path_prefix=path.StartsWith("/")?path:"/"+path;if(ws_path_prefix.GetCount()>1&&ws_path_prefix.EndsWith("/"))ws_path_prefix.TrimLast();Log("PathPrefix: "+ws_path_prefix);}
 void McpServer::SetTls(bool ut,const String&cp,const String&kp){if(is_listening){Log("Err: TLS change while running.");return;}use_tls=ut;tls_cert_path=cp;tls_key_path=kp;Log("TLS use: "+AsString(ut));}
 
-bool McpServer::StartServer(){if(is_listening){Log("Already running.");return true;}Log("Starting Ws::Server...");ws_server.WhenAccept=THISBACK(OnWsAccept);if(!ws_server.Listen(serverPort,ws_path_prefix,use_tls,tls_cert_path,tls_key_path)){Log("StartServer FAILED: Listen failed. SysErr: "+GetLastSystemError());is_listening=false;return false;}is_listening=true;Log("StartServer SUCCEEDED. Listening on "+AsString(serverPort)+ws_path_prefix);return true;}
-bool McpServer::StopServer(){if(!is_listening){Log("Not running.");return true;}Log("Stopping Ws::Server...");for(int i=0;i<active_clients.GetCount();i++){Upp::Ws::Endpoint*ep=active_clients.GetKey(i);if(ep&&!ep->IsClosed()){Log("Closing client: "+ep->GetSocket().GetPeerAddr());ep->Close(1001,"Server shutdown");}}active_clients.Clear();is_listening=false;Log("Server stopped. Pump should cease.");return true;}
-void McpServer::PumpEvents(){if(is_listening)ws_server.Pump();}
+void McpServer::SetDeflate(const Upp::Ws::DeflateOptions& o){if(is_listening){Log("Err: Compression change while running.");return;}deflate_opts=o;Log("permessage-deflate: "+AsString(o.enabled)+", window bits "+AsString(o.server_max_window_bits)+", min size "+AsString(o.min_size));}
+void McpServer::SetReactorThreads(int n){if(is_listening){Log("Err: Reactor thread change while running.");return;}reactor_threads=max(n,1);Log("Reactor threads: "+AsString(reactor_threads));}
+void McpServer::SetMaxMessageSize(int bytes){if(is_listening){Log("Err: Message size limit change while running.");return;}max_message=max(bytes,1024);Log("Max message size: "+AsString(max_message));}
+void McpServer::SetTimeouts(int hs, int ping, int pong, int idle){if(is_listening){Log("Err: Timeout change while running.");return;}handshake_timeout=max(hs,100);ping_interval=max(ping,0);pong_timeout=max(pong,100);idle_timeout=max(idle,0);Log("Timeouts (ms): handshake "+AsString(handshake_timeout)+", ping "+AsString(ping_interval)+", pong "+AsString(pong_timeout)+", idle "+AsString(idle_timeout));}
+void McpServer::SetUnixSocket(const String& p, bool oo){if(is_listening){Log("Err: Unix socket change while running.");return;}unix_socket_path=p;unix_owner_only=oo;Log("Unix socket: "+(p.IsEmpty()?String("off"):p));}
+void McpServer::SetAdmission(int mc, int mi, int ab){if(is_listening){Log("Err: Admission change while running.");return;}max_conns=max(mc,0);max_per_ip=max(mi,0);accept_batch=max(ab,1);Log("Admission: max "+AsString(max_conns)+" conns, "+AsString(max_per_ip)+" per address, "+AsString(accept_batch)+" accepts per pass");}
+void McpServer::SetWaterMarks(int high, int low){if(is_listening){Log("Err: Water mark change while running.");return;}high_water=max(high,4096);low_water=minmax(low,0,high_water);Log("Output water marks: "+AsString(high_water)+"/"+AsString(low_water));}
+void McpServer::SetToolThreads(int n){if(is_listening){Log("Err: Tool thread change while running.");return;}tool_threads=max(n,0);Log("Tool threads: "+AsString(tool_threads));}
+void McpServer::SetIoUring(bool on){if(is_listening){Log("Err: io_uring change while running.");return;}use_io_uring=on;Log("io_uring: "+AsString(on));}
+bool McpServer::IsIoUringActive() const{for(const auto& s:shards)if(s.IsIoUring())return true;return false;}
+int64 McpServer::GetQueuedBytes() const{int64 n=0;for(const auto& s:shards)n+=s.QueuedBytes();return n;}
+int McpServer::GetPausedClients() const{int n=0;for(const auto& s:shards)n+=s.PausedCount();return n;}
+int64 McpServer::GetWritesSaved() const{int64 n=0;for(const auto& s:shards)n+=s.WritesSaved();return n;}
+
+void McpServer::ConfigureShard(Upp::Ws::Server& shard, int i, int n) {
+    shard.WhenAccept = THISBACK(OnWsAccept);
+    shard.Deflate(deflate_opts);
+    shard.MaxMessageSize(max_message);
+    shard.WaterMarks(high_water, low_water);
+    // the global limit is split across shards, the per-address one applies per shard
+    shard.MaxConnections(max_conns ? max(max_conns / n + (i < max_conns % n), 1) : 0)
+         .MaxPerAddress(max_per_ip).AcceptBatch(accept_batch);
+    shard.IoUring(use_io_uring);
+    shard.HandshakeTimeout(handshake_timeout).KeepAlive(ping_interval, pong_timeout).IdleTimeout(idle_timeout);
+}
+
+bool McpServer::StartServer() {
+    if(is_listening){Log("Already running.");return true;}
+    int n = reactor_threads;
+#ifndef PLATFORM_LINUX
+    if(n > 1){Log("Warn: SO_REUSEPORT sharding needs Linux, using one reactor.");n = 1;}
+#endif
+    Log("Starting Ws::Server with "+AsString(n)+" reactor thread(s)...");
+    for(int i = 0; i < n; i++) {
+        Upp::Ws::Server& shard = shards.Add();
+        ConfigureShard(shard, i, n);
+        shard.ReusePort(n > 1);
+        if(!shard.Listen(serverPort,ws_path_prefix,use_tls,tls_cert_path,tls_key_path)) {
+            Log("StartServer FAILED: Listen failed on shard "+AsString(i)+". SysErr: "+GetLastSystemError());
+            shards.Clear();
+            return false;
+        }
+    }
+    if(!unix_socket_path.IsEmpty()) { // local agents, served by a reactor of its own
+        Upp::Ws::Server& local = shards.Add();
+        ConfigureShard(local, 0, 1);
+#ifdef PLATFORM_POSIX
+        if(unix_owner_only)
+            local.AllowUid(getuid());
+#endif
+        if(!local.ListenUnix(unix_socket_path, ws_path_prefix)) {
+            Log("StartServer FAILED: cannot listen on unix socket "+unix_socket_path+". SysErr: "+GetLastSystemError());
+            shards.Clear();
+            return false;
+        }
+        Log("Also listening on unix:"+unix_socket_path+(unix_owner_only?" (owner only)":""));
+    }
+    is_listening=true;
+    reactor_stop=false;
+    jobs_stop=false;
+    for(int i = 0; i < tool_threads; i++)
+        tool_workers.Add().Run([=]{ToolWorker();});
+    for(Upp::Ws::Server& shard : shards)
+        reactors.Add().Run([=, &shard]{ReactorLoop(shard);});
+    Log("StartServer SUCCEEDED. Listening on "+AsString(serverPort)+ws_path_prefix+(IsIoUringActive()?" (io_uring)":use_io_uring?" (io_uring unavailable, epoll only)":""));
+    return true;
+}
+
+bool McpServer::StopServer() {
+    if(!is_listening){Log("Not running.");return true;}
+    Log("Stopping Ws::Server...");
+    reactor_stop=true;
+    for(Upp::Ws::Server& shard : shards)
+        shard.Wake();
+    for(Thread& t : reactors)
+        t.Wait();
+    reactors.Clear();
+    { // running calls are told to stop and their replies are dropped
+        Mutex::Lock __(jobs_lock);
+        jobs_stop = true;
+        ready_light.Clear();
+        ready_clients.Clear();
+        blocked.Clear();
+        job_clients.Clear();
+        for(ToolJob *job : running_jobs)
+            job->cancel.Cancel();
+        jobs_cv.Broadcast();
+    }
+    for(Thread& t : tool_workers)
+        t.Wait();
+    tool_workers.Clear();
+    for(int i = 0; i < tool_stats.GetCount(); i++) {
+        ToolStats& st = tool_stats[i];
+        if(st.calls)
+            Log("Tool '" + tool_stats.GetKey(i) + "' queue wait: " + AsString(st.wait_ms / st.calls) + " ms avg, " + AsString(st.max_wait_ms) + " ms max over " + AsString(st.calls) + " calls");
+        st.running = st.queued = 0;
+    }
+    Log("Write syscalls saved by coalescing: " + AsString(GetWritesSaved()));
+    if(use_tls) {
+        int64 full = 0, resumed = 0;
+        for(const Upp::Ws::Server& shard : shards) { full += shard.TlsHandshakes(); resumed += shard.TlsResumed(); }
+        Log("TLS handshakes: " + AsString(full) + " full, " + AsString(resumed) + " resumed");
+    }
+    { Mutex::Lock __(clients_lock); active_clients.Clear(); }
+    shards.Clear();
+    is_listening=false;
+    Log("Server stopped.");
+    return true;
+}
+
+void McpServer::ReactorLoop(Upp::Ws::Server& shard) {
+    Log("Reactor thread started.");
+    while(!reactor_stop)
+        shard.Wait(-1); // sleeps until a socket is ready or StopServer() wakes us
+    shard.Shutdown(1001, "Server shutdown");
+    Log("Reactor thread finished.");
+}
+bool McpServer::CanStart(const ToolJob& job) const {
+    int limit = job.def.thread_safe ? job.def.max_concurrent : 1;
+    int k = tool_stats.Find(job.tool);
+    return limit <= 0 || k < 0 || tool_stats[k].running < limit;
+}
+
+void McpServer::Ready(JobQueue& q) {
+    if(q.light) {
+        ready_light.AddTail(&q);
+        return;
+    }
+    if(q.client->ready.IsEmpty())
+        ready_clients.AddTail(q.client);
+    q.client->ready.AddTail(&q);
+}
+
+McpServer::JobQueue *McpServer::NextJob() {
+    // Light tools jump ahead of everything else. Otherwise clients take turns,
+    // each taking turns among its tools. A queue whose tool is at its limit is
+    // parked until a call of that tool finishes, so no pick looks at it again.
+    auto Park = [&](JobQueue *q) {
+        if(CanStart(q->jobs.Head()))
+            return false;
+        blocked.GetAdd(q->tool).AddTail(q);
+        return true;
+    };
+    while(ready_light.GetCount()) {
+        JobQueue *q = ready_light.PopHead();
+        if(!Park(q))
+            return q;
+    }
+    while(ready_clients.GetCount()) {
+        ClientJobs *c = ready_clients.PopHead();
+        while(c->ready.GetCount()) {
+            JobQueue *q = c->ready.PopHead();
+            if(Park(q))
+                continue;
+            if(c->ready.GetCount())
+                ready_clients.AddTail(c);
+            return q;
+        }
+    }
+    return nullptr;
+}
+
+ValueMap McpServer::GetToolQueueStats() const {
+    Mutex::Lock __(jobs_lock);
+    ValueMap r;
+    for(int i = 0; i < tool_stats.GetCount(); i++) {
+        const ToolStats& st = tool_stats[i];
+        r.Add(tool_stats.GetKey(i), ValueMap("calls", st.calls)("avg_wait_ms", st.calls ? st.wait_ms / st.calls : 0)
+                                            ("max_wait_ms", st.max_wait_ms)("running", st.running)("queued", st.queued));
+    }
+    return r;
+}
+
+class McpServer::StreamSink : public ToolSink { // turns each chunk into a tool_chunk message
+public:
+    StreamSink(McpServer& server, const Ptr<Upp::Ws::Endpoint>& client, Upp::Ws::Server *shard, const CallRef& ref, const CancelToken& cancel)
+    : server(server), client(client), shard(shard), ref(ref), cancel(cancel) {}
+
+    bool Write(const String& chunk) override;
+
+private:
+    struct Window {
+        Mutex lock;
+        ConditionVariable cv;
+        int64 in_flight = 0;
+    };
+    McpServer& server;
+    Ptr<Upp::Ws::Endpoint> client;   // dereferenced only on the reactor thread, like ToolJob::client
+    Upp::Ws::Server *shard;          // nullptr: we are on the reactor thread, chunks go out directly
+    CallRef ref;
+    CancelToken cancel;
+    int seq = 0;
+    std::shared_ptr<Window> window = std::make_shared<Window>();
+};
+
+bool McpServer::StreamSink::Write(const String& chunk) {
+    // A chunk counts as in flight until the connection's output queue has drained to
+    // its low-water mark; the worker blocks while a window's worth is outstanding.
+    const int64 WINDOW = 1 << 20;
+    if(cancel.IsCancelled())
+        return false;
+    Value msg = ChunkMessage(ref, seq++, chunk);
+    if(msg.IsVoid())
+        return true;
+    if(!shard) {
+        if(!client)
+            return false;
+        server.SendJsonResponse(client, msg);
+        return !client->IsClosed();
+    }
+    int n = chunk.GetCount();
+    {
+        Mutex::Lock __(window->lock);
+        while(window->in_flight && window->in_flight + n > WINDOW) {
+            if(cancel.IsCancelled())
+                return false;
+            window->cv.Wait(window->lock, 100); // wakes up now and then to look at the token
+        }
+        window->in_flight += n;
+    }
+    std::shared_ptr<Window> w = window;
+    Ptr<Upp::Ws::Endpoint> ep = client;
+    McpServer *srv = &server;
+    shard->Post([=] {
+        Event<> release = [=] { Mutex::Lock __(w->lock); w->in_flight -= n; w->cv.Signal(); };
+        if(!ep) {
+            release();
+            return;
+        }
+        srv->SendJsonResponse(ep, msg);
+        ep->WhenDrained(release);
+    });
+    return true;
+}
+
+void McpServer::ToolWorker() {
+    for(;;) {
+        ToolJob job;
+        {
+            Mutex::Lock __(jobs_lock);
+            JobQueue *q = nullptr;
+            while(!jobs_stop && !(q = NextJob()))
+                jobs_cv.Wait(jobs_lock);
+            if(jobs_stop)
+                return;
+            job = pick(q->jobs.Head());
+            q->jobs.DropHead();
+            if(q->jobs.GetCount())
+                Ready(*q);
+            else {
+                ClientJobs *c = q->client;
+                c->tools.RemoveKey(job.tool);
+                if(c->tools.IsEmpty())
+                    job_clients.RemoveKey(job.owner);
+            }
+            ToolStats& st = tool_stats.GetAdd(job.tool);
+            int wait = msecs(job.queued_at);
+            st.queued--;
+            st.running++;
+            st.calls++;
+            st.wait_ms += wait;
+            st.max_wait_ms = max(st.max_wait_ms, wait);
+            running_jobs.Add(&job);
+        }
+        One<StreamSink> sink;
+        if(job.ref.stream && job.def.stream)
+            sink.Create(*this, job.client, job.shard, job.ref, job.cancel);
+        Value result;
+        bool ok = InvokeTool(job.tool, job.def, job.args, job.client_ip, job.cancel, ~sink, result);
+        Value response = job.ref.rpc && job.cancel.IsCancelled() && !job.cancel.IsExpired() ? Value() // MCP: a cancelled request gets no response
+                                                                                          : ToolReply(job.ref, ok, result);
+        {
+            Mutex::Lock __(jobs_lock);
+            running_jobs.Remove(FindIndex(running_jobs, &job));
+            tool_stats.GetAdd(job.tool).running--;
+            int k = blocked.Find(job.tool);
+            if(k >= 0 && blocked[k].GetCount()) { // one queue parked on this tool may go now
+                Ready(*blocked[k].PopHead());
+                jobs_cv.Signal();
+            }
+        }
+        Ptr<Upp::Ws::Endpoint> client = job.client;
+        CallRef ref = job.ref;
+        if(!response.IsVoid() || ref.batch)
+            job.shard->Post([=] { if(client) Answer(client, ref, response); });
+    }
+}
+
 void McpServer::SetLogCallback(std::function<void(const String&)> cb){logCallback=cb;}
 
 void McpServer::OnWsAccept(Upp::Ws::Endpoint& client_endpoint) {
-    String client_ip = client_endpoint.GetSocket().GetPeerAddr(); Log("OnWsAccept: New conn from " + client_ip);
-    active_clients.Add(&client_endpoint);
-    client_endpoint.WhenText = THISBACK2(OnWsText, &client_endpoint);
+    String client_ip = client_endpoint.IsUnixPeer() ? "unix uid " + AsString(client_endpoint.GetPeerUid()) + " pid " + AsString(client_endpoint.GetPeerPid())
+                                                    : client_endpoint.GetSocket().GetPeerAddr();
+    Log("OnWsAccept: New conn from " + client_ip + (client_endpoint.IsTlsResumed() ? " (TLS resumed)" : client_endpoint.IsTls() ? " (TLS)" : ""));
+    { Mutex::Lock __(clients_lock); active_clients.Add(&client_endpoint); }
+    Upp::Ws::Endpoint* ep = &client_endpoint;
+    client_endpoint.WhenTextView = [this, ep](const char* s, int n) { OnWsText(ep, s, n); };
     client_endpoint.WhenBinary = THISBACK2(OnWsBinary, &client_endpoint);
     client_endpoint.WhenClose = Gate<int, const String&>(THISBACK3(OnWsClientClose, &client_endpoint));
     client_endpoint.WhenError = THISBACK2(OnWsClientError, &client_endpoint);
-    ValueMap manifest_msg_map;
-    manifest_msg_map.Add("type", "manifest");
-    manifest_msg_map.Add("tools", GetToolManifest());
-    SendJsonResponse(&client_endpoint, Value(manifest_msg_map)); Log("Manifest sent to " + client_ip);
+    SendManifest(client_endpoint); Log("Manifest sent to " + client_ip);
+}
+
+void McpServer::SendManifest(Upp::Ws::Endpoint& client_endpoint) {
+    // Serialized and framed once per tool change, not per connection: the
+    // endpoints share the bytes, so a reconnect storm costs no JSON work.
+    String text, frame;
+    {
+        Mutex::Lock __(manifest_lock);
+        if(manifest_text.IsEmpty()) {
+            ValueMap manifest_msg_map;
+            manifest_msg_map.Add("type", "manifest");
+            manifest_msg_map.Add("tools", GetToolManifest());
+            manifest_text = StoreAsJson(Value(manifest_msg_map), false);
+            manifest_frame = Upp::Ws::Endpoint::PrepareText(manifest_text);
+        }
+        text = manifest_text;
+        frame = manifest_frame;
+    }
+    if(!client_endpoint.SendPrepared(text, frame)){Log("ERR: Manifest send failed to client "+client_endpoint.GetSocket().GetPeerAddr()+". SysErr: "+GetLastSystemError());Mutex::Lock __(clients_lock);active_clients.RemoveKey(&client_endpoint);}
 }
 
-void McpServer::OnWsText(Upp::Ws::Endpoint* client_endpoint, String msg) {
+void McpServer::OnWsText(Upp::Ws::Endpoint* client_endpoint, const char* msg, int len) {
     String client_ip = client_endpoint->GetSocket().GetPeerAddr();
-    Log("OnWsText from " + client_ip + ": " + msg);
-    ProcessMcpMessage(client_endpoint, msg);
+    // Only a preview: uploads can be many megabytes and the payload is parsed in place below.
+    Log("OnWsText from " + client_ip + " (" + AsString(len) + "B): " + String(msg, min(len, 256)) + (len > 256 ? "..." : ""));
+    ProcessMcpMessage(client_endpoint, msg, len);
 }
 
-void McpServer::ProcessMcpMessage(Upp::Ws::Endpoint* client_endpoint, const String& message_text) {
+void McpServer::ProcessMcpMessage(Upp::Ws::Endpoint* client_endpoint, const char* message_text, int len) {
     String client_ip = client_endpoint->GetSocket().GetPeerAddr();
+    McpEnvelope env; // tool calls skip the full parse, only their arguments become a Value
+    if(env.Parse(message_text, len)) {
+        Value args = env.GetArgs();
+        if(!args.IsError()) {
+            CallRef ref;
+            ref.rpc = env.rpc;
+            ref.notify = env.rpc && !env.has_id;
+            ref.id = env.id;
+            ref.stream = env.stream;
+            DispatchTool(client_endpoint, env.tool, args, client_ip, ref, TimeoutOf(env.timeout_ms));
+            return;
+        }
+    }
+    // everything else, and malformed calls (for the error reply), get the general path
     Value parsed_json = ParseJSON(message_text);
+    if(parsed_json.IsError() && String(message_text, len).Find("\"jsonrpc\"") >= 0){Log("JSON-RPC parse err from "+client_ip+": "+GetErrorText(parsed_json));SendJsonResponse(client_endpoint,ValueMap("jsonrpc","2.0")("id",Value())("error",ValueMap("code",-32700)("message","Parse error")));return;}
     if(parsed_json.IsError()){Log("JSON parse err from "+client_ip+": "+GetErrorText(parsed_json));SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Invalid JSON: "+GetErrorText(parsed_json))));return;}
+    if(parsed_json.Is<ValueArray>()){ProcessBatch(client_endpoint, parsed_json, true, false, client_ip);return;}
     if(!parsed_json.Is<ValueMap>()){Log("Invalid msg from "+client_ip+": not JSON object.");SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Payload must be JSON object.")));return;}
 
     ValueMap msg_map = parsed_json.Get<ValueMap>();
     String msgType = msg_map.Get("type", Value("")).ToString(); // Use Value("") as default for Get
 
+    if(msg_map.Find("jsonrpc") >= 0){ProcessRpc(client_endpoint, msg_map, client_ip);return;}
+
     if(msgType == "tool_call"){
         String toolName = msg_map.Get("tool", Value("")).ToString();
         if(toolName.IsEmpty()){Log("Tool call err from "+client_ip+": 'tool' missing.");SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","'tool' field missing.")));return;}
-
-        Value args_value = msg_map.Get("args", Value(ValueMap()));
-        // ToolFunc expects const Value& args, where args is expected to be a ValueMap by the tool logic.
-        // No need to check Is<ValueMap>() here if tools do it, but good for robustness.
-        if(!args_value.Is<ValueMap>()) {
-             Log("Tool call err from "+client_ip+" for '"+toolName+"': 'args' not ValueMap object.");
-             SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","'args' must be a JSON object.")));
-             return;
-        }
-
-        Log("Client "+client_ip+" tool '"+toolName+"' args: "+StoreAsJson(args_value, true));
-        const ToolDefinition* toolDefPtr = allTools.FindPtr(toolName);
-        if(!toolDefPtr){Log("Tool '"+toolName+"' not found. Req from "+client_ip);SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Tool '"+toolName+"' not found.")));return;}
-        if(!IsToolEnabled(toolName)){Log("Tool '"+toolName+"' not enabled. Req from "+client_ip);SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Tool '"+toolName+"' not enabled.")));return;}
-        if(!toolDefPtr->func){Log("CRITICAL: Tool '"+toolName+"' no func! Req from "+client_ip);SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Server Error: Tool '"+toolName+"' misconfigured.")));return;}
-        try{
-            Log("Executing tool '"+toolName+"' for "+client_ip);
-            Value result = toolDefPtr->func(args_value);
-            SendJsonResponse(client_endpoint, Value(ValueMap("type","tool_response")("result",result)));
-            Log("Tool '"+toolName+"' success for "+client_ip+". Result: "+StoreAsJson(result,true));
-        }catch(const Exc&e){Log("Tool '"+toolName+"' err(Exc) for "+client_ip+": "+e.ToString());SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message",e.ToString())));}
-        catch(const String&e_str){Log("Tool '"+toolName+"' err(String) for "+client_ip+": "+e_str);SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message",e_str)));}
-        catch(const std::exception&e_std){Log("Tool '"+toolName+"' err(std::exc) for "+client_ip+": "+e_std.what());SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message",String("StdExc: ")+e_std.what())));}
-        catch(...){Log("Tool '"+toolName+"' err(unknown) for "+client_ip);SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Unknown error in tool '"+toolName+"'.")));}
+        CallRef ref;
+        ref.id = msg_map["id"]; // optional, echoed in the reply and usable for cancel
+        ref.stream = msg_map["stream"] == Value(true);
+        DispatchTool(client_endpoint, toolName, msg_map.Get("args", Value(ValueMap())), client_ip, ref, TimeoutOf(msg_map["timeout_ms"]));
+    } else if(msgType == "cancel"){
+        CancelCalls(client_endpoint, msg_map["id"]);
+    } else if(msgType == "batch"){
+        Value calls = msg_map["calls"];
+        if(!calls.Is<ValueArray>() || !calls.GetCount()){Log("Batch err from "+client_ip+": 'calls' not a non-empty array.");SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","'calls' must be a non-empty array.")));return;}
+        ProcessBatch(client_endpoint, calls, false, msg_map["stream"] == Value(true), client_ip);
+    } else if(msgType == "shm_attach"){
+        // Local agents can move requests and responses onto shared-memory rings; the
+        // descriptors ride along with the shm_ready reply on the AF_UNIX socket.
+        int capacity = minmax((int)msg_map.Get("capacity", Value(1 << 20)), 1 << 16, 1 << 28);
+        if(client_endpoint->AttachShm(StoreAsJson(ValueMap("type","shm_ready"), false), capacity))
+            Log("Shared-memory transport attached for unix uid "+AsString(client_endpoint->GetPeerUid()));
+        else
+            SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Shared-memory transport needs a local (unix socket) connection.")));
     } else if(msgType.IsEmpty()){Log("Msg type missing from "+client_ip);SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","'type' field missing.")));}
     else {Log("Unknown msg type '"+msgType+"' from "+client_ip);SendJsonResponse(client_endpoint,Value(ValueMap("type","error")("message","Unknown type: "+msgType)));}
 }
 
-void McpServer::OnWsBinary(Upp::Ws::Endpoint*ep,String d){String cip=active_clients.Get(ep,"UnkIP");Log("Binary from "+cip+": "+AsString(d.GetCount())+"B.");}
-bool McpServer::OnWsClientClose(Upp::Ws::Endpoint*ep,int c,const String&r){String cip=active_clients.Get(ep,"UnkIP");Log("Client "+cip+" closed. Code:"+AsString(c)+", Reason:'"+r+"'");active_clients.RemoveKey(ep);return true;}
-void McpServer::OnWsClientError(Upp::Ws::Endpoint*ep,int ec){String cip=active_clients.Get(ep,"UnkIP");Log("Client err "+cip+". Code:"+AsString(ec)+". Sys:"+GetLastSystemError());active_clients.RemoveKey(ep);}
+void McpServer::ProcessBatch(Upp::Ws::Endpoint* client_endpoint, const ValueArray& calls, bool rpc, bool stream, const String& client_ip) {
+    // All items are queued in one go and fan out across the tool workers; the
+    // replies are gathered by slot and sent as one message (or streamed per item).
+    const int MAX_BATCH = 256;
+    if(calls.IsEmpty()) { // JSON-RPC: one error for the whole (empty) batch
+        CallRef ref;
+        ref.rpc = rpc;
+        SendCallError(client_endpoint, ref, -32600, "Invalid Request");
+        return;
+    }
+    if(calls.GetCount() > MAX_BATCH) {
+        Log("Batch of "+AsString(calls.GetCount())+" calls from "+client_ip+" refused.");
+        CallRef ref;
+        ref.rpc = rpc;
+        SendCallError(client_endpoint, ref, -32600, "Batch too large (max " + AsString(MAX_BATCH) + " calls).");
+        return;
+    }
+    Log("Client "+client_ip+" batch of "+AsString(calls.GetCount())+" calls.");
+    auto batch = std::make_shared<Batch>();
+    batch->replies.SetCount(calls.GetCount());
+    batch->pending = calls.GetCount();
+    batch->stream = stream;
+    for(int i = 0; i < calls.GetCount(); i++) {
+        CallRef ref;
+        ref.rpc = rpc;
+        ref.batch = batch;
+        ref.slot = i;
+        const Value& call = calls[i];
+        if(!call.Is<ValueMap>()){SendCallError(client_endpoint, ref, rpc ? -32600 : 0, rpc ? "Invalid Request" : "Batch item must be a JSON object.");continue;}
+        if(rpc){ProcessRpc(client_endpoint, call, client_ip, ref);continue;}
+        String toolName = call["tool"].ToString();
+        if(toolName.IsEmpty()){SendCallError(client_endpoint, ref, 0, "'tool' field missing.");continue;}
+        ref.stream = call["stream"] == Value(true);
+        Value args = call["args"];
+        DispatchTool(client_endpoint, toolName, args.IsVoid() ? Value(ValueMap()) : args, client_ip, ref, TimeoutOf(call["timeout_ms"]));
+    }
+}
+
+void McpServer::ProcessRpc(Upp::Ws::Endpoint* client_endpoint, const ValueMap& msg_map, const String& client_ip, CallRef ref) {
+    // JSON-RPC 2.0 as used by MCP. Requests carry an id and may be pipelined; each
+    // reply goes out when its call completes, so clients match them by id.
+    ref.rpc = true;
+    ref.notify = msg_map.Find("id") < 0;
+    ref.id = msg_map["id"];
+    String method = msg_map.Get("method", Value("")).ToString();
+    Value params = msg_map.Get("params", Value(ValueMap()));
+    if(msg_map["jsonrpc"].ToString() != "2.0" || method.IsEmpty()){SendCallError(client_endpoint, ref, -32600, "Invalid Request");return;}
+    if(method == "initialize"){
+        ValueMap info; info("name","upp-mcpserver")("version",MCP_SERVER_VERSION);
+        String version = params["protocolVersion"].ToString();
+        SendCallResult(client_endpoint, ref, ValueMap("protocolVersion", Nvl(version, String("2024-11-05")))
+                                                     ("capabilities", ValueMap("tools", ValueMap()))("serverInfo", info));
+    } else if(method == "tools/list"){
+        ValueMap manifest = GetToolManifest();
+        ValueArray tools;
+        for(int i = 0; i < manifest.GetCount(); i++) {
+            Value def = manifest.GetValue(i);
+            tools << ValueMap("name", manifest.GetKey(i))("description", def["description"])
+                             ("inputSchema", ValueMap("type","object")("properties", def["parameters"]));
+        }
+        SendCallResult(client_endpoint, ref, ValueMap("tools", tools));
+    } else if(method == "tools/call"){
+        String toolName = params["name"].ToString();
+        if(toolName.IsEmpty()){SendCallError(client_endpoint, ref, -32602, "'name' missing.");return;}
+        Value args = params["arguments"];
+        ref.stream = params["stream"] == Value(true);
+        DispatchTool(client_endpoint, toolName, args.IsVoid() ? Value(ValueMap()) : args, client_ip, ref, TimeoutOf(params["timeout_ms"]));
+    } else if(method == "ping"){
+        SendCallResult(client_endpoint, ref, ValueMap());
+    } else if(method.StartsWith("notifications/")){
+        if(method == "notifications/cancelled" && !params["requestId"].IsVoid())
+            CancelCalls(client_endpoint, params["requestId"]);
+        Answer(client_endpoint, ref, Value());
+    } else {Log("Unknown JSON-RPC method '"+method+"' from "+client_ip);SendCallError(client_endpoint, ref, -32601, "Method not found: "+method);}
+}
+
+void McpServer::DispatchTool(Upp::Ws::Endpoint* client_endpoint, const String& toolName, const Value& args_value, const String& client_ip, const CallRef& ref, int timeout_ms) {
+    // ToolFunc expects const Value& args, where args is expected to be a ValueMap by the tool logic.
+    if(!args_value.Is<ValueMap>()) {
+         Log("Tool call err from "+client_ip+" for '"+toolName+"': 'args' not ValueMap object.");
+         SendCallError(client_endpoint, ref, -32602, "'args' must be a JSON object.");
+         return;
+    }
+
+    Log("Client "+client_ip+" tool '"+toolName+"' args: "+Brief(args_value));
+    // Copy the definition out so AddTool/EnableTool on another thread cannot pull it from under us.
+    ToolDefinition toolDef;
+    bool found, enabled;
+    {
+        RWMutex::ReadLock __(tools_lock);
+        const ToolDefinition* p = allTools.FindPtr(toolName);
+        found = p;
+        if(p) toolDef = *p;
+        enabled = enabledTools.Find(toolName) >= 0;
+    }
+    if(!found){Log("Tool '"+toolName+"' not found. Req from "+client_ip);SendCallError(client_endpoint, ref, -32602, "Tool '"+toolName+"' not found.");return;}
+    if(!enabled){Log("Tool '"+toolName+"' not enabled. Req from "+client_ip);SendCallError(client_endpoint, ref, -32602, "Tool '"+toolName+"' not enabled.");return;}
+    CancelToken cancel; // the deadline counts from now, queueing included
+    cancel.SetTimeout(timeout_ms > 0 ? timeout_ms : toolDef.timeout_ms);
+    if(!toolDef.func && !toolDef.stream){Log("CRITICAL: Tool '"+toolName+"' no func! Req from "+client_ip);SendCallError(client_endpoint, ref, -32603, "Server Error: Tool '"+toolName+"' misconfigured.");return;}
+    if(!tool_workers.IsEmpty() && client_endpoint->GetServer()) {
+        // Off the reactor thread: the reply is posted back to it when the call is done.
+        Mutex::Lock __(jobs_lock);
+        ClientJobs& c = job_clients.GetAdd(client_endpoint);
+        JobQueue& q = c.tools.GetAdd(toolName);
+        ToolJob& job = q.jobs.AddTail();
+        job.tool = toolName;
+        job.def = pick(toolDef);
+        job.args = args_value;
+        job.ref = ref;
+        job.client = client_endpoint;
+        job.shard = client_endpoint->GetServer();
+        job.client_ip = client_ip;
+        job.queued_at = msecs();
+        job.cancel = cancel;
+        job.owner = client_endpoint;
+        tool_stats.GetAdd(toolName).queued++;
+        if(q.jobs.GetCount() == 1) { // a new queue: ready, or behind the ones already waiting for the tool
+            q.tool = toolName;
+            q.light = job.def.light;
+            q.client = &c;
+            int k = blocked.Find(toolName);
+            if(k >= 0 && blocked[k].GetCount())
+                blocked[k].AddTail(&q);
+            else
+                Ready(q);
+        }
+        jobs_cv.Signal();
+        return;
+    }
+    One<StreamSink> sink;
+    if(ref.stream && toolDef.stream)
+        sink.Create(*this, Ptr<Upp::Ws::Endpoint>(client_endpoint), nullptr, ref, cancel);
+    Value result;
+    bool ok = InvokeTool(toolName, toolDef, args_value, client_ip, cancel, ~sink, result);
+    Answer(client_endpoint, ref, ToolReply(ref, ok, result));
+}
+
+bool McpServer::InvokeTool(const String& toolName, const ToolDefinition& def, const Value& args_value, const String& client_ip, const CancelToken& cancel, ToolSink *sink, Value& result) {
+    if(cancel.IsCancelled()) { // while it was queued
+        result = cancel.IsExpired() ? "Deadline exceeded before '"+toolName+"' could start." : String("Cancelled.");
+        Log("Tool '"+toolName+"' for "+client_ip+" dropped: "+result.ToString());
+        return false;
+    }
+    bool ok = false;
+    tls_cancel = &cancel;
+    try{
+        Log("Executing tool '"+toolName+"' for "+client_ip);
+        if(sink)
+            result = def.stream(args_value, *sink);
+        else if(def.func)
+            result = def.func(args_value);
+        else { // a streaming-only tool called the plain way: the chunks become the result
+            struct : ToolSink { StringBuffer out; bool Write(const String& s) override { out.Cat(s); return true; } } join;
+            def.stream(args_value, join);
+            result = String(join.out);
+        }
+        Log("Tool '"+toolName+"' success for "+client_ip+". Result: "+Brief(result));
+        ok = true;
+    }catch(const Exc&e){Log("Tool '"+toolName+"' err(Exc) for "+client_ip+": "+e.ToString());result=e.ToString();}
+    catch(const String&e_str){Log("Tool '"+toolName+"' err(String) for "+client_ip+": "+e_str);result=e_str;}
+    catch(const std::exception&e_std){Log("Tool '"+toolName+"' err(std::exc) for "+client_ip+": "+e_std.what());result=String("StdExc: ")+e_std.what();}
+    catch(...){Log("Tool '"+toolName+"' err(unknown) for "+client_ip);result="Unknown error in tool '"+toolName+"'.";}
+    tls_cancel = nullptr;
+    return ok;
+}
+
+void McpServer::CancelCalls(const Upp::Ws::Endpoint* ep, const Value& id) {
+    // Queued calls are dropped when their turn comes, running ones stop at their next poll.
+    Mutex::Lock __(jobs_lock);
+    int n = 0;
+    auto Cancel = [&](const ToolJob& job) {
+        if(job.owner == ep && (id.IsVoid() || job.ref.id == id) && !job.cancel.IsCancelled()) {
+            job.cancel.Cancel();
+            n++;
+        }
+    };
+    int k = job_clients.Find(ep);
+    if(k >= 0)
+        for(const JobQueue& q : job_clients[k].tools)
+            for(int i = 0; i < q.jobs.GetCount(); i++)
+                Cancel(q.jobs[i]);
+    for(const ToolJob *job : running_jobs)
+        Cancel(*job);
+    if(n)
+        Log("Cancelled " + AsString(n) + " tool call(s)" + (id.IsVoid() ? String() : " with id " + StoreAsJson(id, false)));
+}
+
+Value McpServer::ToolReply(const CallRef& ref, bool ok, const Value& result) {
+    if(!ref.rpc && ref.batch)
+        return ok ? ValueMap("result",result) : ValueMap("error",result);
+    if(!ref.rpc) {
+        ValueMap r = ok ? ValueMap("type","tool_response")("result",result) : ValueMap("type","error")("message",result);
+        if(!ref.id.IsVoid())
+            r.Add("id", ref.id);
+        return r;
+    }
+    if(ref.notify)
+        return Value();
+    // MCP reports tool failures as a result with isError, JSON-RPC errors are for the protocol
+    String text = IsString(result) ? result.ToString() : StoreAsJson(result, false);
+    return ValueMap("jsonrpc","2.0")("id",ref.id)("result", ValueMap("content", ValueArray() << ValueMap("type","text")("text",text))("isError",!ok));
+}
+
+Value McpServer::ChunkMessage(const CallRef& ref, int seq, const String& data) {
+    if(ref.rpc)
+        return ref.notify ? Value() : Value(ValueMap("jsonrpc","2.0")("method","notifications/tool_chunk")("params", ValueMap("requestId",ref.id)("seq",seq)("data",data)));
+    ValueMap m("type", "tool_chunk");
+    m("seq", seq)("data", data);
+    if(ref.batch)
+        m("index", ref.slot);
+    if(!ref.id.IsVoid())
+        m("id", ref.id);
+    return m;
+}
+
+void McpServer::SendCallResult(Upp::Ws::Endpoint* ep, const CallRef& ref, const Value& result) {
+    Answer(ep, ref, ref.notify ? Value() : Value(ValueMap("jsonrpc","2.0")("id",ref.id)("result",result)));
+}
+
+void McpServer::SendCallError(Upp::Ws::Endpoint* ep, const CallRef& ref, int code, const String& message) {
+    if(!ref.rpc) Answer(ep, ref, ref.batch ? ValueMap("error",message) : ref.id.IsVoid() ? ValueMap("type","error")("message",message) : ValueMap("type","error")("message",message)("id",ref.id));
+    else Answer(ep, ref, ref.notify ? Value() : Value(ValueMap("jsonrpc","2.0")("id",ref.id)("error",ValueMap("code",code)("message",message))));
+}
+
+void McpServer::Answer(Upp::Ws::Endpoint* ep, const CallRef& ref, const Value& reply) {
+    if(!ref.batch) {
+        if(!reply.IsVoid())
+            SendJsonResponse(ep, reply);
+        return;
+    }
+    Batch& b = *ref.batch;
+    if(b.stream) {
+        ValueMap item("type", "batch_item");
+        item("index", ref.slot);
+        ValueMap r = reply;
+        for(int i = 0; i < r.GetCount(); i++)
+            item(r.GetKey(i), r.GetValue(i));
+        SendJsonResponse(ep, item);
+    }
+    else
+        b.replies[ref.slot] = reply;
+    if(--b.pending)
+        return;
+    if(b.stream) {
+        SendJsonResponse(ep, ValueMap("type","batch_done")("count",b.replies.GetCount()));
+        return;
+    }
+    ValueArray all;
+    for(const Value& r : b.replies)
+        if(!r.IsVoid()) // JSON-RPC notifications have no reply; an all-notification batch sends nothing
+            all.Add(r);
+    if(all.GetCount())
+        SendJsonResponse(ep, ref.rpc ? Value(all) : Value(ValueMap("type","batch_response")("results",all)));
+}
+
+void McpServer::OnWsBinary(Upp::Ws::Endpoint*ep,String d){String cip=ep->GetSocket().GetPeerAddr();Log("Binary from "+cip+": "+AsString(d.GetCount())+"B.");}
+bool McpServer::OnWsClientClose(Upp::Ws::Endpoint*ep,int c,const String&r){String cip=ep->GetSocket().GetPeerAddr();Log("Client "+cip+" closed. Code:"+AsString(c)+", Reason:'"+r+"'");CancelCalls(ep);Mutex::Lock __(clients_lock);active_clients.RemoveKey(ep);return true;}
+void McpServer::OnWsClientError(Upp::Ws::Endpoint*ep,int ec){String cip=ep->GetSocket().GetPeerAddr();Log("Client err "+cip+". Code:"+AsString(ec)+". Sys:"+GetLastSystemError());CancelCalls(ep);Mutex::Lock __(clients_lock);active_clients.RemoveKey(ep);}
 
 void McpServer::SendJsonResponse(Upp::Ws::Endpoint* client, const Value& jsonData) {
-    if(!client||client->IsClosed()){Log("SendJsonResponse: Client null/closed.");if(client)active_clients.RemoveKey(client);return;}
+    if(!client||client->IsClosed()){Log("SendJsonResponse: Client null/closed.");if(client){Mutex::Lock __(clients_lock);active_clients.RemoveKey(client);}return;}
     String json_text = StoreAsJson(jsonData, false);
     // Log("Sending to client "+client->GetSocket().GetPeerAddr()+": "+json_text); // Verbose
-    if(!client->SendText(json_text)){Log("ERR: SendText failed to client "+client->GetSocket().GetPeerAddr()+". SysErr: "+GetLastSystemError());active_clients.RemoveKey(client);}
+    if(!client->SendText(json_text)){Log("ERR: SendText failed to client "+client->GetSocket().GetPeerAddr()+". SysErr: "+GetLastSystemError());Mutex::Lock __(clients_lock);active_clients.RemoveKey(client);}
 }
@@ -2,39 +2,341 @@
 #pragma once
 #include <Core/Core.h>
 #include <Core/SSL/SSL.h>        // only used if TLS requested
+#include <openssl/ssl.h>          // server side TLS drives OpenSSL (linked by Core/SSL) directly
+#include <openssl/err.h>
+#include <plugin/z/lib/zlib.h>    // zlib bundled with U++ (behind Core's Zlib/GZCompress), for permessage-deflate
+#include <atomic>
+
+#ifdef PLATFORM_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#endif
+#define WS_URING
+#endif
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WS_MASK_X86
+#endif
 
 namespace Upp { // Assuming Upp namespace was intended for Frame, Endpoint, Server, Client
 namespace Ws {
 
+// -------------------- byte ring ----------------------------------
+// Growable ring buffer with O(1) Consume(). Capacity is always a power of two.
+// Peek()/GetWriteSpace() rotate the data to the front only when the requested
+// range wraps, which happens at most once per capacity's worth of traffic.
+class ByteRing {
+public:
+    int    GetCount() const    { return count; }
+    bool   IsEmpty() const     { return count == 0; }
+    int    GetCapacity() const { return cap; }
+
+    void        Put(const void *data, int n);
+    byte       *GetWriteSpace(int min_free, int& len); // contiguous free space, >= min_free
+    void        Commit(int n)  { ASSERT(count + n <= cap); count += n; }
+    byte       *Peek(int n);                          // contiguous view of the first n bytes
+    byte       *PeekZ(int n);                         // same, plus one addressable byte past the range
+    int         GetChunk(const byte *& ptr) const;    // first contiguous run of data
+    void        Consume(int n);
+    void        Clear()        { head = count = 0; }
+    void        Shrink();                             // drop storage of an idle, oversized ring
+
+private:
+    Buffer<byte> buf;
+    int          cap = 0;
+    int          head = 0;
+    int          count = 0;
+
+    int   Tail() const         { return (head + count) & (cap - 1); }
+    void  Reserve(int free);
+    void  Linearize();
+};
+
+// -------------------- outbound segment queue ---------------------
+// Bytes waiting to be written, kept as a list of ref-counted Strings. Frame
+// headers and payloads stay separate segments (payloads share the caller's
+// buffer), and Gather() hands them to writev without concatenating them first.
+// Tiny segments are merged into the tail so a burst of small frames stays cheap.
+class OutQueue {
+public:
+    int64  GetCount() const   { return bytes; }
+    bool   IsEmpty() const    { return bytes == 0; }
+
+    void   Add(const String& s);
+    int    GetChunk(const byte *& ptr) const;     // first contiguous run of data
+#ifdef PLATFORM_LINUX
+    int    Gather(iovec *iov, int max) const;     // fills iovecs, returns count
+#endif
+    int    Copy(byte *dst, int n) const;          // first n bytes across segments, not consumed
+    void   Consume(int64 n);
+    void   Clear()            { segs.Clear(); offset = 0; bytes = 0; }
+
+private:
+    BiVector<String> segs;
+    int              offset = 0;  // already written part of segs.Head()
+    int64            bytes = 0;
+};
+
+// -------------------- payload masking ----------------------------
+// XORs n bytes with the 4-byte WebSocket mask key. The widest kernel the CPU
+// supports (AVX2, SSE2, or a 64-bit scalar loop) is picked once at first use.
+inline void MaskBytes(byte *data, int n, const byte key[4]);
+
+// -------------------- permessage-deflate (RFC 7692) --------------
+struct DeflateOptions {
+    bool enabled = false;
+    bool server_no_context_takeover = false;
+    bool client_no_context_takeover = false;
+    int  server_max_window_bits = 15; // 9..15; zlib cannot produce raw deflate with 8
+    int  client_max_window_bits = 15;
+    int  min_size = 256;              // smaller messages go out uncompressed
+    int  level = Z_DEFAULT_COMPRESSION;
+
+    // Server side: picks the first acceptable offer from Sec-WebSocket-Extensions,
+    // fills the agreed parameters and the response header value.
+    bool Negotiate(const String& offers, DeflateOptions& agreed, String& response) const;
+    String Offer() const;                                    // client request header value
+    bool Accept(const String& response, DeflateOptions& agreed) const; // client side
+};
+
+// z_streams are expensive to set up (a deflater with a 32 KB window is ~256 KB),
+// so endpoints borrow them from a process-wide pool and give them back reset.
+class ZPool {
+public:
+    static z_stream *GetDeflater(int window_bits, int level);
+    static z_stream *GetInflater();
+    static void      Release(z_stream *z, bool deflater, int window_bits = 15, int level = 0);
+
+private:
+    static Mutex& Lock()                               { static Mutex m; return m; }
+    static VectorMap<int, Vector<z_stream *>>& Free()  { static VectorMap<int, Vector<z_stream *>> m; return m; }
+};
+
+// -------------------- timer wheel --------------------------------
+// Hierarchical timing wheel: 4 levels of 64 slots over 64 ms ticks, spanning about
+// twelve days. Scheduling and cancelling are O(1) list operations; Advance() visits
+// one slot per elapsed tick and moves a higher level slot down once per 64 ticks
+// of the level below. Timers are intrusive nodes; destroying one cancels it.
+class TimerWheel {
+public:
+    struct Node {
+        Node *prev = NULL;
+        Node *next = NULL;
+        int64 tick = 0;
+        void *data = NULL;            // whatever the owner needs in the callback
+
+        bool  IsScheduled() const     { return next; }
+        void  Cancel();
+        Node() = default;
+        ~Node()                       { Cancel(); }
+        Node(const Node&) = delete;
+        Node& operator=(const Node&) = delete;
+    };
+
+    void  Schedule(Node& n, int delay_ms, int now = msecs()); // reschedules if already pending
+    template <class F>
+    void  Advance(int now, F fire);   // fire(Node&) for every timer that is due
+    int   GetTimeout(int now = msecs()) const; // ms until the next timer may fire, -1 if none
+
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+private:
+    enum { BITS = 6, SLOTS = 1 << BITS, LEVELS = 4, TICK_MS = 64 };
+    Node  slot[LEVELS][SLOTS];        // circular list heads
+    int64 cur = 0;                    // last processed tick
+    int64 ms = 0;                     // wheel time, advanced by msecs() deltas (wrap safe)
+    int   last_now;
+
+    int64 Now(int now) const          { return ms + (int)((dword)now - (dword)last_now); }
+    void  Link(Node& n);
+    static void Splice(Node& from, Node& to);
+};
+
+// -------------------- shared-memory channel ----------------------
+#ifdef PLATFORM_LINUX
+// Two single-producer/single-consumer rings in a memfd, one per direction, for
+// clients on the same host. Records are a 32-bit length plus payload, 8-byte
+// aligned, never split at the end of the ring (a pad marker skips to the start).
+// Each side owns an eventfd; it is written only when the other side announced
+// that it is about to sleep (Sleep()) or found the ring full, so a busy pair
+// exchanges messages without any system call.
+class ShmChannel {
+public:
+    bool   Create(int capacity);      // server side: new memfd and eventfds, capacity rounded to 2^n
+    bool   Attach(int memfd, int server_efd, int client_efd); // client side, takes the descriptors
+    void   GetFds(Vector<int>& fds) const; // the three descriptors Attach() wants, in order
+    int    GetEventFd() const         { return own_efd; }
+    int    GetMaxMessage() const      { return capacity / 2 - 8; }
+
+    bool   Send(const void *data, int len); // false if it does not fit now (peer is asked to wake us)
+    void   Notify();                  // after Send()s: wakes the peer if it sleeps
+    bool   Receive(String& msg);      // false if empty, or if the ring is corrupt (IsBroken())
+    bool   IsBroken() const           { return broken; } // the peer wrote garbage, drop the channel
+    bool   HasInput() const;
+    bool   Sleep();                   // false if input arrived meanwhile; otherwise wait on GetEventFd()
+    void   Awake();                   // consumes the wake-up
+
+    ShmChannel() = default;
+    ~ShmChannel();
+
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+
+private:
+    enum { MAGIC = 0x57534d31, PAD = 0xffffffff, DATA = 4096 };
+    struct Ring {
+        alignas(64) std::atomic<uint32> head;     // consumer position
+        alignas(64) std::atomic<uint32> tail;     // producer position
+        alignas(64) std::atomic<uint32> sleeping; // consumer waits on its eventfd
+        std::atomic<uint32> blocked;              // producer waits for room
+    };
+    struct Header {
+        uint32 magic;
+        uint32 capacity;
+        Ring   ring[2];                           // [0] client -> server, [1] server -> client
+    };
+
+    byte   *base = NULL;
+    int64   size = 0;
+    uint32  capacity = 0;
+    Ring   *tx = NULL, *rx = NULL;
+    byte   *tx_data = NULL, *rx_data = NULL;
+    int     memfd = -1, own_efd = -1, peer_efd = -1;
+    bool    notify = false;
+    bool    broken = false;
+
+    bool    Map(int fd, bool server);
+    bool    Corrupt()                 { broken = true; return false; }
+    void    Signal(int efd)           { uint64 one = 1; (void)!write(efd, &one, sizeof(one)); }
+};
+#endif
+
+// -------------------- io_uring ----------------------------------
+#ifdef WS_URING
+// Minimal io_uring driver on the raw system calls. The reactor hands it the recv
+// and send of every ready endpoint so a Wait() costs one io_uring_enter for each
+// instead of one syscall per socket; LoadFile/SaveFile keep several chunks in
+// flight. Open() fails where io_uring is missing or filtered (old kernels,
+// seccomp profiles) and callers carry on with plain system calls.
+class Uring {
+public:
+    bool   Open(int entries = 256);
+    void   Close();
+    bool   IsOpen() const                 { return fd >= 0; }
+
+    io_uring_sqe *GetSqe();               // zeroed, NULL if the submission queue is full
+    bool   Run(int count);                // submits the prepared entries, waits for `count` completions
+    template <class F>
+    void   Reap(F done);                  // done(user_data, res) for every completion
+
+    String LoadFile(const char *path);    // void String on failure
+    bool   SaveFile(const char *path, const String& data);
+
+    Uring() = default;
+    ~Uring()                              { Close(); }
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+private:
+    int       fd = -1;
+    byte     *sq_map = NULL, *cq_map = NULL;
+    size_t    sq_size = 0, cq_size = 0, sqes_size = 0;
+    io_uring_sqe *sqes = NULL;
+    io_uring_cqe *cqes = NULL;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned  sq_entries = 0;
+    unsigned  tail = 0;                   // ours, published by Run()
+    unsigned  unsubmitted = 0;
+
+    int64     Transfer(int file, byte *data, int64 len, bool write); // bytes done, -1 on error
+};
+#endif
+
+// -------------------- TLS ---------------------------------------
+// Server certificates get one SSL_CTX per cert/key pair for the life of the
+// process. All listeners share it, so its session cache and ticket keys let a
+// reconnecting client resume on whichever shard accepts it.
+struct TlsContext {
+    static SSL_CTX *Get(const String& cert_path, const String& key_path); // NULL if unusable
+};
+
 // -------------------- low-level frame ----------------------------
 struct Frame {
     enum OPC : byte { CONT=0, TEXT=1, BINARY=2, CLOSE=8, PING=9, PONG=0xA };
     bool  fin   = true;
+    bool  rsv1  = false;         // permessage-deflate: payload is compressed
     byte  opcode= TEXT;
+    bool  masked = false;
     int   len   = 0;             // payload size
     byte  mask_key[4] = {0,0,0,0}; // Initialized
     String payload;
 
     String  Encode(bool mask);        // build raw bytes (mask=true for client)
+    String  EncodeHeader(bool mask);  // header only, mask key included; payload left to the caller
     bool    Decode(const void* buf,int sz,int& used,bool expect_mask);
+    // Parses only the header (fields above, not payload). Returns its size,
+    // 0 if more bytes are needed, -1 if the frame is unacceptable.
+    int     DecodeHeader(const byte* b, int sz);
+    void    Unmask(byte* data, int n, int offset = 0) const; // offset: position within the payload
 };
 
 // -------------------- endpoint base ------------------------------
-class Endpoint {
+class Server;
+
+class Endpoint : public Pte<Endpoint> {
 public:
     Event<String> WhenText;
     Event<String> WhenBinary;
+    // Zero-copy alternatives; when set they take precedence over WhenText/WhenBinary.
+    // The payload points into the receive buffer, already unmasked and NUL-terminated
+    // in place, and is valid only for the duration of the call.
+    Event<const char*, int> WhenTextView;
+    Event<const char*, int> WhenBinaryView;
+    // Fragmented messages are reassembled (up to MaxMessageSize, beyond that the
+    // endpoint closes with 1009). With WhenFragment set, data is streamed instead:
+    // each fragment, and each chunk of a large frame, is handed over as soon as it
+    // is read (inflated if compressed). Args: message opcode, data, length, last piece.
+    Event<int, const char*, int, bool> WhenFragment;
     Gate2<int,const String&> WhenClose;   // return false to veto close
     Event<int>    WhenError; // Parameter is error code
 
     // outbound
-    void  SendText(const String&);
-    void  SendBinary(const void*,int);
+    // The payload String is shared, not copied, on the server side; false if closed
+    bool  SendText(const String&);
+    bool  SendBinary(const String&);
+    bool  SendBinary(const void*,int);
+    // A message many endpoints send alike (e.g. a greeting) can be framed once with
+    // PrepareText and the frame shared; endpoints whose frames differ (client side,
+    // compressing, shared memory) encode `text` as usual instead.
+    static String PrepareText(const String& text);
+    bool  SendPrepared(const String& text, const String& frame);
     void  Close(int code=1000,const String&reason=""); // Added default for reason
     bool  IsClosed() const { return closed; }
 
-    // must be called from owner loop
+    // must be called from owner loop (polled clients; Server drives its endpoints itself)
     bool  Pump();                     // returns false on fatal error
+    bool  HasPending() const { return !outbuf.IsEmpty(); }
 
     // stats
     uint64  TxBytes() const { return tx_bytes; }
@@ -43,25 +345,125 @@ public:
     // Access to underlying socket for IP Address etc.
     const TcpSocket& GetSocket() const { return sock; } // Added for IP Addr
 
+    // permessage-deflate: options to offer/accept before the handshake, agreed ones after
+    Endpoint& Deflate(const DeflateOptions& o) { deflate = o; return *this; }
+    Endpoint& MaxMessageSize(int bytes)        { max_message = bytes; return *this; }
+    bool      IsDeflating() const              { return deflate_on; }
+
+    // Backpressure: once more than `high` bytes of output are queued the endpoint
+    // stops reading (and so dispatching requests) until the queue drains to `low`.
+    Endpoint& WaterMarks(int high, int low)    { high_water = high; low_water = min(low, high); return *this; }
+    int       QueueDepth() const               { return outbuf.GetCount(); }
+    bool      IsPaused() const                 { return paused; }
+    // Runs fn once queued output is down to the low-water mark (right away if it
+    // already is, or when the endpoint goes away). Owner thread only.
+    void      WhenDrained(Event<> fn);
+
+    bool      IsTls() const                    { return tls || ssl_sock; }
+    bool      IsUnixPeer() const               { return peer_uid >= 0; }
+    Server   *GetServer() const                { return owner; } // server side: the reactor to Post() to
+    int       GetPeerUid() const               { return peer_uid; } // SO_PEERCRED, -1 if not local
+    int       GetPeerPid() const               { return peer_pid; }
+    bool      IsTlsResumed() const             { return tls && SSL_session_reused(tls); } // abbreviated handshake
+
+    // Server side, AF_UNIX peers (Linux): creates a ShmChannel and sends `ready`, a
+    // text message announcing it, together with its descriptors. From then on text
+    // messages go through the rings both ways; ones too big for them still use the socket.
+    bool      AttachShm(const String& ready, int capacity = 1 << 20);
+    bool      IsShm() const;
+
+    Endpoint() = default;
+    ~Endpoint();
+
 protected:
+    friend class Server;
+
     TcpSocket sock;
-    Buffer<byte> inbuf, outbuf; // Consider initializing size in constructor
+    ByteRing  inbuf;
+    OutQueue  outbuf;
     bool   masked  = false;           // true for client→server frames
     bool   closed  = false;
-    Time   last_ping; // Should be initialized
     uint64 tx_bytes = 0; // Initialize
     uint64 rx_bytes = 0; // Initialize
-
-
-    Endpoint() : last_ping(Time::Low()) {} // Constructor to init last_ping, potentially buffer sizes
-
-    bool   HandshakeServer(const HttpHeader& h);
+    Server *owner = NULL;             // set for server-side endpoints
+    bool   reported = false;          // WhenClose/WhenError already told the owner
+    int    close_code = 1006;
+    int    max_message = 64 << 20;
+    int    high_water = 4 << 20;
+    int    low_water = 1 << 20;
+    bool   paused = false;            // over the high-water mark, input is left in the kernel
+    bool   dirty = false;             // in owner's flush list
+    bool   dying = false;             // in owner's list of endpoints to reap
+    bool   rx_listed = false;         // in owner's list of endpoints to read again next pass
+    int    slot = -1;                 // index in owner's clients, so reaping needs no search
+    int    frames_pending = 0;        // frames (or HTTP responses) queued since the last flush
+    Vector<Event<>> drained;          // WhenDrained callbacks waiting for the queue to shrink
+    String peer_key;                  // server side: address counted in owner's per-address limit
+    int    reject = 0;                // HTTP status to answer the upgrade with (admission control)
+    int    peer_uid = -1;             // AF_UNIX peer credentials, -1 for network peers
+    int    peer_pid = 0;              // SO_PEERCRED pid of AF_UNIX peers, 0 for TCP
+    int    msg_opcode = 0;            // TEXT/BINARY of the message being received, 0 between messages
+    bool   msg_deflated = false;
+    int64  msg_size = 0;              // wire bytes, or inflated bytes for compressed messages
+    String msg_buf;                   // reassembly buffer when not streaming
+    Frame  stream_frame;              // data frame being streamed to WhenFragment in chunks
+    int    stream_left = 0;
+    int    stream_pos = 0;
+    bool   handshaking = false;       // server side: upgrade request not complete yet
+    int    hs_scanned = 0;            // request bytes already searched for the blank line
+    int    hs_deadline = 0;           // msecs() by which the TLS and HTTP handshakes must be done
+    TimerWheel::Node timer;           // server side: handshake, keepalive and idle deadlines
+    int    last_rx = 0;               // msecs() of the last bytes received
+    int    last_data = 0;             // ... and of the last data frame
+    int    ping_sent = 0;
+    bool   ping_out = false;          // no traffic since ping_sent yet
+    DeflateOptions deflate;
+    bool      deflate_on = false;
+    z_stream *tx_z = NULL;            // kept across messages only with context takeover
+    z_stream *rx_z = NULL;
+    SSL      *tls = NULL;             // server side TLS on top of sock's descriptor
+    int       tls_retry = 0;          // length SSL_write has to be called with again
+    bool      ssl_sock = false;       // client side TLS, done by TcpSocket itself
+    bool      rx_drained = false;     // the owner's batched recv already emptied the socket
+    int       tx_early = INT_MIN;     // result of the owner's batched send of the head of outbuf
+#ifdef PLATFORM_LINUX
+    One<ShmChannel> shm;
+    BiVector<String> shm_backlog;     // text waiting for room in the ring
+    Vector<int> send_fds;             // passed (SCM_RIGHTS) with the next write
+    bool      shm_wanted = false;     // client: descriptors expected on the socket
+
+    void   DrainShm();                // delivers what the peer put in the ring
+    void   FlushShm();                // moves the backlog into the ring, wakes the peer
+    int    RecvFds(byte *buf, int len); // Recv() picking up passed descriptors
+#endif
+
+    // Server side upgrade, fed from inbuf as bytes arrive. Returns 1 when the 101
+    // response is queued, 0 if the request is still incomplete and -1 if it was
+    // refused (an HTTP error response is queued and the endpoint is closed).
+    int    HandshakeServer(const String& ws_path);
+    void   Refuse(int code, const char *text, const char *extra = "");
     bool   HandshakeClient(const String& host,const String& path);
     void   SendFrame(Frame&);
-    bool   ReadFrames();
-    bool   WritePending();
+    void   Queued(int delta);         // keeps the owner's queue total and pause state current
+    bool   SendData(int opcode, const String& data);
+    bool   Compress(const String& in, String& out);
+    bool   Decompress(const byte *in, int n, String& out, bool fin, int64 limit);
+    bool   ParseFrames();             // dispatches the frames buffered in inbuf
+    bool   OnData(const Frame& f, byte *p, int n, bool frame_begin, bool frame_end);
+    bool   TooBig();
+    void   DeliverString(int opcode, const String& data);
+    bool   TxNoTakeover() const       { return masked ? deflate.client_no_context_takeover : deflate.server_no_context_takeover; }
+    bool   RxNoTakeover() const       { return masked ? deflate.server_no_context_takeover : deflate.client_no_context_takeover; }
+    int    TxWindowBits() const       { return masked ? deflate.client_max_window_bits : deflate.server_max_window_bits; }
+    bool   ReadFrames();              // drains the socket until it would block or the owner's read budget is spent
+    void   Received(int res, int room); // completion of a recv the owner did into inbuf's write space
+    bool   WritePending();            // writes until outbuf is empty or the socket would block
+    int    Recv(byte *buf, int len);  // >0 bytes read, 0 would block, -1 peer gone, -2 error
+    int    Send();                    // >0 bytes of outbuf written, 0 would block, -1 error
+    bool   TlsAccept(int deadline);   // blocking, runs on a TLS worker thread
     void   HandleControl(Frame&);
     void   Fatal(int err,const char* msg); // Added const for msg
+    void   Lost();                    // peer went away without a close frame
 
     // Make Endpoint non-copyable as it has TcpSocket member
     Endpoint(const Endpoint&) = delete;
@@ -69,29 +471,149 @@ protected:
 };
 
 // -------------------- server wrapper -----------------------------
+// On Linux the server is an edge-triggered epoll reactor: Wait() sleeps until the
+// listener or some endpoint becomes ready and touches only those. Other platforms
+// fall back to SocketWaitEvent over all sockets.
+// A Server and its endpoints belong to the one thread calling Wait(). To use more
+// cores, run several Servers with ReusePort() on the same port, one per thread;
+// the kernel then spreads incoming connections across their listeners.
+// With TLS the handshakes run on a few worker threads, so key exchanges do not
+// stall the reactor; endpoints join it once the session is established.
 class Server {
 public:
-    Server() = default; // Added default constructor
+    Server() = default;
+    ~Server() { Close(); }
 
+    Server& ReusePort(bool b = true) { reuse_port = b; return *this; } // SO_REUSEPORT, Linux only
     bool  Listen(uint16 port,const String& path="/",
                  bool tls=false,const String& cert="",const String& key="");
+    // Local agents: same WebSocket protocol over an AF_UNIX socket (Linux). Peers are
+    // identified by SO_PEERCRED; with allowed uids set, anybody else is closed at accept.
+    bool  ListenUnix(const String& socket_path, const String& path = "/");
+    Server& AllowUid(int uid)                { allowed_uids.FindAdd(uid); return *this; }
+    void  Close();           // closes listener and drops all clients
 
     // user connects
     Event<Endpoint&> WhenAccept;
 
     // drive in owner loop
-    void  Pump();            // accept new + pump all clients
-    bool  IsFinished() const { return !listener.IsOpen(); } // Consider if listener is always valid
+    bool  Wait(int timeout_ms = -1); // block until ready or timeout, then service ready sockets
+    void  Pump() { Wait(0); }        // non-blocking single iteration
+    void  Wake();                    // thread-safe; makes a blocked Wait() return
+    void  Post(Event<> fn);          // thread-safe; fn runs on the Wait() thread during its next pass
+    void  Shutdown(int code = 1001, const String& reason = ""); // close frames to everyone, best-effort flush
+    bool  IsFinished() const { return !listener.IsOpen(); }
     int   ClientCount() const { return clients.GetCount(); }
+    Server& Deflate(const DeflateOptions& o) { deflate = o; return *this; } // permessage-deflate for new endpoints
+    Server& HandshakeTimeout(int ms)         { handshake_timeout = ms; return *this; }
+    Server& KeepAlive(int ping_ms, int pong_ms) { ping_interval = ping_ms; pong_timeout = pong_ms; return *this; }
+    Server& IdleTimeout(int ms)              { idle_timeout = ms; return *this; } // 0 = never
+    Server& MaxMessageSize(int bytes)        { max_message = bytes; return *this; }
+    Server& ReadBudget(int bytes)            { read_budget = max(bytes, 4096); return *this; } // per endpoint and Wait()
+    Server& WaterMarks(int high, int low)    { high_water = high; low_water = low; return *this; } // per endpoint
+    Server& TlsThreads(int n)                { tls_threads = max(n, 1); return *this; } // before Listen
+    Server& IoUring(bool b = true)           { use_uring = b; return *this; } // before Listen, Linux
+    bool    IsIoUring() const;               // recv/send batched through io_uring
+    // Admission: at most `n` accepts per Wait() so a reconnect storm cannot starve
+    // connected clients; per source address limit (closed at once) and a global
+    // one (answered 503 once the upgrade request is in). 0 = unlimited.
+    Server& AcceptBatch(int n)               { accept_batch = max(n, 1); return *this; }
+    Server& MaxConnections(int n)            { max_conns = n; return *this; }
+    Server& MaxPerAddress(int n)             { max_per_ip = n; return *this; }
+
+    // stats, safe to read from other threads
+    int64 QueuedBytes() const  { return queued.load(std::memory_order_relaxed); } // output not yet written
+    int   PausedCount() const  { return paused.load(std::memory_order_relaxed); } // endpoints over high water
+    int64 Rejected() const      { return rejected.load(std::memory_order_relaxed); } // admission refusals
+    int64 WritesSaved() const   { return frames_flushed.load(std::memory_order_relaxed) - write_calls.load(std::memory_order_relaxed); } // frames that shared a write
+    int64 TlsHandshakes() const { return tls_full.load(std::memory_order_relaxed); }
+    int64 TlsResumed() const    { return tls_resumed.load(std::memory_order_relaxed); } // tickets or session cache
 
     // Make Server non-copyable
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
 
 private:
+    friend class Endpoint;
+
     TcpSocket listener;
-    Vector<Ptr<Endpoint>> clients; // Ptr<> implies heap allocated Endpoints managed by Server
+    TimerWheel timers;               // before clients: endpoints unlink their timers on destruction
+    Array<Endpoint> clients;
+    Vector<Endpoint*> dead;          // endpoints to reap at the end of this Wait()
+    Vector<Endpoint*> readable;      // stopped at the read budget; epoll will not report them again
+    String  unix_path;               // socket file to remove on Close()
+    Index<int> allowed_uids;
     String  ws_path = "/";
+    bool    reuse_port = false;
+    DeflateOptions deflate;
+    int     handshake_timeout = 5000;
+    int     max_message = 64 << 20;
+    int     read_budget = 256 << 10; // bytes one endpoint may read per Wait(), so a fast sender cannot hog a pass
+    int     high_water = 4 << 20;
+    int     low_water = 1 << 20;
+    std::atomic<int64> queued{0};    // only the Wait() thread writes these
+    std::atomic<int>   paused{0};
+    std::atomic<int64> frames_flushed{0}, write_calls{0}, rejected{0};
+    int     accept_batch = 64;
+    int     max_conns = 0;
+    int     max_per_ip = 0;
+    int     live = 0;                // admitted endpoints, TLS handshakes included
+    VectorMap<String, int> per_ip;   // raw address bytes -> admitted endpoints
+    Vector<Endpoint *> dirty;        // endpoints with output queued during this Wait()
+    Mutex   post_lock;
+    Vector<Event<>> posted;          // from other threads, run by Wait()
+    int     ping_interval = 30000;   // ms of silence before a ping, 0 = no keepalive
+    int     pong_timeout = 10000;    // ms a pinged (or closing) peer gets to answer
+    int     idle_timeout = 0;        // ms without data frames before closing, 0 = never
+    bool    use_uring = true;
+
+    SSL_CTX *tls_ctx = NULL;         // shared, owned by TlsContext
+    int      tls_threads = 2;
+    Array<Thread> tls_pool;
+    Mutex    tls_lock;               // guards the tls_* lists and tls_stop
+    ConditionVariable tls_cv;
+    BiVector<Endpoint *> tls_todo;   // accepted, handshake not started; owned
+    Vector<Endpoint *>   tls_busy;   // being handshaken by a worker
+    Vector<Endpoint *>   tls_done;   // finished (closed if failed), waiting for Wait(); owned
+    bool     tls_stop = false;
+    std::atomic<int64> tls_full{0}, tls_resumed{0};
+#ifdef PLATFORM_LINUX
+    int     epfd = -1;
+    int     wakefd = -1;
+
+    bool    Watch(SOCKET s, void *token, dword events); // token: Endpoint*, +1 for its ShmChannel
+    void    Unwatch(int fd)           { if(epfd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL); }
+    bool    ListenReusePort(uint16 port);
+    bool    StartReactor();           // epoll set with the listener and the wake-up eventfd
+#endif
+#ifdef WS_URING
+    Uring   uring;                    // epoll still reports readiness, this does the transfers
+    Vector<msghdr> tx_msg;
+    Vector<iovec>  tx_iov;
+
+    void    RecvBatch(const epoll_event *ev, int n);
+    void    SendBatch();
+#endif
+
+    void    AcceptPending();
+    bool    Accept(Endpoint& ep, String& peer);
+    void    Release(Endpoint& ep);    // an admitted endpoint is going away
+    void    Adopt(Endpoint& ep);      // sets up a connected endpoint in this reactor
+    void    TlsWorker();
+    void    AdoptTls();               // takes over endpoints whose TLS handshake finished
+    void    StopTls();
+    void    Service(Endpoint& ep, bool readable, bool writable);
+    void    Reap();
+    void    OnTimer(Endpoint& ep);
+    void    Arm(Endpoint& ep, int now); // next keepalive/idle deadline of an open endpoint
+    void    Dead(Endpoint& ep)        { if(!ep.dying) { ep.dying = true; dead.Add(&ep); } }
+    void    Readable(Endpoint& ep)    { if(!ep.rx_listed) { ep.rx_listed = true; readable.Add(&ep); } }
+    void    MarkDirty(Endpoint& ep)   { if(!ep.dirty) { ep.dirty = true; dirty.Add(&ep); } }
+    void    Flush();                  // one coalesced write per dirty endpoint
+    void    RunPosted();
+
+    template <class T>
+    static void Bump(std::atomic<T>& a, typename std::atomic<T>::value_type d) { a.store(a.load(std::memory_order_relaxed) + d, std::memory_order_relaxed); } // single writer
 };
 
 // -------------------- client wrapper -----------------------------
@@ -99,6 +621,13 @@ class Client : public Endpoint { // Client inherits from Endpoint
 public:
     Client() = default; // Added default constructor
     bool Connect(const String& url, bool tls=false);
+    bool ConnectUnix(const String& socket_path, const String& path = "/"); // Linux
+    // After ConnectUnix(): sends `request` (the server's cue for Endpoint::AttachShm)
+    // and waits for the rings; false if the server did not provide them in time.
+    bool AttachShm(const String& request, int timeout_ms = 5000);
+    // Sleeps until the socket or the rings have input (spinning briefly first when
+    // the rings are attached), then Pump()s. False on fatal error.
+    bool Wait(int timeout_ms);
 
     // Make Client non-copyable (implicitly non-copyable due to Endpoint base)
 };
@@ -111,304 +640,2474 @@ public:
 namespace Upp {
 namespace Ws {
 
-inline String Frame::Encode(bool mask)
+inline void ByteRing::Reserve(int free)
 {
-    String out;
-    byte b0 = (fin ? 0x80 : 0x00) | (opcode & 0x0F);
-    out.Cat(b0);
+    if(cap - count >= free)
+        return;
+    int ncap = max(cap, 4096);
+    while(ncap - count < free)
+        ncap <<= 1;
+    Buffer<byte> nbuf(ncap);
+    const byte *p;
+    int first = GetChunk(p);
+    if(first)
+        memcpy(~nbuf, p, first);
+    if(count > first)
+        memcpy(~nbuf + first, ~buf, count - first);
+    buf = pick(nbuf);
+    cap = ncap;
+    head = 0;
+}
 
-    int payload_len = payload.GetCount();
-    byte b1 = mask ? 0x80 : 0x00;
-    if(payload_len < 126) {
-        out.Cat(b1 | (byte)payload_len);
-    }
-    else if(payload_len <= 0xFFFF) {
-        out.Cat(b1 | 126);
-        out.Cat((byte)(payload_len >> 8));
-        out.Cat((byte)(payload_len & 0xFF));
-    }
-    else {
-        out.Cat(b1 | 127);
-        uint64 len64 = payload_len;
-        for(int i = 7; i >= 0; --i)
-            out.Cat((byte)(len64 >> (i * 8)));
-    }
+inline void ByteRing::Linearize()
+{
+    if(head == 0)
+        return;
+    std::rotate(~buf, ~buf + head, ~buf + cap);
+    head = 0;
+}
 
-    String data = payload;
-    if(mask) {
-        for(int i = 0; i < 4; i++)
-            mask_key[i] = (byte)Random();
-        out.Cat((const char*)mask_key, 4);
-        for(int i = 0; i < data.GetCount(); i++)
-            data[i] ^= mask_key[i & 3];
+inline void ByteRing::Put(const void *data, int n)
+{
+    Reserve(n);
+    int tail = Tail();
+    int first = min(n, cap - tail);
+    memcpy(~buf + tail, data, first);
+    if(n > first)
+        memcpy(~buf, (const byte *)data + first, n - first);
+    count += n;
+}
+
+inline byte *ByteRing::GetWriteSpace(int min_free, int& len)
+{
+    Reserve(min_free);
+    if(count == 0)
+        head = 0;
+    int tail = Tail();
+    len = tail >= head ? cap - tail : head - tail;
+    if(len < min_free) {
+        Linearize();
+        tail = count;
+        len = cap - tail;
     }
-    out.Cat(data);
-    return out;
+    return ~buf + tail;
 }
 
-inline bool Frame::Decode(const void* buf, int sz, int& used, bool expect_mask)
+inline byte *ByteRing::Peek(int n)
 {
-    used = 0;
-    if(sz < 2)
-        return false;
+    ASSERT(n <= count);
+    if(head + n > cap)
+        Linearize();
+    return ~buf + head;
+}
 
-    const byte* b = static_cast<const byte*>(buf);
-    fin = (b[0] & 0x80) != 0;
-    opcode = b[0] & 0x0F;
-    bool mask = (b[1] & 0x80) != 0;
-    uint64 length = b[1] & 0x7F;
-    int pos = 2;
-    if(length == 126) {
-        if(sz < pos + 2) return false;
-        length = ((uint64)b[pos] << 8) | b[pos+1];
-        pos += 2;
-    } else if(length == 127) {
-        if(sz < pos + 8) return false;
-        length = 0;
-        for(int i = 0; i < 8; i++)
-            length = (length << 8) | b[pos++];
-    }
+inline byte *ByteRing::PeekZ(int n)
+{
+    ASSERT(n <= count);
+    Reserve(1);
+    if(head + n + 1 > cap)
+        Linearize();
+    return ~buf + head;
+}
 
-    if(mask) {
-        if(sz < pos + 4) return false;
-        memcpy(mask_key, b + pos, 4);
-        pos += 4;
-    } else {
-        memset(mask_key, 0, 4);
-    }
+inline int ByteRing::GetChunk(const byte *& ptr) const
+{
+    ptr = ~buf + head;
+    return min(count, cap - head);
+}
 
-    if(sz < pos + length)
-        return false;
+inline void ByteRing::Consume(int n)
+{
+    ASSERT(n <= count);
+    count -= n;
+    head = count ? (head + n) & (cap - 1) : 0;
+}
 
-    payload = String((const char*)b + pos, (int)length);
-    if(mask) {
-        for(int i = 0; i < payload.GetCount(); i++)
-            payload[i] ^= mask_key[i & 3];
+inline void ByteRing::Shrink()
+{
+    if(count == 0 && cap > 65536) {
+        buf.Clear();
+        cap = head = 0;
     }
-
-    len = (int)length;
-    used = pos + (int)length;
-    if(expect_mask && !mask)
-        return false;
-    return true;
 }
 
-inline void Endpoint::SendText(const String& s)
+inline void MaskBytesScalar(byte *data, int n, const byte key[4])
 {
-    Frame f;
-    f.opcode = Frame::TEXT;
-    f.payload = s;
-    f.len = s.GetCount();
-    SendFrame(f);
+    uint32 k32;
+    memcpy(&k32, key, 4);
+    uint64 k64 = ((uint64)k32 << 32) | k32;
+    int i = 0;
+    for(; i + 8 <= n; i += 8) {
+        uint64 w;
+        memcpy(&w, data + i, 8);
+        w ^= k64;
+        memcpy(data + i, &w, 8);
+    }
+    for(; i < n; i++)
+        data[i] ^= key[i & 3];
 }
 
-inline void Endpoint::SendBinary(const void* data, int len)
+#ifdef WS_MASK_X86
+__attribute__((target("sse2")))
+inline void MaskBytesSSE2(byte *data, int n, const byte key[4])
 {
-    Frame f;
-    f.opcode = Frame::BINARY;
-    f.payload = String((const char*)data, len);
-    f.len = len;
-    SendFrame(f);
+    int32 k32;
+    memcpy(&k32, key, 4);
+    __m128i k = _mm_set1_epi32(k32);
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i *p = (__m128i *)(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k));
+    }
+    MaskBytesScalar(data + i, n - i, key); // i is a multiple of 4, key phase unchanged
 }
 
-inline void Endpoint::Close(int code, const String& reason)
+__attribute__((target("avx2")))
+inline void MaskBytesAVX2(byte *data, int n, const byte key[4])
 {
-    if(closed)
-        return;
-    Frame f;
-    f.opcode = Frame::CLOSE;
-    f.payload.Cat((byte)(code >> 8));
-    f.payload.Cat((byte)(code & 0xFF));
-    f.payload << reason;
-    f.len = f.payload.GetCount();
-    SendFrame(f);
-    closed = true;
+    int32 k32;
+    memcpy(&k32, key, 4);
+    __m256i k = _mm256_set1_epi32(k32);
+    int i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m256i *p = (__m256i *)(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), k));
+    }
+    MaskBytesSSE2(data + i, n - i, key);
 }
+#endif
 
-inline void Endpoint::SendFrame(Frame& f)
+inline void MaskBytes(byte *data, int n, const byte key[4])
 {
-    String raw = f.Encode(masked);
-    int n = raw.GetCount();
-    outbuf.SetCount(outbuf.GetCount() + n);
-    memcpy(~outbuf + outbuf.GetCount() - n, raw.Begin(), n);
-    tx_bytes += n;
+    typedef void (*Kernel)(byte *, int, const byte *);
+    static Kernel kernel = [] {
+#ifdef WS_MASK_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return (Kernel)MaskBytesAVX2;
+        if(__builtin_cpu_supports("sse2"))
+            return (Kernel)MaskBytesSSE2;
+#endif
+        return (Kernel)MaskBytesScalar;
+    }();
+    if(n < 32)
+        MaskBytesScalar(data, n, key); // not worth the indirect call
+    else
+        kernel(data, n, key);
 }
 
-inline bool Endpoint::WritePending()
+inline void OutQueue::Add(const String& s)
 {
-    if(outbuf.IsEmpty())
-        return true;
+    int n = s.GetCount();
+    if(n == 0)
+        return;
+    if(n < 256 && !segs.IsEmpty() && segs.Tail().GetCount() < 4096)
+        segs.Tail().Cat(s);
+    else
+        segs.AddTail(s);
+    bytes += n;
+}
 
-    int n = sock.Put(~outbuf, outbuf.GetCount());
-    if(n < 0) {
-        Fatal(-1, "write error");
-        return false;
-    }
-    if(n > 0) {
-        outbuf.Remove(0, n);
+inline int OutQueue::GetChunk(const byte *& ptr) const
+{
+    if(segs.IsEmpty()) {
+        ptr = NULL;
+        return 0;
     }
-    return true;
+    ptr = (const byte *)~segs.Head() + offset;
+    return segs.Head().GetCount() - offset;
 }
 
-inline bool Endpoint::ReadFrames()
+#ifdef PLATFORM_LINUX
+inline int OutQueue::Gather(iovec *iov, int max) const
 {
-    byte buffer[4096];
-    int n = sock.Get(buffer, sizeof(buffer));
-    if(n < 0) {
-        Fatal(-1, "read error");
-        return false;
+    int n = min(segs.GetCount(), max);
+    for(int i = 0; i < n; i++) {
+        const String& s = segs[i];
+        int skip = i ? 0 : offset;
+        iov[i].iov_base = (void *)(~s + skip);
+        iov[i].iov_len = s.GetCount() - skip;
     }
-    if(n == 0)
-        return true;
+    return n;
+}
+#endif
 
-    rx_bytes += n;
-    int old = inbuf.GetCount();
-    inbuf.SetCount(old + n);
-    memcpy(~inbuf + old, buffer, n);
+inline int OutQueue::Copy(byte *dst, int n) const
+{
+    int done = 0;
+    for(int i = 0; i < segs.GetCount() && done < n; i++) {
+        const String& s = segs[i];
+        int skip = i ? 0 : offset;
+        int m = min(s.GetCount() - skip, n - done);
+        memcpy(dst + done, ~s + skip, m);
+        done += m;
+    }
+    return done;
+}
 
-    int used = 0;
-    while(true) {
-        Frame f;
-        if(!f.Decode(~inbuf, inbuf.GetCount(), used, masked))
-            break;
-        inbuf.Remove(0, used);
-        if(f.opcode == Frame::TEXT || f.opcode == Frame::BINARY)
-        {
-            if(f.opcode == Frame::TEXT)
-                WhenText(f.payload);
-            else
-                WhenBinary(f.payload);
+inline void OutQueue::Consume(int64 n)
+{
+    ASSERT(n <= bytes);
+    bytes -= n;
+    while(n > 0) {
+        int left = segs.Head().GetCount() - offset;
+        if(n < left) {
+            offset += (int)n;
+            return;
         }
-        else
-            HandleControl(f);
+        n -= left;
+        segs.DropHead();
+        offset = 0;
     }
-    return true;
 }
 
-inline void Endpoint::HandleControl(Frame& f)
+inline bool DeflateOptions::Negotiate(const String& offers, DeflateOptions& agreed, String& response) const
 {
-    switch(f.opcode) {
-    case Frame::PING:
-        {
-            Frame pong;
-            pong.opcode = Frame::PONG;
-            pong.payload = f.payload;
-            pong.len = pong.payload.GetCount();
-            SendFrame(pong);
-            break;
+    if(!enabled)
+        return false;
+    for(const String& offer : Split(offers, ',')) {
+        Vector<String> params = Split(offer, ';');
+        if(params.IsEmpty() || ToLower(TrimBoth(params[0])) != "permessage-deflate")
+            continue;
+        agreed = *this;
+        bool ok = true;
+        bool client_bits = false;
+        for(int i = 1; i < params.GetCount() && ok; i++) {
+            String p = TrimBoth(params[i]);
+            int q = p.Find('=');
+            String key = ToLower(TrimBoth(q >= 0 ? p.Left(q) : p));
+            String val = q >= 0 ? TrimBoth(p.Mid(q + 1)) : String();
+            val.Replace("\"", "");
+            int bits = val.IsEmpty() ? 15 : ScanInt(val);
+            if(key == "server_no_context_takeover")
+                agreed.server_no_context_takeover = true;
+            else
+            if(key == "client_no_context_takeover")
+                agreed.client_no_context_takeover = true;
+            else
+            if(key == "server_max_window_bits" && bits >= 9 && bits <= 15)
+                agreed.server_max_window_bits = min(bits, server_max_window_bits);
+            else
+            if(key == "client_max_window_bits" && bits >= 8 && bits <= 15) {
+                client_bits = true;
+                agreed.client_max_window_bits = min(bits, client_max_window_bits);
+            }
+            else
+                ok = false; // unknown parameter or a window we cannot honour
         }
-    case Frame::CLOSE:
-        closed = true;
-        if(WhenClose)
-            WhenClose(1000, f.payload.Mid(2));
-        break;
+        if(!ok)
+            continue;
+        if(!client_bits)
+            agreed.client_max_window_bits = 15; // client did not allow us to limit it
+        response = "permessage-deflate";
+        if(agreed.server_no_context_takeover)
+            response << "; server_no_context_takeover";
+        if(agreed.client_no_context_takeover)
+            response << "; client_no_context_takeover";
+        if(agreed.server_max_window_bits < 15)
+            response << "; server_max_window_bits=" << agreed.server_max_window_bits;
+        if(client_bits && agreed.client_max_window_bits < 15)
+            response << "; client_max_window_bits=" << agreed.client_max_window_bits;
+        agreed.enabled = true;
+        return true;
     }
+    return false;
 }
 
-inline void Endpoint::Fatal(int err, const char* msg)
+inline String DeflateOptions::Offer() const
 {
-    closed = true;
-    if(WhenError)
-        WhenError(err);
+    String r = "permessage-deflate; client_max_window_bits";
+    if(client_max_window_bits < 15)
+        r << "=" << client_max_window_bits;
+    if(server_no_context_takeover)
+        r << "; server_no_context_takeover";
+    if(client_no_context_takeover)
+        r << "; client_no_context_takeover";
+    if(server_max_window_bits < 15)
+        r << "; server_max_window_bits=" << server_max_window_bits;
+    return r;
 }
 
-inline bool Endpoint::HandshakeClient(const String& host, const String& path)
+inline bool DeflateOptions::Accept(const String& response, DeflateOptions& agreed) const
 {
-    String key;
-    for(int i = 0; i < 16; i++)
-        key.Cat((char)Random());
-    String request;
-    request << "GET " << path << " HTTP/1.1\r\n"
-            << "Host: " << host << "\r\n"
-            << "Upgrade: websocket\r\n"
-            << "Connection: Upgrade\r\n"
-            << "Sec-WebSocket-Version: 13\r\n"
-            << "Sec-WebSocket-Key: " << Base64Encode(key) << "\r\n\r\n";
-
-    if(!sock.PutAll(request))
-        return false;
-
-    String line, header;
-    while(!(line = sock.GetLine(8192)).IsEmpty())
-        header << line << "\n";
-
-    if(header.Find("101") < 0)
+    Vector<String> params = Split(response, ';');
+    if(params.IsEmpty() || ToLower(TrimBoth(params[0])) != "permessage-deflate")
         return false;
-
-    masked = true;
+    agreed = *this;
+    agreed.client_max_window_bits = agreed.server_max_window_bits = 15;
+    for(int i = 1; i < params.GetCount(); i++) {
+        String p = TrimBoth(params[i]);
+        int q = p.Find('=');
+        String key = ToLower(TrimBoth(q >= 0 ? p.Left(q) : p));
+        int bits = q >= 0 ? ScanInt(TrimBoth(p.Mid(q + 1))) : 15;
+        if(key == "server_no_context_takeover")
+            agreed.server_no_context_takeover = true;
+        else
+        if(key == "client_no_context_takeover")
+            agreed.client_no_context_takeover = true;
+        else
+        if(key == "server_max_window_bits" && bits >= 8 && bits <= 15)
+            agreed.server_max_window_bits = bits;
+        else
+        if(key == "client_max_window_bits" && bits >= 9 && bits <= 15)
+            agreed.client_max_window_bits = bits;
+        else
+            return false;
+    }
+    agreed.enabled = true;
     return true;
 }
 
-inline bool Endpoint::HandshakeServer(const HttpHeader&)
+inline z_stream *ZPool::GetDeflater(int window_bits, int level)
 {
-    String line, header;
-    while(!(line = sock.GetLine(8192)).IsEmpty())
-        header << line << "\n";
+    int key = (window_bits << 8) | (level & 0xff);
+    {
+        Mutex::Lock __(Lock());
+        Vector<z_stream *> *v = Free().FindPtr(key);
+        if(v && v->GetCount())
+            return v->Pop();
+    }
+    z_stream *z = new z_stream;
+    memset(z, 0, sizeof(z_stream));
+    if(deflateInit2(z, level, Z_DEFLATED, -window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete z;
+        return NULL;
+    }
+    return z;
+}
 
-    String key;
-    Vector<String> lines = Split(header, '\n');
-    for(const String& l : lines) {
-        if(ToLower(l).StartsWith("sec-websocket-key:")) {
-            key = Trim(l.Mid(l.Find(':') + 1));
-            break;
-        }
+inline z_stream *ZPool::GetInflater()
+{
+    {
+        Mutex::Lock __(Lock());
+        Vector<z_stream *> *v = Free().FindPtr(-1);
+        if(v && v->GetCount())
+            return v->Pop();
     }
-    if(key.IsEmpty())
-        return false;
+    z_stream *z = new z_stream;
+    memset(z, 0, sizeof(z_stream));
+    if(inflateInit2(z, -15) != Z_OK) { // a 15 bit window inflates any smaller one too
+        delete z;
+        return NULL;
+    }
+    return z;
+}
 
-    byte sha1[20];
-    SHA1(sha1, key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
-    String accept = Base64Encode((const char*)sha1, 20);
+inline void ZPool::Release(z_stream *z, bool deflater, int window_bits, int level)
+{
+    if(!z)
+        return;
+    if(deflater ? deflateReset(z) : inflateReset(z)) {
+        deflater ? deflateEnd(z) : inflateEnd(z);
+        delete z;
+        return;
+    }
+    int key = deflater ? (window_bits << 8) | (level & 0xff) : -1;
+    Mutex::Lock __(Lock());
+    Vector<z_stream *>& v = Free().GetAdd(key);
+    if(v.GetCount() < 64) {
+        v.Add(z);
+        return;
+    }
+    deflater ? deflateEnd(z) : inflateEnd(z);
+    delete z;
+}
 
-    String response;
-    response << "HTTP/1.1 101 Switching Protocols\r\n"
-             << "Upgrade: websocket\r\n"
-             << "Connection: Upgrade\r\n"
-             << "Sec-WebSocket-Accept: " << accept << "\r\n\r\n";
+inline void TimerWheel::Node::Cancel()
+{
+    if(!next)
+        return;
+    prev->next = next;
+    next->prev = prev;
+    prev = next = NULL;
+}
 
-    if(!sock.PutAll(response))
-        return false;
+inline TimerWheel::TimerWheel()
+{
+    for(auto& level : slot)
+        for(Node& h : level)
+            h.prev = h.next = &h;
+    last_now = msecs();
+}
 
-    masked = false;
-    return true;
+inline void TimerWheel::Splice(Node& from, Node& to)
+{
+    if(from.next == &from)
+        return;
+    Node *first = from.next, *last = from.prev;
+    first->prev = to.prev;
+    to.prev->next = first;
+    last->next = &to;
+    to.prev = last;
+    from.prev = from.next = &from;
 }
 
-inline bool Endpoint::Pump()
+inline void TimerWheel::Link(Node& n)
 {
-    if(!WritePending())
-        return false;
-    if(!ReadFrames())
-        return false;
-    return true;
+    n.tick = max(n.tick, cur);
+    // lowest level whose slots still reach the tick; a level l slot is only
+    // visited again when its level l-1 wraps, so the slot must not be the current one
+    int l = 0;
+    while(l < LEVELS - 1 && (n.tick >> (BITS * l)) - (cur >> (BITS * l)) >= SLOTS)
+        l++;
+    if((n.tick >> (BITS * l)) - (cur >> (BITS * l)) >= SLOTS) // beyond the span, fire at its end
+        n.tick = ((cur >> (BITS * l)) + SLOTS - 1) << (BITS * l);
+    Node& h = slot[l][(n.tick >> (BITS * l)) & (SLOTS - 1)];
+    n.prev = h.prev;
+    n.next = &h;
+    h.prev->next = &n;
+    h.prev = &n;
 }
 
-inline bool Server::Listen(uint16 port, const String& path, bool, const String&, const String&)
+inline void TimerWheel::Schedule(Node& n, int delay_ms, int now)
 {
-    ws_path = path;
-    return listener.Listen(port);
+    n.Cancel();
+    n.tick = max((Now(now) + max(delay_ms, 0) + TICK_MS - 1) / TICK_MS, cur + 1);
+    Link(n);
 }
 
-inline void Server::Pump()
+template <class F>
+void TimerWheel::Advance(int now, F fire)
 {
-    TcpSocket s;
-    while(listener.Accept(s)) {
-        Ptr<Endpoint> ep = new Endpoint;
-        ep->sock.Attach(s.GetSOCKET());
-        if(ep->HandshakeServer(HttpHeader())) {
-            clients.Add(ep);
-            WhenAccept(*ep);
+    ms = Now(now);
+    last_now = now;
+    int64 target = ms / TICK_MS;
+    while(cur < target) {
+        cur++;
+        int top = 0;
+        while(top < LEVELS - 1 && (cur & ((int64(1) << (BITS * (top + 1))) - 1)) == 0)
+            top++;
+        for(int l = top; l > 0; l--) { // redistribute, highest level first
+            Node moving;
+            moving.prev = moving.next = &moving;
+            Splice(slot[l][(cur >> (BITS * l)) & (SLOTS - 1)], moving);
+            while(moving.next != &moving) {
+                Node *n = moving.next;
+                n->Cancel();
+                Link(*n);
+            }
+        }
+        Node due;
+        due.prev = due.next = &due;
+        Splice(slot[0][cur & (SLOTS - 1)], due);
+        while(due.next != &due) { // fire may cancel or reschedule any timer, this one included
+            Node *n = due.next;
+            n->Cancel();
+            fire(*n);
         }
-        else
-            delete ~ep;
     }
+}
 
-    for(int i = 0; i < clients.GetCount(); ) {
-        Endpoint& c = *clients[i];
-        if(!c.Pump() || c.IsClosed())
-            clients.Remove(i);
-        else
-            ++i;
+inline int TimerWheel::GetTimeout(int now) const
+{
+    int64 t = Now(now);
+    for(int i = 1; i < SLOTS; i++) {
+        const Node& h = slot[0][(cur + i) & (SLOTS - 1)];
+        if(h.next != &h)
+            return (int)max<int64>((cur + i) * TICK_MS - t, 0);
     }
+    for(int l = 1; l < LEVELS; l++)
+        for(const Node& h : slot[l])
+            if(h.next != &h) // nothing due soon, but wake for the next cascade
+                return (int)max<int64>(((cur | (SLOTS - 1)) + 1) * TICK_MS - t, 0);
+    return -1;
+}
+
+#ifdef PLATFORM_LINUX
+inline ShmChannel::~ShmChannel()
+{
+    if(base)
+        munmap(base, size);
+    for(int fd : { memfd, own_efd, peer_efd })
+        if(fd >= 0)
+            close(fd);
+}
+
+inline bool ShmChannel::Map(int fd, bool server)
+{
+    base = (byte *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED) {
+        base = NULL;
+        return false;
+    }
+    Header& h = *(Header *)base;
+    if(server) {
+        new(base) Header;
+        h.magic = MAGIC;
+        h.capacity = capacity;
+    }
+    else
+    if(h.magic != MAGIC || h.capacity != capacity)
+        return false;
+    tx = &h.ring[server];
+    rx = &h.ring[!server];
+    tx_data = base + DATA + (server ? capacity : 0);
+    rx_data = base + DATA + (server ? 0 : capacity);
+    return true;
+}
+
+inline bool ShmChannel::Create(int cap)
+{
+    capacity = 65536;
+    while((int)capacity < cap && capacity < (1u << 28))
+        capacity <<= 1;
+    size = DATA + 2 * (int64)capacity;
+    memfd = memfd_create("ws-shm", MFD_CLOEXEC);
+    own_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    peer_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return memfd >= 0 && own_efd >= 0 && peer_efd >= 0 && ftruncate(memfd, size) == 0 && Map(memfd, true);
+}
+
+inline bool ShmChannel::Attach(int mfd, int server_efd, int client_efd)
+{
+    memfd = mfd;
+    own_efd = client_efd;
+    peer_efd = server_efd;
+    struct stat st;
+    if(fstat(mfd, &st) || st.st_size <= DATA)
+        return false;
+    size = st.st_size;
+    capacity = (uint32)((size - DATA) / 2);
+    if(capacity < 65536 || (capacity & (capacity - 1)) || !Map(mfd, false))
+        return false;
+    close(memfd); // the mapping keeps the memory
+    memfd = -1;
+    return true;
+}
+
+inline void ShmChannel::GetFds(Vector<int>& fds) const
+{
+    fds << memfd << own_efd << peer_efd;
+}
+
+inline bool ShmChannel::Send(const void *data, int len)
+{
+    uint32 need = (4 + len + 7) & ~7;
+    if(len < 0 || len > GetMaxMessage())
+        return false;
+    uint32 tail = tx->tail.load(std::memory_order_relaxed);
+    uint32 pos = tail & (capacity - 1);
+    uint32 pad = capacity - pos < need ? capacity - pos : 0;
+    if(capacity - (tail - tx->head.load(std::memory_order_acquire)) < pad + need) {
+        tx->blocked.store(1, std::memory_order_seq_cst);
+        if(capacity - (tail - tx->head.load(std::memory_order_seq_cst)) < pad + need)
+            return false; // the consumer signals our eventfd once it made room
+        tx->blocked.store(0, std::memory_order_relaxed);
+    }
+    if(pad) {
+        *(uint32 *)(tx_data + pos) = PAD;
+        tail += pad;
+        pos = 0;
+    }
+    *(uint32 *)(tx_data + pos) = len;
+    memcpy(tx_data + pos + 4, data, len);
+    tx->tail.store(tail + need, std::memory_order_release);
+    notify = true;
+    return true;
+}
+
+inline void ShmChannel::Notify()
+{
+    if(!notify)
+        return;
+    notify = false;
+    std::atomic_thread_fence(std::memory_order_seq_cst); // tail store before the sleeping load
+    if(tx->sleeping.load(std::memory_order_relaxed) && tx->sleeping.exchange(0))
+        Signal(peer_efd);
+}
+
+inline bool ShmChannel::Receive(String& msg)
+{
+    for(;;) {
+        if(broken)
+            return false;
+        // Everything in the mapping may be written by the peer at any time: positions
+        // and lengths are read once and checked before anything is copied.
+        uint32 head = rx->head.load(std::memory_order_relaxed);
+        uint32 avail = rx->tail.load(std::memory_order_acquire) - head;
+        if(avail == 0)
+            return false;
+        uint32 pos = head & (capacity - 1);
+        if(avail > capacity || (pos & 7))
+            return Corrupt();
+        uint32 len = *(volatile uint32 *)(rx_data + pos);
+        if(len == PAD) {
+            if(capacity - pos > avail)
+                return Corrupt();
+            rx->head.store(head + capacity - pos, std::memory_order_release);
+            continue;
+        }
+        if(len > (uint32)GetMaxMessage() || pos + 4 + len > capacity || ((4 + len + 7) & ~7) > avail)
+            return Corrupt(); // would read past the record, or past the end of the ring
+        msg = String((const char *)rx_data + pos + 4, len);
+        rx->head.store(head + ((4 + len + 7) & ~7), std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(rx->blocked.load(std::memory_order_relaxed) && rx->blocked.exchange(0))
+            Signal(peer_efd);
+        return true;
+    }
+}
+
+inline bool ShmChannel::HasInput() const
+{
+    return rx->head.load(std::memory_order_relaxed) != rx->tail.load(std::memory_order_acquire);
+}
+
+inline bool ShmChannel::Sleep()
+{
+    rx->sleeping.store(1, std::memory_order_seq_cst);
+    if(rx->head.load(std::memory_order_relaxed) == rx->tail.load(std::memory_order_seq_cst))
+        return true;
+    rx->sleeping.store(0, std::memory_order_relaxed);
+    return false;
+}
+
+inline void ShmChannel::Awake()
+{
+    rx->sleeping.store(0, std::memory_order_relaxed);
+    uint64 cnt;
+    (void)!read(own_efd, &cnt, sizeof(cnt));
+}
+#endif
+
+#ifdef WS_URING
+inline bool Uring::Open(int entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if(fd < 0)
+        return false;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single)
+        sq_size = cq_size = max(sq_size, cq_size);
+    auto Map = [&](size_t size, int64 offset) -> byte * {
+        void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return m == MAP_FAILED ? NULL : (byte *)m;
+    };
+    sq_map = Map(sq_size, IORING_OFF_SQ_RING);
+    cq_map = single ? sq_map : Map(cq_size, IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe *)Map(sqes_size, IORING_OFF_SQES);
+    if(!sq_map || !cq_map || !sqes) {
+        Close();
+        return false;
+    }
+    sq_head = (unsigned *)(sq_map + p.sq_off.head);
+    sq_tail = (unsigned *)(sq_map + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq_map + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq_map + p.sq_off.array);
+    cq_head = (unsigned *)(cq_map + p.cq_off.head);
+    cq_tail = (unsigned *)(cq_map + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq_map + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq_map + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+    tail = *sq_tail;
+    unsubmitted = 0;
+    return true;
+}
+
+inline void Uring::Close()
+{
+    if(sqes)
+        munmap(sqes, sqes_size);
+    if(cq_map && cq_map != sq_map)
+        munmap(cq_map, cq_size);
+    if(sq_map)
+        munmap(sq_map, sq_size);
+    if(fd >= 0)
+        close(fd);
+    fd = -1;
+    sq_map = cq_map = NULL;
+    sqes = NULL;
+}
+
+inline io_uring_sqe *Uring::GetSqe()
+{
+    if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        return NULL;
+    unsigned i = tail++ & *sq_mask;
+    sq_array[i] = i;
+    unsubmitted++;
+    memset(&sqes[i], 0, sizeof(io_uring_sqe));
+    return &sqes[i];
+}
+
+inline bool Uring::Run(int count)
+{
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    for(;;) {
+        int ready = int(__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head);
+        if(!unsubmitted && ready >= count)
+            return true;
+        unsigned wait = max(count - ready, 0);
+        int r = (int)syscall(__NR_io_uring_enter, fd, unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(r >= 0)
+            unsubmitted -= r;
+        else
+        if(errno != EINTR) {
+            tail -= unsubmitted; // the kernel has not looked at these yet
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            unsubmitted = 0;
+            return false;
+        }
+    }
+}
+
+template <class F>
+inline void Uring::Reap(F done)
+{
+    unsigned head = *cq_head;
+    for(; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+        const io_uring_cqe& c = cqes[head & *cq_mask];
+        done(c.user_data, c.res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+inline int64 Uring::Transfer(int file, byte *data, int64 len, bool write)
+{
+    enum { CHUNK = 256 * 1024, DEPTH = 8 };
+    int64 pos = 0;
+    while(pos < len) {
+        int n = 0;
+        while(n < DEPTH && pos + (int64)n * CHUNK < len) {
+            io_uring_sqe *s = GetSqe();
+            if(!s)
+                break;
+            int64 off = pos + (int64)n * CHUNK;
+            s->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            s->fd = file;
+            s->addr = (uint64)(uintptr_t)(data + off);
+            s->len = (uint32)min<int64>(CHUNK, len - off);
+            s->off = off;
+            s->user_data = n++;
+        }
+        int res[DEPTH];
+        for(int& r : res)
+            r = INT_MIN;
+        bool ok = n && Run(n);
+        Reap([&](uint64 i, int r) { if(i < DEPTH) res[i] = r; });
+        if(!ok)
+            return -1;
+        for(int i = 0; i < n; i++) {
+            int want = (int)min<int64>(CHUNK, len - pos);
+            if(res[i] < 0)
+                return -1;
+            pos += res[i];
+            if(res[i] < want) {
+                if(res[i] == 0)
+                    return pos; // end of file (it shrank), or no space
+                break;          // short: go on from here, redoing the rest of the window
+            }
+        }
+    }
+    return pos;
+}
+
+inline String Uring::LoadFile(const char *path)
+{
+    int f = open(path, O_RDONLY | O_CLOEXEC);
+    if(f < 0)
+        return String::GetVoid();
+    struct stat st;
+    if(fstat(f, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size >= INT_MAX) {
+        close(f);
+        return Upp::LoadFile(path); // size unknown up front (procfs, pipes), or too big anyway
+    }
+    StringBuffer b((int)st.st_size);
+    int64 n = Transfer(f, (byte *)b.Begin(), st.st_size, false);
+    close(f);
+    if(n < 0)
+        return String::GetVoid();
+    b.SetCount((int)n);
+    return String(b);
+}
+
+inline bool Uring::SaveFile(const char *path, const String& data)
+{
+    int f = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(f < 0)
+        return false;
+    bool ok = Transfer(f, (byte *)~data, data.GetCount(), true) == data.GetCount();
+    return close(f) == 0 && ok;
+}
+#endif
+
+inline SSL_CTX *TlsContext::Get(const String& cert_path, const String& key_path)
+{
+    static Mutex lock;
+    static VectorMap<String, SSL_CTX *> cache;
+    Mutex::Lock __(lock);
+    String k = cert_path + '\n' + key_path;
+    int q = cache.Find(k);
+    if(q >= 0)
+        return cache[q];
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx)
+        return NULL;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS); // idle connections give their record buffers back
+    // Resumption: stateless tickets (on by default, keys live in the ctx) for
+    // TLS 1.3 and capable 1.2 clients, plus the server session cache for the rest.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const byte *)"upp-ws", 6);
+    SSL_CTX_sess_set_cache_size(ctx, 32768);
+    SSL_CTX_set_timeout(ctx, 4 * 3600);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1 ||
+       SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(ctx) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    cache.Add(k, ctx);
+    return ctx;
+}
+
+inline String Frame::EncodeHeader(bool mask)
+{
+    String out;
+    byte b0 = (fin ? 0x80 : 0x00) | (rsv1 ? 0x40 : 0x00) | (opcode & 0x0F);
+    out.Cat(b0);
+
+    int payload_len = payload.GetCount();
+    byte b1 = mask ? 0x80 : 0x00;
+    if(payload_len < 126) {
+        out.Cat(b1 | (byte)payload_len);
+    }
+    else if(payload_len <= 0xFFFF) {
+        out.Cat(b1 | 126);
+        out.Cat((byte)(payload_len >> 8));
+        out.Cat((byte)(payload_len & 0xFF));
+    }
+    else {
+        out.Cat(b1 | 127);
+        uint64 len64 = payload_len;
+        for(int i = 7; i >= 0; --i)
+            out.Cat((byte)(len64 >> (i * 8)));
+    }
+
+    if(mask) {
+        for(int i = 0; i < 4; i++)
+            mask_key[i] = (byte)Random();
+        out.Cat((const char*)mask_key, 4);
+    }
+    return out;
+}
+
+inline String Frame::Encode(bool mask)
+{
+    String out = EncodeHeader(mask);
+    int payload_len = payload.GetCount();
+    if(mask) {
+        StringBuffer data(payload_len);
+        memcpy(~data, ~payload, payload_len);
+        MaskBytes((byte*)~data, payload_len, mask_key);
+        out.Cat(~data, payload_len);
+    }
+    else
+        out.Cat(payload);
+    return out;
+}
+
+inline int Frame::DecodeHeader(const byte* b, int sz)
+{
+    if(sz < 2)
+        return 0;
+    fin = (b[0] & 0x80) != 0;
+    rsv1 = (b[0] & 0x40) != 0;
+    if(b[0] & 0x30)
+        return -1; // RSV2/RSV3 are not negotiated
+    opcode = b[0] & 0x0F;
+    masked = (b[1] & 0x80) != 0;
+    uint64 length = b[1] & 0x7F;
+    int pos = 2;
+    if(length == 126) {
+        if(sz < pos + 2) return 0;
+        length = ((uint64)b[pos] << 8) | b[pos+1];
+        pos += 2;
+    } else if(length == 127) {
+        if(sz < pos + 8) return 0;
+        length = 0;
+        for(int i = 0; i < 8; i++)
+            length = (length << 8) | b[pos++];
+    }
+    if(length > (uint64)INT_MAX - 16)
+        return -1;
+
+    if(masked) {
+        if(sz < pos + 4) return 0;
+        memcpy(mask_key, b + pos, 4);
+        pos += 4;
+    } else {
+        memset(mask_key, 0, 4);
+    }
+    len = (int)length;
+    return pos;
+}
+
+inline void Frame::Unmask(byte* data, int n, int offset) const
+{
+    if(!masked)
+        return;
+    byte key[4];
+    for(int i = 0; i < 4; i++)
+        key[i] = mask_key[(i + offset) & 3];
+    MaskBytes(data, n, key);
+}
+
+inline bool Frame::Decode(const void* buf, int sz, int& used, bool expect_mask)
+{
+    used = 0;
+    const byte* b = static_cast<const byte*>(buf);
+    int pos = DecodeHeader(b, sz);
+    if(pos <= 0 || sz - pos < len)
+        return false;
+
+    StringBuffer sb(len);
+    memcpy(~sb, b + pos, len);
+    Unmask((byte*)~sb, len);
+    payload = sb;
+
+    used = pos + len;
+    if(expect_mask && !masked)
+        return false;
+    return true;
+}
+
+inline Endpoint::~Endpoint()
+{
+    Vector<Event<>> run = pick(drained); // waiters must not hang on an endpoint that is gone
+    for(Event<>& fn : run)
+        fn();
+#ifdef PLATFORM_LINUX
+    if(shm && owner)
+        owner->Unwatch(shm->GetEventFd()); // the client holds a copy, closing ours would not do it
+#endif
+    if(owner && peer_key.GetCount())
+        owner->Release(*this);
+    ZPool::Release(tx_z, true, TxWindowBits(), deflate.level);
+    ZPool::Release(rx_z, false);
+    if(tls) {
+        if(SSL_is_init_finished(tls))
+            SSL_shutdown(tls); // best-effort close_notify; sock closes the descriptor
+        SSL_free(tls);
+    }
+}
+
+inline bool Endpoint::SendData(int opcode, const String& data)
+{
+    if(closed)
+        return false;
+#ifdef PLATFORM_LINUX
+    if(shm && opcode == Frame::TEXT && data.GetCount() <= shm->GetMaxMessage()) {
+        if(!shm_backlog.IsEmpty() || !shm->Send(~data, data.GetCount()))
+            shm_backlog.AddTail(data);
+        if(owner)
+            owner->MarkDirty(*this); // Flush() wakes the peer once for the whole batch
+        else
+            FlushShm();
+        return true;
+    }
+#endif
+    Frame f;
+    f.opcode = opcode;
+    if(deflate_on && data.GetCount() >= deflate.min_size && Compress(data, f.payload))
+        f.rsv1 = true;
+    else
+        f.payload = data;
+    f.len = f.payload.GetCount();
+    SendFrame(f);
+    return true;
+}
+
+inline bool Endpoint::SendText(const String& s)
+{
+    return SendData(Frame::TEXT, s);
+}
+
+inline String Endpoint::PrepareText(const String& text)
+{
+    Frame f;
+    f.opcode = Frame::TEXT;
+    f.payload = text; // shared, only its length is looked at
+    f.len = text.GetCount();
+    return f.EncodeHeader(false) + text;
+}
+
+inline bool Endpoint::SendPrepared(const String& text, const String& frame)
+{
+    if(closed)
+        return false;
+#ifdef PLATFORM_LINUX
+    if(shm)
+        return SendText(text);
+#endif
+    if(masked || deflate_on && text.GetCount() >= deflate.min_size)
+        return SendText(text);
+    outbuf.Add(frame);
+    tx_bytes += frame.GetCount();
+    Queued(frame.GetCount());
+    return true;
+}
+
+inline bool Endpoint::SendBinary(const String& data)
+{
+    return SendData(Frame::BINARY, data);
+}
+
+inline bool Endpoint::SendBinary(const void* data, int len)
+{
+    return SendBinary(String((const char*)data, len));
+}
+
+inline bool Endpoint::Compress(const String& in, String& out)
+{
+    if(!tx_z)
+        tx_z = ZPool::GetDeflater(TxWindowBits(), deflate.level);
+    if(!tx_z)
+        return false;
+    z_stream& z = *tx_z;
+    StringBuffer r((int)deflateBound(&z, in.GetCount()) + 16);
+    z.next_in = (Bytef *)~in;
+    z.avail_in = in.GetCount();
+    int total = 0;
+    for(;;) {
+        z.next_out = (Bytef *)~r + total;
+        z.avail_out = r.GetCount() - total;
+        int e = deflate(&z, Z_SYNC_FLUSH);
+        total = r.GetCount() - z.avail_out;
+        if(e != Z_OK && e != Z_BUF_ERROR)
+            return false;
+        if(z.avail_out)
+            break;
+        r.SetCount(2 * r.GetCount());
+    }
+    if(total >= 4 && memcmp(~r + total - 4, "\x00\x00\xff\xff", 4) == 0)
+        total -= 4; // RFC 7692 7.2.1: drop the sync flush marker
+    r.SetCount(total);
+    out = r;
+    if(TxNoTakeover()) { // next message starts from scratch, so the stream can go back
+        ZPool::Release(tx_z, true, TxWindowBits(), deflate.level);
+        tx_z = NULL;
+    }
+    return true;
+}
+
+inline bool Endpoint::Decompress(const byte *in, int n, String& out, bool fin, int64 limit)
+{
+    static const byte tail[4] = { 0x00, 0x00, 0xff, 0xff };
+    const int max_out = (int)minmax(limit, (int64)0, (int64)INT_MAX - 1); // guard against inflation bombs
+    if(!rx_z)
+        rx_z = ZPool::GetInflater();
+    if(!rx_z)
+        return false;
+    z_stream& z = *rx_z;
+    StringBuffer r(min(max(4 * n, 1024), max(max_out, 1)));
+    int total = 0;
+    bool end = false;
+    for(int pass = 0; pass < (fin ? 2 : 1) && !end; pass++) {
+        z.next_in = (Bytef *)(pass ? tail : in);
+        z.avail_in = pass ? 4 : n;
+        while(!end) {
+            if(total == r.GetCount()) {
+                if(total >= max_out) {
+                    r.SetCount(total);
+                    out = r; // a full buffer tells the caller the message is too big
+                    return false;
+                }
+                r.SetCount(min(2 * total, max_out));
+            }
+            z.next_out = (Bytef *)~r + total;
+            z.avail_out = r.GetCount() - total;
+            int e = inflate(&z, Z_SYNC_FLUSH);
+            total = r.GetCount() - z.avail_out;
+            if(e == Z_STREAM_END)
+                end = true; // peer finished with BFINAL; the rest of the input is padding
+            else
+            if(e != Z_OK && e != Z_BUF_ERROR)
+                return false;
+            if(z.avail_in == 0 && z.avail_out)
+                break; // input used up and nothing left pending
+        }
+    }
+    r.SetCount(total);
+    out = r;
+    if(end)
+        inflateReset(&z);
+    if(fin && RxNoTakeover()) {
+        ZPool::Release(rx_z, false);
+        rx_z = NULL;
+    }
+    return true;
+}
+
+inline void Endpoint::Close(int code, const String& reason)
+{
+    if(closed)
+        return;
+    Frame f;
+    f.opcode = Frame::CLOSE;
+    f.payload.Cat((byte)(code >> 8));
+    f.payload.Cat((byte)(code & 0xFF));
+    f.payload << reason;
+    f.len = f.payload.GetCount();
+    SendFrame(f);
+    closed = true;
+    close_code = code;
+}
+
+inline void Endpoint::SendFrame(Frame& f)
+{
+    if(masked) { // client frames have to be masked, which means a copy anyway
+        String raw = f.Encode(true);
+        outbuf.Add(raw);
+        tx_bytes += raw.GetCount();
+        Queued(raw.GetCount());
+        return;
+    }
+    String hdr = f.EncodeHeader(false);
+    outbuf.Add(hdr);
+    outbuf.Add(f.payload);
+    tx_bytes += hdr.GetCount() + f.payload.GetCount();
+    Queued(hdr.GetCount() + f.payload.GetCount());
+}
+
+inline bool Endpoint::WritePending()
+{
+    while(!outbuf.IsEmpty()) {
+        int n = Send();
+        if(n < 0) {
+            Fatal(-1, "write error");
+            return false;
+        }
+        if(n == 0)
+            break; // EPOLLOUT will call us again
+        outbuf.Consume(n);
+        Queued(-n);
+    }
+    return true;
+}
+
+inline int Endpoint::Send()
+{
+    if(owner)
+        Server::Bump(owner->write_calls, 1);
+    if(tx_early != INT_MIN) { // already sent by the owner's batch
+        int n = tx_early;
+        tx_early = INT_MIN;
+        return n >= 0 ? n : n == -EAGAIN ? 0 : -1;
+    }
+    if(tls) {
+        // Small segments (frame headers, short replies) are packed into one record;
+        // after a would-block OpenSSL wants the call repeated with the same length.
+        byte rec[16384];
+        const byte *p;
+        int len = outbuf.GetChunk(p);
+        int want = tls_retry ? tls_retry : len >= (int)sizeof(rec) ? len : (int)min<int64>(outbuf.GetCount(), sizeof(rec));
+        if(len < want) {
+            outbuf.Copy(rec, want);
+            p = rec;
+        }
+        ERR_clear_error();
+        int n = SSL_write(tls, p, want);
+        if(n > 0) {
+            tls_retry = 0;
+            return n;
+        }
+        int err = SSL_get_error(tls, n);
+        if(err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ)
+            return -1;
+        tls_retry = want;
+        return 0;
+    }
+#ifdef PLATFORM_LINUX
+    if(!ssl_sock) {
+        iovec iov[64];
+        int cnt = outbuf.Gather(iov, __countof(iov));
+        for(;;) {
+            ssize_t n;
+            if(send_fds.GetCount()) {
+                union { cmsghdr align; char buf[CMSG_SPACE(4 * sizeof(int))]; } ctl;
+                ASSERT(send_fds.GetCount() <= 4);
+                msghdr mh = {};
+                mh.msg_iov = iov;
+                mh.msg_iovlen = cnt;
+                mh.msg_control = ctl.buf;
+                mh.msg_controllen = CMSG_SPACE(send_fds.GetCount() * sizeof(int));
+                cmsghdr *c = CMSG_FIRSTHDR(&mh);
+                c->cmsg_level = SOL_SOCKET;
+                c->cmsg_type = SCM_RIGHTS;
+                c->cmsg_len = CMSG_LEN(send_fds.GetCount() * sizeof(int));
+                memcpy(CMSG_DATA(c), send_fds.begin(), send_fds.GetCount() * sizeof(int));
+                n = sendmsg(sock.GetSOCKET(), &mh, MSG_NOSIGNAL);
+                if(n > 0)
+                    send_fds.Clear(); // they travel with the first byte
+            }
+            else
+                n = writev(sock.GetSOCKET(), iov, cnt);
+            if(n >= 0)
+                return (int)n;
+            if(errno != EINTR)
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+#endif
+    const byte *p;
+    int len = outbuf.GetChunk(p);
+    int n = sock.Put(p, len);
+    return sock.IsError() || n < 0 ? -1 : n;
+}
+
+inline int Endpoint::Recv(byte *buf, int len)
+{
+    if(tls) {
+        ERR_clear_error();
+        int n = SSL_read(tls, buf, len);
+        if(n > 0)
+            return n;
+        switch(SSL_get_error(tls, n)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+        case SSL_ERROR_ZERO_RETURN:
+        case SSL_ERROR_SYSCALL:     // EOF without close_notify
+            return -1;
+        default:
+            return -2;
+        }
+    }
+#ifdef PLATFORM_LINUX
+    if(shm_wanted)
+        return RecvFds(buf, len);
+#endif
+    int n = sock.Get(buf, len);
+    if(sock.IsError() || n < 0)
+        return -2;
+    return n == 0 && sock.IsEof() ? -1 : n;
+}
+
+#ifdef PLATFORM_LINUX
+inline int Endpoint::RecvFds(byte *buf, int len)
+{
+    iovec iov = { buf, (size_t)len };
+    union { cmsghdr align; char buf[CMSG_SPACE(4 * sizeof(int))]; } ctl;
+    msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    ssize_t n;
+    while((n = recvmsg(sock.GetSOCKET(), &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if(n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -2;
+    for(cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c))
+        if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int cnt = int((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int fd[4];
+            memcpy(fd, CMSG_DATA(c), min(cnt, 4) * sizeof(int));
+            if(cnt == 3 && !shm) {
+                shm.Create();
+                if(shm->Attach(fd[0], fd[1], fd[2])) {
+                    shm->Sleep(); // the server may answer before we ever wait
+                    shm_wanted = false;
+                }
+                else
+                    shm.Clear(); // closes them
+            }
+            else
+                for(int i = 0; i < cnt && i < 4; i++)
+                    close(fd[i]);
+        }
+    return n == 0 ? -1 : (int)n;
+}
+
+inline void Endpoint::DrainShm()
+{
+    shm->Awake();
+    FlushShm(); // a blocked send may be why we were woken
+    for(;;) {
+        String msg;
+        bool got = false;
+        // While our replies wait for room nothing new is taken on, so a client
+        // that stops reading fills its request ring and stalls, not our memory.
+        while(shm_backlog.IsEmpty() && !closed && !paused && shm->Receive(msg)) {
+            DeliverString(Frame::TEXT, msg);
+            got = true;
+        }
+        if(got) {
+            last_rx = last_data = msecs();
+            ping_out = false;
+        }
+        FlushShm();
+        if(shm->IsBroken()) {
+            Fatal(1002, "corrupt shared-memory ring");
+            break;
+        }
+        if(!shm_backlog.IsEmpty() || closed || paused || shm->Sleep())
+            break;
+    }
+}
+
+inline void Endpoint::FlushShm()
+{
+    while(shm_backlog.GetCount() && shm->Send(~shm_backlog.Head(), shm_backlog.Head().GetCount()))
+        shm_backlog.DropHead();
+    shm->Notify();
+}
+#endif
+
+inline bool Endpoint::AttachShm(const String& ready, int capacity)
+{
+#ifdef PLATFORM_LINUX
+    if(!owner || peer_uid < 0 || tls || shm || closed)
+        return false;
+    One<ShmChannel> ch;
+    ch.Create();
+    if(!ch->Create(capacity) || !owner->Watch(ch->GetEventFd(), (byte *)this + 1, EPOLLIN))
+        return false;
+    ch->Sleep();
+    ch->GetFds(send_fds);
+    SendData(Frame::TEXT, ready); // still over the socket, carrying the descriptors
+    shm = pick(ch);
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline bool Endpoint::IsShm() const
+{
+#ifdef PLATFORM_LINUX
+    return shm;
+#else
+    return false;
+#endif
+}
+
+inline bool Endpoint::TlsAccept(int deadline)
+{
+    for(;;) {
+        ERR_clear_error();
+        int r = SSL_accept(tls);
+        if(r == 1)
+            return true;
+        int err = SSL_get_error(tls, r);
+        int left = deadline - msecs();
+        if(left <= 0 || (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE))
+            return false;
+        sock.Timeout(left);
+        if(!(err == SSL_ERROR_WANT_READ ? sock.WaitRead() : sock.WaitWrite()))
+            return false;
+    }
+}
+
+inline bool Endpoint::ReadFrames()
+{
+    if(paused) {
+        rx_drained = false;
+        return true; // the peer has to read first; TCP flow control holds it back meanwhile
+    }
+    bool got = false;
+    int budget = owner ? owner->read_budget : INT_MAX;
+    while(!rx_drained) {
+        if(budget <= 0) { // the rest waits for the next pass, after the other endpoints had theirs
+            owner->Readable(*this);
+            break;
+        }
+        int room;
+        byte *w = inbuf.GetWriteSpace(4096, room); // recv straight into the ring
+        int n = Recv(w, room);
+        if(n == -2) {
+            Fatal(-1, "read error");
+            return false;
+        }
+        if(n <= 0) {
+            if(n < 0)
+                Lost();
+            break;
+        }
+        rx_bytes += n;
+        inbuf.Commit(n);
+        budget -= n;
+        got = true;
+    }
+    rx_drained = false;
+    if(got) { // any traffic proves the peer alive, the keepalive timer checks these lazily
+        last_rx = msecs();
+        ping_out = false;
+    }
+
+    if(handshaking) {
+        // Frames pipelined behind the upgrade wait until the owner installed handlers.
+        HandshakeServer(owner ? owner->ws_path : String("/"));
+        return true;
+    }
+    return ParseFrames();
+}
+
+inline void Endpoint::Received(int res, int room)
+{
+    if(res > 0) {
+        rx_bytes += res;
+        inbuf.Commit(res);
+        last_rx = msecs();
+        ping_out = false;
+    }
+    // A short read emptied the socket, so ReadFrames() can skip straight to parsing;
+    // errors and EOF are left for its own recv to find again.
+    rx_drained = res == -EAGAIN || (res > 0 && res < room);
+}
+
+inline bool Endpoint::ParseFrames()
+{
+    while(!closed && !paused) {
+        int avail = inbuf.GetCount();
+        if(stream_left) { // continue a large frame that is streamed piecewise
+            int n = min(avail, stream_left);
+            if(n == 0)
+                break;
+            byte *p = inbuf.Peek(n);
+            stream_frame.Unmask(p, n, stream_pos);
+            bool begin = stream_pos == 0;
+            stream_left -= n;
+            stream_pos += n;
+            bool ok = OnData(stream_frame, p, n, begin, stream_left == 0);
+            inbuf.Consume(n);
+            if(!ok)
+                return false;
+            continue;
+        }
+
+        Frame f;
+        int hdr = f.DecodeHeader(inbuf.Peek(min(avail, 14)), min(avail, 14));
+        if(hdr < 0) {
+            Fatal(1002, "bad frame header");
+            return true; // the close frame still goes out
+        }
+        if(hdr == 0)
+            break;
+        bool control = f.opcode >= Frame::CLOSE;
+        bool bad = control ? !f.fin || f.len > 125 || f.rsv1
+                           : f.opcode == Frame::CONT ? !msg_opcode || f.rsv1
+                                                      : msg_opcode || (f.rsv1 && !deflate_on);
+        if(bad || (f.opcode > Frame::BINARY && !control)) {
+            Fatal(1002, "protocol error");
+            return true; // the close frame still goes out
+        }
+        if(!control && (msg_deflated || f.rsv1 ? f.len : msg_size + f.len) > max_message)
+            return TooBig(); // known from the header already, do not buffer it
+        if(avail - hdr < f.len) {
+            // Without compression a streaming consumer can take the frame in pieces.
+            if(WhenFragment && !control && !f.rsv1 && !msg_deflated && avail > hdr) {
+                inbuf.Consume(hdr);
+                stream_frame = f;
+                stream_left = f.len;
+                stream_pos = 0;
+                continue;
+            }
+            break;
+        }
+        byte *p = inbuf.PeekZ(hdr + f.len) + hdr;
+        f.Unmask(p, f.len);   // in place, the bytes are consumed right after
+        bool ok = true;
+        if(control) {
+            f.payload = String((const char*)p, f.len);
+            HandleControl(f);
+        }
+        else
+            ok = OnData(f, p, f.len, true, true);
+        inbuf.Consume(hdr + f.len);
+        if(!ok)
+            return false;
+    }
+    inbuf.Shrink();
+    return true;
+}
+
+inline bool Endpoint::TooBig()
+{
+    msg_buf.Clear();
+    Close(1009, "message too big");
+    return true; // the close frame still has to go out
+}
+
+// One data frame, or a chunk of one when streaming; p is unmasked and may be
+// NUL-terminated in place at p[n] when the frame was delivered whole.
+inline bool Endpoint::OnData(const Frame& f, byte *p, int n, bool frame_begin, bool frame_end)
+{
+    if(f.opcode != Frame::CONT && frame_begin) { // first bytes of a new message
+        msg_opcode = f.opcode;
+        msg_deflated = f.rsv1;
+        msg_size = 0;
+    }
+    int opcode = msg_opcode;
+    bool last = f.fin && frame_end;
+    last_data = last_rx;
+    if(last)
+        msg_opcode = 0;
+
+    String piece;
+    if(msg_deflated) {
+        int64 room = max_message - msg_size + 1;
+        if(!Decompress(p, n, piece, last, room)) {
+            if(piece.GetCount() >= room)
+                return TooBig();
+            Fatal(1007, "inflate failed");
+            return true; // the close frame still goes out
+        }
+        msg_size += piece.GetCount();
+        if(msg_size > max_message)
+            return TooBig();
+    }
+    else
+        msg_size += n;
+
+    if(WhenFragment) {
+        if(msg_deflated)
+            WhenFragment(opcode, ~piece, piece.GetCount(), last);
+        else
+            WhenFragment(opcode, (const char*)p, n, last);
+    }
+    else
+    if(last && msg_buf.IsEmpty()) { // common case: a message in one frame
+        if(msg_deflated)
+            DeliverString(opcode, piece);
+        else {
+            Event<const char*, int>& view = opcode == Frame::TEXT ? WhenTextView : WhenBinaryView;
+            if(view) {
+                byte c = p[n];
+                p[n] = 0;
+                view((const char*)p, n);
+                p[n] = c;
+            }
+            else
+                DeliverString(opcode, String((const char*)p, n));
+        }
+    }
+    else {
+        if(msg_deflated)
+            msg_buf.Cat(piece);
+        else
+            msg_buf.Cat((const char*)p, n);
+        if(last) {
+            String whole = msg_buf;
+            msg_buf.Clear();
+            DeliverString(opcode, whole);
+        }
+    }
+    if(last) {
+        msg_deflated = false;
+        msg_size = 0;
+    }
+    return true;
+}
+
+inline void Endpoint::DeliverString(int opcode, const String& data)
+{
+    Event<const char*, int>& view = opcode == Frame::TEXT ? WhenTextView : WhenBinaryView;
+    if(view)
+        view(~data, data.GetCount()); // String storage is NUL-terminated already
+    else
+    if(opcode == Frame::TEXT)
+        WhenText(data);
+    else
+        WhenBinary(data);
+}
+
+inline void Endpoint::HandleControl(Frame& f)
+{
+    switch(f.opcode) {
+    case Frame::PING:
+        {
+            Frame pong;
+            pong.opcode = Frame::PONG;
+            pong.payload = f.payload;
+            pong.len = pong.payload.GetCount();
+            SendFrame(pong);
+            break;
+        }
+    case Frame::CLOSE:
+        {
+            int code = f.len >= 2 ? (byte)f.payload[0] << 8 | (byte)f.payload[1] : 1005;
+            Close(code == 1005 ? 1000 : code, String()); // echo, completing the closing handshake
+            reported = true;
+            if(WhenClose)
+                WhenClose(code, f.payload.Mid(2));
+            break;
+        }
+    }
+}
+
+inline void Endpoint::Fatal(int err, const char* msg)
+{
+    if(err >= 1000)
+        Close(err, msg); // protocol errors are answered with a close frame
+    closed = true;
+    reported = true;
+    if(WhenError)
+        WhenError(err);
+}
+
+inline void Endpoint::Lost()
+{
+    if(closed)
+        return;
+    closed = true;
+    reported = true;
+    if(WhenClose)
+        WhenClose(1006, "connection lost");
+}
+
+inline bool Endpoint::HandshakeClient(const String& host, const String& path)
+{
+    String key;
+    for(int i = 0; i < 16; i++)
+        key.Cat((char)Random());
+    String request;
+    request << "GET " << path << " HTTP/1.1\r\n"
+            << "Host: " << host << "\r\n"
+            << "Upgrade: websocket\r\n"
+            << "Connection: Upgrade\r\n"
+            << "Sec-WebSocket-Version: 13\r\n"
+            << "Sec-WebSocket-Key: " << Base64Encode(key) << "\r\n";
+    if(deflate.enabled)
+        request << "Sec-WebSocket-Extensions: " << deflate.Offer() << "\r\n";
+    request << "\r\n";
+
+    if(!sock.PutAll(request))
+        return false;
+
+    String line, header;
+    while(!(line = sock.GetLine(8192)).IsEmpty())
+        header << line << "\n";
+
+    if(header.Find("101") < 0)
+        return false;
+
+    deflate_on = false;
+    for(const String& l : Split(header, '\n'))
+        if(ToLower(l).StartsWith("sec-websocket-extensions:")) {
+            DeflateOptions agreed;
+            if(!deflate.enabled || !deflate.Accept(TrimBoth(l.Mid(l.Find(':') + 1)), agreed))
+                return false; // server picked something we never offered
+            deflate = agreed;
+            deflate_on = true;
+        }
+
+    masked = true;
+    return true;
+}
+
+inline void Endpoint::Refuse(int code, const char *text, const char *extra)
+{
+    String r;
+    r << "HTTP/1.1 " << code << ' ' << text << "\r\n"
+      << extra
+      << "Connection: close\r\n"
+      << "Content-Length: 0\r\n\r\n";
+    outbuf.Add(r);
+    Queued(r.GetCount());
+    closed = true; // reaped once the response is flushed
+}
+
+inline int Endpoint::HandshakeServer(const String& ws_path)
+{
+    const int max_request = 16384;
+    int n = inbuf.GetCount();
+    const char *p = (const char *)inbuf.Peek(n);
+    int end = -1;
+    for(int i = max(hs_scanned, 3); i < n; i++)
+        if(p[i] == '\n' && p[i - 1] == '\r' && p[i - 2] == '\n' && p[i - 3] == '\r') {
+            end = i + 1;
+            break;
+        }
+    if(end < 0) {
+        hs_scanned = n;
+        if(n > max_request) {
+            Refuse(431, "Request Header Fields Too Large");
+            return -1;
+        }
+        return 0;
+    }
+    String header(p, end);
+    inbuf.Consume(end);
+    if(reject) {
+        Refuse(reject, "Service Unavailable", "Retry-After: 5\r\n");
+        return -1;
+    }
+
+    Vector<String> lines = Split(header, '\n');
+    Vector<String> request_line = Split(lines.GetCount() ? TrimBoth(lines[0]) : String(), ' ');
+    if(request_line.GetCount() != 3 || request_line[0] != "GET") {
+        Refuse(400, "Bad Request");
+        return -1;
+    }
+    String path = request_line[1];
+    int q = path.Find('?');
+    if(q >= 0)
+        path.Trim(q);
+    if(path.GetCount() > 1 && path.EndsWith("/"))
+        path.TrimLast();
+    String want = ws_path.GetCount() > 1 && ws_path.EndsWith("/") ? ws_path.Left(ws_path.GetCount() - 1) : ws_path;
+    if(path != want) {
+        Refuse(404, "Not Found");
+        return -1;
+    }
+
+    String key, extensions, upgrade, version;
+    for(int i = 1; i < lines.GetCount(); i++) {
+        const String& l = lines[i];
+        String ll = ToLower(l);
+        String value = TrimBoth(l.Mid(l.Find(':') + 1));
+        if(ll.StartsWith("sec-websocket-key:"))
+            key = value;
+        else
+        if(ll.StartsWith("sec-websocket-extensions:"))
+            extensions << (extensions.IsEmpty() ? "" : ", ") << value;
+        else
+        if(ll.StartsWith("upgrade:"))
+            upgrade = ToLower(value);
+        else
+        if(ll.StartsWith("sec-websocket-version:"))
+            version = value;
+    }
+    if(key.IsEmpty() || upgrade.Find("websocket") < 0) {
+        Refuse(400, "Bad Request");
+        return -1;
+    }
+    if(version != "13") {
+        Refuse(426, "Upgrade Required", "Sec-WebSocket-Version: 13\r\n");
+        return -1;
+    }
+
+    DeflateOptions agreed;
+    String ext_response;
+    deflate_on = deflate.Negotiate(extensions, agreed, ext_response);
+    if(deflate_on)
+        deflate = agreed;
+
+    byte sha1[20];
+    SHA1(sha1, key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    String accept = Base64Encode((const char*)sha1, 20);
+
+    String response;
+    response << "HTTP/1.1 101 Switching Protocols\r\n"
+             << "Upgrade: websocket\r\n"
+             << "Connection: Upgrade\r\n"
+             << "Sec-WebSocket-Accept: " << accept << "\r\n";
+    if(deflate_on)
+        response << "Sec-WebSocket-Extensions: " << ext_response << "\r\n";
+    response << "\r\n";
+    outbuf.Add(response);
+    Queued(response.GetCount());
+
+    masked = false;
+    handshaking = false;
+    return 1;
+}
+
+inline void Endpoint::Queued(int delta)
+{
+    int depth = outbuf.GetCount();
+    bool pause = paused ? depth > low_water : depth > high_water;
+    if(owner) {
+        Server::Bump(owner->queued, delta);
+        if(pause != paused)
+            Server::Bump(owner->paused, pause ? 1 : -1);
+        if(delta > 0) {
+            frames_pending++;
+            owner->MarkDirty(*this);
+        }
+    }
+    paused = pause;
+    if(delta < 0 && depth <= low_water && drained.GetCount()) {
+        Vector<Event<>> run = pick(drained);
+        for(Event<>& fn : run)
+            fn();
+    }
+}
+
+inline void Endpoint::WhenDrained(Event<> fn)
+{
+    if(outbuf.GetCount() <= low_water)
+        fn();
+    else
+        drained.Add(pick(fn));
+}
+
+inline bool Endpoint::Pump()
+{
+    // read first, so replies produced by the handlers leave in this same call
+    if(!ReadFrames())
+        return false;
+#ifdef PLATFORM_LINUX
+    if(shm)
+        DrainShm();
+#endif
+    return WritePending();
+}
+
+inline bool Server::Listen(uint16 port, const String& path, bool tls, const String& cert, const String& key)
+{
+    Close();
+    ws_path = path;
+    if(tls && !(tls_ctx = TlsContext::Get(cert, key)))
+        return false;
+#ifdef PLATFORM_LINUX
+    if(reuse_port ? !ListenReusePort(port) : !listener.Listen(port, 128))
+        return false;
+#else
+    if(!listener.Listen(port, 128))
+        return false;
+#endif
+    listener.Timeout(0);
+#ifdef PLATFORM_LINUX
+    if(!StartReactor())
+        return false;
+#endif
+    if(tls_ctx) {
+        tls_stop = false;
+        for(int i = 0; i < tls_threads; i++)
+            tls_pool.Add().Run([=] { TlsWorker(); });
+    }
+    return true;
+}
+
+inline bool Server::ListenUnix(const String& socket_path, const String& path)
+{
+#ifdef PLATFORM_LINUX
+    Close();
+    ws_path = path;
+    sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if(socket_path.GetCount() >= (int)sizeof(sun.sun_path))
+        return false;
+    memcpy(sun.sun_path, ~socket_path, socket_path.GetCount());
+    struct stat st;
+    if(lstat(socket_path, &st) == 0) {
+        // Only a socket nobody listens on any more (a previous run that died) is
+        // replaced; other files, and the socket of a server still running, are not ours.
+        if(!S_ISSOCK(st.st_mode))
+            return false;
+        SOCKET probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool stale = probe >= 0 && connect(probe, (sockaddr *)&sun, sizeof(sun)) < 0 && errno == ECONNREFUSED;
+        if(probe >= 0)
+            close(probe);
+        if(!stale || unlink(socket_path))
+            return false;
+    }
+    else
+    if(errno != ENOENT)
+        return false;
+    SOCKET s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(s < 0)
+        return false;
+    // The uid check is the real gate; with one, others cannot even connect. Linux
+    // creates the socket file with the mode of the socket itself (less the umask),
+    // so it never exists more open than that, and the process umask is left alone.
+    if(allowed_uids.GetCount() && fchmod(s, 0660)) {
+        close(s);
+        return false;
+    }
+    bool bound = bind(s, (sockaddr *)&sun, sizeof(sun)) == 0;
+    if(!bound || listen(s, 128)) {
+        if(bound)
+            unlink(socket_path);
+        close(s);
+        return false;
+    }
+    listener.Attach(s);
+    unix_path = socket_path;
+    return StartReactor();
+#else
+    return false;
+#endif
+}
+
+inline void Server::Close()
+{
+    StopTls();
+    dirty.Clear();
+    readable.Clear();
+    clients.Clear();
+    dead.Clear();
+    {
+        Mutex::Lock __(post_lock);
+        posted.Clear();
+    }
+    per_ip.Clear();
+    live = 0;
+    queued = 0;
+    paused = 0;
+    listener.Close();
+#ifdef PLATFORM_LINUX
+    if(unix_path.GetCount())
+        unlink(unix_path);
+    unix_path.Clear();
+#ifdef WS_URING
+    uring.Close();
+#endif
+    if(wakefd >= 0)
+        close(wakefd);
+    if(epfd >= 0)
+        close(epfd);
+    wakefd = epfd = -1;
+#endif
+}
+
+#ifdef PLATFORM_LINUX
+inline bool Server::StartReactor()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(epfd < 0 || wakefd < 0 ||
+       !Watch(listener.GetSOCKET(), &listener, EPOLLIN) ||
+       !Watch(wakefd, &wakefd, EPOLLIN)) {
+        Close();
+        return false;
+    }
+#ifdef WS_URING
+    if(use_uring)
+        uring.Open(256); // else plain recv/writev
+#endif
+    return true;
+}
+
+inline bool Server::ListenReusePort(uint16 port)
+{
+    // TcpSocket::Listen only knows SO_REUSEADDR, so the shared listener is set up by hand
+    SOCKET s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(s < 0)
+        return false;
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(s, (sockaddr *)&sin, sizeof(sin)) || listen(s, 128)) {
+        close(s);
+        return false;
+    }
+    listener.Attach(s);
+    return true;
+}
+
+inline bool Server::Watch(SOCKET s, void *token, dword events)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = token;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) == 0;
+}
+#endif
+
+inline void Server::Wake()
+{
+#ifdef PLATFORM_LINUX
+    if(wakefd >= 0) {
+        uint64 one = 1;
+        (void)!write(wakefd, &one, sizeof(one));
+    }
+#endif
+}
+
+inline void Server::Post(Event<> fn)
+{
+    {
+        Mutex::Lock __(post_lock);
+        posted.Add(pick(fn));
+    }
+    Wake();
+}
+
+inline void Server::RunPosted()
+{
+    Vector<Event<>> run;
+    {
+        Mutex::Lock __(post_lock);
+        run = pick(posted);
+    }
+    for(Event<>& fn : run)
+        fn();
+}
+
+inline void Server::AcceptPending()
+{
+    // The listener is level-triggered: whatever is left after the batch is
+    // reported again by the next Wait(), after the ready clients had their turn.
+    for(int i = 0; i < accept_batch; i++) {
+        One<Endpoint> ep;
+        ep.Create();
+        String peer;
+        if(!Accept(*ep, peer))
+            break;
+        if(ep->peer_uid >= 0 && allowed_uids.GetCount() && allowed_uids.Find(ep->peer_uid) < 0) {
+            Bump(rejected, 1);
+            continue;
+        }
+        if(max_per_ip > 0) {
+            int q = per_ip.Find(peer);
+            if(q >= 0 && per_ip[q] >= max_per_ip) {
+                Bump(rejected, 1);
+                continue; // closed right away
+            }
+        }
+        ep->sock.Timeout(0);
+        ep->owner = this;
+        ep->peer_key = peer;
+        int q = per_ip.Find(peer);
+        if(q < 0)
+            q = per_ip.Put(peer, 0);
+        per_ip[q]++;
+        live++;
+        if(max_conns > 0 && live > max_conns) {
+            Bump(rejected, 1);
+            if(tls_ctx)
+                continue; // a 503 would first cost the TLS handshake we are trying to avoid
+            ep->reject = 503;
+        }
+        ep->Deflate(deflate);
+        ep->MaxMessageSize(max_message);
+        ep->WaterMarks(high_water, low_water);
+        ep->handshaking = true;
+        ep->hs_deadline = msecs() + handshake_timeout;
+        if(tls_ctx) {
+            ep->tls = SSL_new(tls_ctx);
+            if(!ep->tls || !SSL_set_fd(ep->tls, (int)ep->sock.GetSOCKET()))
+                continue;
+            SSL_set_accept_state(ep->tls);
+            Mutex::Lock __(tls_lock);
+            tls_todo.AddTail(ep.Detach());
+            tls_cv.Signal();
+            continue;
+        }
+        Adopt(clients.Add(ep.Detach()));
+    }
+}
+
+inline bool Server::Accept(Endpoint& ep, String& peer)
+{
+    TcpSocket& s = ep.sock;
+#ifdef PLATFORM_LINUX
+    sockaddr_storage sa;
+    for(;;) {
+        socklen_t len = sizeof(sa);
+        int fd = accept4(listener.GetSOCKET(), (sockaddr *)&sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd >= 0) {
+            if(!s.Attach(fd)) {
+                close(fd);
+                return false;
+            }
+            break;
+        }
+        if(errno != EINTR && errno != ECONNABORTED)
+            return false; // EAGAIN, or out of descriptors: retried when reported again
+    }
+    if(sa.ss_family == AF_UNIX) {
+        ucred cred;
+        socklen_t len = sizeof(cred);
+        if(getsockopt(s.GetSOCKET(), SOL_SOCKET, SO_PEERCRED, &cred, &len))
+            return false;
+        ep.peer_uid = cred.uid;
+        ep.peer_pid = cred.pid;
+        peer = "uid:" + AsString(cred.uid); // per-address limits become per-user limits
+    }
+    else
+    if(sa.ss_family == AF_INET6)
+        peer = String((const char *)&((sockaddr_in6 *)&sa)->sin6_addr, 16);
+    else
+        peer = String((const char *)&((sockaddr_in *)&sa)->sin_addr, 4);
+    return true;
+#else
+    if(!s.Accept(listener))
+        return false;
+    peer = s.GetPeerAddr();
+    return true;
+#endif
+}
+
+inline void Server::Release(Endpoint& ep)
+{
+    int q = per_ip.Find(ep.peer_key);
+    if(q >= 0 && --per_ip[q] <= 0)
+        per_ip.Unlink(q); // Put() reuses the slot
+    live--;
+}
+
+inline void Server::Adopt(Endpoint& ep)
+{
+    ep.slot = clients.GetCount() - 1; // just added
+    if(ep.peer_uid < 0)
+        ep.sock.NoDelay(); // coalescing is done by Flush(), Nagle would only add latency
+#ifdef PLATFORM_LINUX
+    if(!Watch(ep.sock.GetSOCKET(), &ep, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+        clients.Drop();
+        return;
+    }
+#endif
+    ep.timer.data = &ep;
+    timers.Schedule(ep.timer, handshake_timeout);
+    Service(ep, true, false); // the request often arrives together with the connection
+}
+
+inline void Server::TlsWorker()
+{
+    for(;;) {
+        Endpoint *ep;
+        {
+            Mutex::Lock __(tls_lock);
+            while(!tls_stop && tls_todo.IsEmpty())
+                tls_cv.Wait(tls_lock);
+            if(tls_stop)
+                return;
+            ep = tls_todo.Head();
+            tls_todo.DropHead();
+            tls_busy.Add(ep);
+        }
+        bool ok = ep->TlsAccept(ep->hs_deadline);
+        if(ok)
+            (SSL_session_reused(ep->tls) ? tls_resumed : tls_full)++;
+        {
+            Mutex::Lock __(tls_lock);
+            tls_busy.Remove(FindIndex(tls_busy, ep));
+            ep->closed = !ok;
+            tls_done.Add(ep);
+        }
+        Wake();
+    }
+}
+
+inline void Server::AdoptTls()
+{
+    Vector<Endpoint *> done;
+    {
+        Mutex::Lock __(tls_lock);
+        if(tls_done.IsEmpty())
+            return;
+        done = pick(tls_done);
+    }
+    for(Endpoint *ep : done) {
+        if(ep->closed) {
+            delete ep;
+            continue;
+        }
+        ep->sock.Timeout(0);
+        Adopt(clients.Add(ep)); // the HTTP upgrade gets a fresh handshake_timeout
+    }
+}
+
+inline void Server::StopTls()
+{
+    {
+        Mutex::Lock __(tls_lock);
+        tls_stop = true;
+        for(Endpoint *ep : tls_busy)
+            ep->sock.Shutdown(); // cuts the worker's wait short
+        tls_cv.Broadcast();
+    }
+    for(Thread& t : tls_pool)
+        t.Wait();
+    tls_pool.Clear();
+    for(Endpoint *ep : tls_todo)
+        delete ep;
+    for(Endpoint *ep : tls_done)
+        delete ep;
+    tls_todo.Clear();
+    tls_done.Clear();
+    tls_ctx = NULL;
+}
+
+inline void Server::Service(Endpoint& ep, bool readable, bool writable)
+{
+    bool ok = true;
+    bool was_handshaking = ep.handshaking;
+    if(readable)
+        ok = ep.ReadFrames();
+    if(ok && was_handshaking && !ep.handshaking) {
+        ep.last_rx = ep.last_data = msecs();
+        Arm(ep, ep.last_rx);
+        WhenAccept(ep);
+        ok = ep.ReadFrames(); // frames that came in right behind the upgrade request
+    }
+    // Replies produced by the handlers above are not written here: Flush() sends
+    // everything an endpoint accumulated during this Wait() in one writev.
+    if(ok && writable && ep.HasPending())
+        MarkDirty(ep);
+    if(!ok || (ep.IsClosed() && !ep.HasPending()))
+        Dead(ep);
+}
+
+inline bool Server::IsIoUring() const
+{
+#ifdef WS_URING
+    return uring.IsOpen();
+#else
+    return false;
+#endif
+}
+
+#ifdef WS_URING
+inline void Server::RecvBatch(const epoll_event *ev, int n)
+{
+    int room[64];
+    int count = 0;
+    for(int i = 0; i < n && i < (int)__countof(room); i++) {
+        void *token = ev[i].data.ptr;
+        if(token == &listener || token == &wakefd || ((uintptr_t)token & 1) || !(ev[i].events & EPOLLIN))
+            continue;
+        Endpoint& ep = *(Endpoint *)token;
+        if(ep.tls || ep.paused || ep.closed)
+            continue;
+        io_uring_sqe *s = uring.GetSqe();
+        if(!s)
+            break;
+        s->opcode = IORING_OP_RECV;
+        s->fd = ep.sock.GetSOCKET();
+        s->addr = (uint64)(uintptr_t)ep.inbuf.GetWriteSpace(4096, room[i]);
+        s->len = room[i];
+        s->msg_flags = MSG_DONTWAIT;
+        s->user_data = i;
+        count++;
+    }
+    if(!count)
+        return;
+    bool ok = uring.Run(count);
+    uring.Reap([&](uint64 i, int res) { ((Endpoint *)ev[i].data.ptr)->Received(res, room[i]); });
+    if(!ok)
+        uring.Close(); // endpoints without a completion just read for themselves
+}
+
+inline void Server::SendBatch()
+{
+    const int IOV = 16;
+    int n = dirty.GetCount();
+    tx_msg.SetCount(n);
+    tx_iov.SetCount(n * IOV);
+    int count = 0;
+    for(int i = 0; i < n; i++) {
+        Endpoint& ep = *dirty[i];
+        if(ep.tls || ep.outbuf.IsEmpty() || ep.send_fds.GetCount())
+            continue;
+        io_uring_sqe *s = uring.GetSqe();
+        if(!s)
+            break;
+        msghdr& m = tx_msg[i];
+        memset(&m, 0, sizeof(m));
+        m.msg_iov = &tx_iov[i * IOV];
+        m.msg_iovlen = ep.outbuf.Gather(m.msg_iov, IOV);
+        s->opcode = IORING_OP_SENDMSG;
+        s->fd = ep.sock.GetSOCKET();
+        s->addr = (uint64)(uintptr_t)&m;
+        s->len = 1;
+        s->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+        s->user_data = i;
+        count++;
+    }
+    if(!count)
+        return;
+    bool ok = uring.Run(count);
+    uring.Reap([&](uint64 i, int res) { dirty[(int)i]->tx_early = res; }); // Send() returns it
+    if(!ok)
+        uring.Close();
+}
+#endif
+
+inline void Server::Flush()
+{
+#ifdef WS_URING
+    if(uring.IsOpen())
+        SendBatch(); // endpoints that get queued from here on write for themselves
+#endif
+    for(int i = 0; i < dirty.GetCount(); i++) { // resumed endpoints may append to the list
+        Endpoint& ep = *dirty[i];
+        ep.dirty = false;
+        Bump(frames_flushed, ep.frames_pending);
+        ep.frames_pending = 0;
+        bool was_paused = ep.paused;
+#ifdef PLATFORM_LINUX
+        if(ep.shm)
+            ep.FlushShm();
+#endif
+        bool ok = ep.WritePending();
+        if(ok && was_paused && !ep.paused) {
+            // drained below the low-water mark: input that arrived meanwhile raised no
+            // new edge, so pick it up now
+            ok = ep.ParseFrames() && ep.ReadFrames();
+#ifdef PLATFORM_LINUX
+            if(ok && ep.shm)
+                ep.DrainShm();
+#endif
+        }
+        if(!ok || (ep.IsClosed() && !ep.HasPending()))
+            Dead(ep);
+    }
+    dirty.Clear();
+}
+
+inline void Server::Arm(Endpoint& ep, int now)
+{
+    int delay = INT_MAX;
+    if(ep.ping_out)
+        delay = ep.ping_sent + pong_timeout - now;
+    else
+    if(ping_interval > 0)
+        delay = ep.last_rx + ping_interval - now;
+    if(idle_timeout > 0)
+        delay = min(delay, ep.last_data + idle_timeout - now);
+    if(delay < INT_MAX)
+        timers.Schedule(ep.timer, delay, now);
+    else
+        ep.timer.Cancel();
+}
+
+inline void Server::OnTimer(Endpoint& ep)
+{
+    int now = msecs();
+    if(ep.handshaking || ep.closed) { // upgrade too slow, or the peer never took our close frame
+        ep.closed = true;
+        Dead(ep);
+        return;
+    }
+    if(ep.paused) { // not reading, so no pong could be seen; a dead peer fails the writes instead
+        timers.Schedule(ep.timer, max(ping_interval, pong_timeout), now);
+        return;
+    }
+    if(ep.ping_out && now - ep.ping_sent >= pong_timeout) { // half-open: nothing since the ping
+        ep.closed = true; // reported with 1006
+        Dead(ep);
+        return;
+    }
+    if(idle_timeout > 0 && now - ep.last_data >= idle_timeout) {
+        ep.Close(1001, "idle timeout"); // Flush() reaps it once the close frame is out
+        timers.Schedule(ep.timer, pong_timeout, now);
+        return;
+    }
+    if(!ep.ping_out && ping_interval > 0 && now - ep.last_rx >= ping_interval) {
+        Frame ping;
+        ping.opcode = Frame::PING;
+        ep.SendFrame(ping);
+        ep.ping_out = true;
+        ep.ping_sent = now;
+    }
+    Arm(ep, now);
+}
+
+inline void Server::Reap()
+{
+    for(int k = 0; k < dead.GetCount(); k++) { // WhenClose may let another endpoint die
+        Endpoint *ep = dead[k];
+        if(!ep->reported && !ep->handshaking && ep->WhenClose) {
+            ep->reported = true; // closed on our side (e.g. 1009), let the owner forget it
+            ep->WhenClose(ep->close_code, String());
+        }
+        queued.store(QueuedBytes() - ep->QueueDepth(), std::memory_order_relaxed);
+        if(ep->paused)
+            paused.store(PausedCount() - 1, std::memory_order_relaxed);
+        if(ep->rx_listed)
+            readable.Remove(FindIndex(readable, ep));
+        int i = ep->slot, last = clients.GetCount() - 1; // the order of clients does not matter
+        if(i != last) {
+            clients.Swap(i, last);
+            clients[i].slot = i;
+        }
+        clients.Drop(); // closes the socket, which also drops it from the epoll set
+    }
+    dead.Clear();
+}
+
+inline bool Server::Wait(int timeout_ms)
+{
+    if(!listener.IsOpen())
+        return false;
+    Vector<Endpoint*> again = pick(readable); // left unread by the last pass
+    for(Endpoint *ep : again)
+        ep->rx_listed = false;
+    int deadline = again.GetCount() ? 0 : timers.GetTimeout();
+    if(deadline >= 0 && (timeout_ms < 0 || deadline < timeout_ms))
+        timeout_ms = deadline;
+#ifdef PLATFORM_LINUX
+    epoll_event ev[64];
+    int n = epoll_wait(epfd, ev, __countof(ev), timeout_ms);
+    if(n < 0) {
+        if(errno != EINTR)
+            return false;
+        n = 0; // a signal: finish the pass anyway, the endpoints in `again` are owed their read
+    }
+#ifdef WS_URING
+    if(uring.IsOpen())
+        RecvBatch(ev, n);
+#endif
+    for(int i = 0; i < n; i++) {
+        void *token = ev[i].data.ptr;
+        dword events = ev[i].events;
+        if(token == &listener)
+            AcceptPending();
+        else
+        if(token == &wakefd) {
+            uint64 cnt;
+            (void)!read(wakefd, &cnt, sizeof(cnt));
+        }
+        else
+        if((uintptr_t)token & 1) {
+            Endpoint& ep = *(Endpoint *)((byte *)token - 1);
+            ep.DrainShm();
+            if(ep.IsClosed() && !ep.HasPending())
+                Dead(ep);
+        }
+        else
+            Service(*(Endpoint *)token, events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR),
+                    events & EPOLLOUT);
+    }
+#else
+    SocketWaitEvent we;
+    we.Add(listener, WAIT_READ);
+    for(Endpoint& ep : clients)
+        we.Add(ep.sock, WAIT_READ | (ep.HasPending() ? WAIT_WRITE : 0));
+    we.Wait(timeout_ms < 0 ? 100 : timeout_ms); // no wake-up fd here, so keep the sleep bounded
+    int count = clients.GetCount();
+    AcceptPending();
+    for(int i = 0; i < count; i++) {
+        dword e = we[i + 1];
+        if(e)
+            Service(clients[i], e & WAIT_READ, e & WAIT_WRITE);
+    }
+#endif
+    for(Endpoint *ep : again)
+        if(!ep->rx_listed && !ep->dying) // not already read (and capped again) above
+            Service(*ep, true, false);
+    if(tls_ctx)
+        AdoptTls();
+    RunPosted(); // before Flush(), so posted replies share its writes
+    timers.Advance(msecs(), [&](TimerWheel::Node& n) { OnTimer(*(Endpoint *)n.data); });
+    Flush();
+    Reap();
+    return true;
+}
+
+inline void Server::Shutdown(int code, const String& reason)
+{
+    for(Endpoint& ep : clients) {
+        if(ep.handshaking)
+            continue; // not a WebSocket yet, just drop it
+        ep.Close(code, reason);
+        ep.WritePending();
+    }
+    dirty.Clear();
+    readable.Clear();
+    clients.Clear();
+    dead.Clear();
+    queued = 0;
+    paused = 0;
 }
 
 inline bool Client::Connect(const String& url, bool)
@@ -432,8 +3131,95 @@ inline bool Client::Connect(const String& url, bool)
 
     if(!sock.Connect(host, port))
         return false;
+    if(ssl) {
+        if(!sock.StartSSL())
+            return false;
+        while(sock.SSLHandshake())
+            if(sock.IsError() || sock.IsTimeout())
+                return false;
+        ssl_sock = true;
+    }
+    masked = true;
+    if(!HandshakeClient(host, path))
+        return false;
+    sock.Timeout(0); // Pump() must never block the caller's loop
+    return true;
+}
+
+inline bool Client::ConnectUnix(const String& socket_path, const String& path)
+{
+#ifdef PLATFORM_LINUX
+    sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if(socket_path.GetCount() >= (int)sizeof(sun.sun_path))
+        return false;
+    memcpy(sun.sun_path, ~socket_path, socket_path.GetCount());
+    SOCKET s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0)
+        return false;
+    if(connect(s, (sockaddr *)&sun, sizeof(sun)) || !sock.Attach(s)) {
+        close(s);
+        return false;
+    }
     masked = true;
-    return HandshakeClient(host, path);
+    if(!HandshakeClient("localhost", path))
+        return false;
+    sock.Timeout(0);
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline bool Client::AttachShm(const String& request, int timeout_ms)
+{
+#ifdef PLATFORM_LINUX
+    if(shm || ssl_sock || !SendText(request))
+        return false;
+    shm_wanted = true;
+    int start = msecs();
+    while(shm_wanted && !IsClosed() && msecs(start) < timeout_ms)
+        if(!Wait(timeout_ms - msecs(start)))
+            break;
+    shm_wanted = false;
+    return shm;
+#else
+    return false;
+#endif
+}
+
+inline bool Client::Wait(int timeout_ms)
+{
+#ifdef PLATFORM_LINUX
+    pollfd pfd[2];
+    int n = 1;
+    pfd[0].fd = sock.GetSOCKET();
+    pfd[0].events = POLLIN | (HasPending() ? POLLOUT : 0);
+    if(shm) {
+        FlushShm();
+        // a reply is usually a few microseconds away; a futile spin costs less than
+        // the eventfd round trip through the scheduler
+        for(int i = 0; i < 4096 && !shm->HasInput(); i++) {
+#ifdef WS_MASK_X86
+            _mm_pause();
+#endif
+        }
+        if(!shm->Sleep())
+            timeout_ms = 0;
+        pfd[1].fd = shm->GetEventFd();
+        pfd[1].events = POLLIN;
+        n = 2;
+    }
+    if(timeout_ms)
+        while(poll(pfd, n, timeout_ms) < 0 && errno == EINTR)
+            ;
+#else
+    SocketWaitEvent we;
+    we.Add(sock, WAIT_READ | (HasPending() ? WAIT_WRITE : 0));
+    we.Wait(timeout_ms);
+#endif
+    return Pump();
 }
 
 } // namespace Ws
@@ -43,11 +43,8 @@ CONSOLE_APP_MAIN {
     if (hub.Listen(port, path)) {
         LOG("Listening on port " + AsString(port) + ", path " + path);
         LOG("Server running. Press Ctrl+C to exit.");
-        while (true) {
-            hub.Pump();
-            Ctrl::ProcessEvents();
-            Sleep(1);
-        }
+        while (hub.Wait(-1)) // sleeps until a socket is ready
+            ;
     } else {
         LOG("Failed to listen on port " + AsString(port) + ". System Error: " + GetLastSystemError());
     }
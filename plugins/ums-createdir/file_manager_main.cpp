@@ -22,7 +22,7 @@ CONSOLE_APP_MAIN {
     LOG("--- UMS CreateDir Example ---");
     McpServer server(5003,10);
     server.SetLogCallback([](const String&m){LOG("[S]: "+m);});
-    server.GetPermissions().allowCreateDirs=true;
+    Permissions perms; perms.allowCreateDirs=true; server.SetPermissions(perms);
     String sandboxDir=AppendFileName(GetExeFolder(),"ums_example_sandbox_create");
     RealizeDirectory(sandboxDir); // Ensure base sandbox dir exists
     server.AddSandboxRoot(sandboxDir);
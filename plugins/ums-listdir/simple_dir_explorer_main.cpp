@@ -8,7 +8,8 @@ JsonValue ListDirToolLogic(McpServer& server, const JsonObject& args){
     String p=args.Get("path",".").ToString();
     String ep=p;
     if(p=="."){
-        if(!server.GetSandboxRoots().IsEmpty()) ep=server.GetSandboxRoots()[0];
+        Vector<String> roots=server.GetSandboxRoots();
+        if(!roots.IsEmpty()) ep=roots[0];
         else {
             server.Log("Warning: ums-listdir for '.' with no sandbox roots, using current working directory.");
             ep=GetCurrentDirectory();
@@ -17,6 +18,7 @@ JsonValue ListDirToolLogic(McpServer& server, const JsonObject& args){
     server.EnforceSandbox(ep);
     JsonArray res; FindFile ff(AppendFileName(ep,"*.*"));
     while(ff){
+        McpServer::CurrentCancel().Check(); // the caller left or the deadline passed
         JsonObject fe;
         fe("name",ff.GetName());
         fe("is_dir",ff.IsDirectory());
@@ -34,7 +36,7 @@ CONSOLE_APP_MAIN {
     LOG("--- UMS ListDir Example ---");
     McpServer server(5004,10);
     server.SetLogCallback([](const String&m){LOG("[S]: "+m);});
-    server.GetPermissions().allowSearchDirs=true;
+    Permissions perms; perms.allowSearchDirs=true; server.SetPermissions(perms);
     String sandboxDir=AppendFileName(GetExeFolder(),"ums_example_sandbox_list");
     RealizeDirectory(sandboxDir); // Ensure base sandbox dir exists
     SaveFile(AppendFileName(sandboxDir,"tmp_file_for_listing.txt"),"test content"); // Create a file to list
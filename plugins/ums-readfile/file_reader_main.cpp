@@ -9,17 +9,25 @@ using namespace Upp;
 Value ReadFileToolLogic_Plugin(McpServer& server, const Value& args_v) {
     if(!args_v.Is<ValueMap>()) throw Exc("ums-readfile-plugin: 'args' must be a JSON object.");
     ValueMap args = args_v.Get<ValueMap>();
-    server.Log("ums-readfile-plugin invoked. Args: " + StoreAsJson(args_v, true));
+    server.Log("ums-readfile-plugin invoked. Args: " + McpServer::Brief(args_v));
     if (!server.GetPermissions().allowReadFiles) throw Exc("Permission denied: Read Files required.");
     String path = args.Get("path", "").ToString(); if (path.IsEmpty()) throw Exc("Argument error: 'path' required.");
-    server.EnforceSandbox(path); String content = LoadFile(path);
+    server.EnforceSandbox(path); String content = server.ReadFile(path);
     if (content.IsVoid()) throw Exc("File error: Could not read file '" + path + "'.");
     return content;
 }
+Value ReadFileStreamLogic_Plugin(McpServer& server, const Value& args_v, ToolSink& sink) {
+    if(!args_v.Is<ValueMap>()) throw Exc("ums-readfile-plugin: 'args' must be a JSON object.");
+    if (!server.GetPermissions().allowReadFiles) throw Exc("Permission denied: Read Files required.");
+    String path = args_v["path"].ToString(); if (path.IsEmpty()) throw Exc("Argument error: 'path' required.");
+    server.EnforceSandbox(path); int64 size = server.StreamFile(path, sink);
+    if (size < 0) throw Exc("File error: Could not read file '" + path + "'.");
+    return ValueMap("path", path)("size", size);
+}
 CONSOLE_APP_MAIN {
     StdLogSetup(LOG_COUT|LOG_TIMESTAMP); SetExitCode(0); LOG("--- UMS File Reader Plugin ---");
     McpServer server(5001, 10); server.SetLogCallback([](const String&m){LOG("[Svc]: "+m);});
-    server.GetPermissions().allowReadFiles = true;
+    Permissions perms; perms.allowReadFiles=true; server.SetPermissions(perms);
     String sandboxDir=AppendFileName(GetExeFolder(),"ums_plugin_sandbox_rf");RealizeDirectory(sandboxDir);
     server.AddSandboxRoot(sandboxDir);
     String testFilePath = AppendFileName(sandboxDir,"test.txt");
@@ -31,6 +39,7 @@ CONSOLE_APP_MAIN {
     td.parameters = Value(params_map);
 
     td.func = [&](const Value&args_v){return ReadFileToolLogic_Plugin(server,args_v);};
+    td.stream = [&](const Value&args_v, ToolSink& sink){return ReadFileStreamLogic_Plugin(server,args_v,sink);};
     const String toolName = "ums-readfile-plugin";
     server.AddTool(toolName, td); server.EnableTool(toolName); LOG("Tool '"+toolName+"' enabled.");
     server.ConfigureBind(true); if(server.StartServer()){
@@ -11,7 +11,7 @@ JsonValue WriteFileToolLogic(McpServer& server, const JsonObject& args){
     if(args.Find("data")<0)throw Exc("Argument error: 'data' (string content) is a required argument for 'ums-writefile' tool.");
     String d=args.Get("data","").ToString();
     server.EnforceSandbox(p);
-    if(!SaveFile(p,d))throw Exc("File system error: Failed to save data to file '" + p + "' for 'ums-writefile' tool.");
+    if(!server.WriteFile(p,d))throw Exc("File system error: Failed to save data to file '" + p + "' for 'ums-writefile' tool.");
     server.Log("ums-writefile: Data saved successfully to '" + p + "'.");
     return true;
 }
@@ -21,7 +21,7 @@ CONSOLE_APP_MAIN {
     LOG("--- UMS WriteFile Example ---");
     McpServer server(5005,10);
     server.SetLogCallback([](const String&m){LOG("[S]: "+m);});
-    server.GetPermissions().allowWriteFiles=true;
+    Permissions perms; perms.allowWriteFiles=true; server.SetPermissions(perms);
     String sandboxDir=AppendFileName(GetExeFolder(),"ums_example_sandbox_write");
     RealizeDirectory(sandboxDir); // Ensure base sandbox dir exists
     server.AddSandboxRoot(sandboxDir);
@@ -0,0 +1,59 @@
+#include "test_server.h"
+
+static String Upgrade(const TestServer& server) // status line of the answer to a raw upgrade request, "" if closed
+{
+    TcpSocket s;
+    s.Timeout(5000);
+    if(!s.Connect("127.0.0.1", server.GetPort()))
+        return String();
+    s.Put("GET " + server.GetPathPrefix() + " HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+    return s.GetLine();
+}
+
+static bool Admitted(const TestServer& server, int timeout_ms = 5000) // retried while the server reaps the old ones
+{
+    int start = msecs();
+    do {
+        TestClient c;
+        if(c.Open(server))
+            return true;
+        Sleep(20);
+    }
+    while(msecs(start) < timeout_ms);
+    return false;
+}
+
+TEST(Admission_PerAddressLimit)
+{
+    TestServer server;
+    server.SetAdmission(0, 2, 64);
+    server.Start();
+    One<TestClient> a, b;
+    a.Create();
+    b.Create();
+    ASSERT(a->Open(server) && b->Open(server));
+    ASSERT(Upgrade(server).IsEmpty());                          // a third from 127.0.0.1 is closed at accept
+    TestClient c;
+    ASSERT(!c.Open(server));
+
+    a.Clear();                                                  // its slot is given back once it is reaped
+    ASSERT(Admitted(server));
+    ASSERT(Admitted(server));                                   // so did the one that just left
+}
+
+TEST(Admission_MaxConnectionsAnswers503)
+{
+    TestServer server;
+    server.SetAdmission(2, 0, 64);
+    server.Start();
+    One<TestClient> a, b;
+    a.Create();
+    b.Create();
+    ASSERT(a->Open(server) && b->Open(server));
+    ASSERT(Upgrade(server).StartsWith("HTTP/1.1 503 "));       // answered once the upgrade request is in
+
+    b.Clear();                                                  // its slot is given back once it is reaped
+    ASSERT(Admitted(server));
+    ASSERT(Admitted(server));                                   // so did the one that just left
+}
@@ -0,0 +1,66 @@
+#include "../include/McpServer.h"
+#include "../mcp_server_lib/JsonEnvelope.h"
+#include <Core/Core.h>
+#include "test_helpers.h"
+
+static bool Parse(McpEnvelope& env, const String& text)
+{
+    return env.Parse(~text, text.GetCount());
+}
+
+TEST(Envelope_LegacyToolCall)
+{
+    McpEnvelope env;
+    ASSERT(Parse(env, "{ \"args\": {\"path\": \"a\\\"b.txt\", \"data\": [1, {\"x\": \"}\"}]}, \"id\": 7,\n"
+                      "  \"type\": \"tool_call\", \"tool\": \"ums-writefile\", \"stream\": true, \"extra\": null }"));
+    ASSERT(!env.rpc && env.tool == "ums-writefile" && env.has_id && (int)env.id == 7 && env.stream);
+    ASSERT(env.timeout_ms.IsVoid());
+    Value args = env.GetArgs();
+    ASSERT(args["path"] == "a\"b.txt" && args["data"][1]["x"] == "}");
+
+    ASSERT(Parse(env, "{\"type\":\"tool_call\",\"tool\":\"ums-c\\u0061lc\",\"timeout_ms\":250}"));
+    ASSERT(env.tool == "ums-calc" && (int)env.timeout_ms == 250 && !env.has_id && !env.stream);
+    ASSERT(env.GetArgs().Is<ValueMap>() && env.GetArgs().GetCount() == 0);
+}
+
+TEST(Envelope_JsonRpcToolsCall)
+{
+    McpEnvelope env;
+    ASSERT(Parse(env, "{\"jsonrpc\":\"2.0\",\"id\":\"r1\",\"method\":\"tools/call\","
+                      "\"params\":{\"name\":\"ums-readfile\",\"arguments\":{\"path\":\"x\"},\"stream\":true}}"));
+    ASSERT(env.rpc && env.tool == "ums-readfile" && env.id == "r1" && env.stream);
+    ASSERT(env.GetArgs()["path"] == "x");
+
+    ASSERT(Parse(env, "{\"jsonrpc\":\"2.0\",\"method\":\"tools/call\",\"params\":{\"name\":\"t\",\"arguments\":null}}"));
+    ASSERT(env.rpc && !env.has_id && env.GetArgs().Is<ValueMap>()); // a notification, no arguments
+}
+
+TEST(Envelope_OtherMessagesTakeGeneralPath)
+{
+    McpEnvelope env;
+    ASSERT(!Parse(env, "[{\"type\":\"tool_call\",\"tool\":\"t\"}]"));                      // batch
+    ASSERT(!Parse(env, "{\"type\":\"batch\",\"calls\":[]}"));
+    ASSERT(!Parse(env, "{\"type\":\"tool_call\",\"args\":{}}"));                            // no tool: error reply
+    ASSERT(!Parse(env, "{\"type\":\"tool_call\",\"tool\":5}"));
+    ASSERT(!Parse(env, "{\"type\":\"tool_call\",\"tool\":\"t\"} x"));                      // trailing garbage
+    ASSERT(!Parse(env, "{\"type\":\"tool_call\",\"tool\":\"t\",\"args\":{\"a\":[1}}"));    // mismatched brackets
+    ASSERT(!Parse(env, "{\"type\":\"tool_call\",\"tool\":\"t\",\"args\":{\"a\":\"1}"));    // unterminated
+    ASSERT(!Parse(env, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"tools/list\"}"));
+    ASSERT(!Parse(env, "{\"jsonrpc\":\"1.0\",\"id\":1,\"method\":\"tools/call\",\"params\":{\"name\":\"t\"}}"));
+    ASSERT(!Parse(env, "{\"type\":\"tool_call\",\"tool\":\"t\",\"args\":{\"a\":1,}}"));   // trailing comma
+}
+
+TEST(Envelope_MalformedValuesTakeGeneralPath)
+{
+    // whatever ParseJSON would refuse must not be dispatched from the fast path
+    const char *bad[] = {
+        "\"junk\":nonsense", "\"junk\":tru", "\"junk\":truex", "\"junk\":NaN", "\"junk\":+1",
+        "\"junk\":01", "\"junk\":1.", "\"junk\":.5", "\"junk\":1e", "\"junk\":-",
+        "\"junk\":[1 2]", "\"junk\":[1,]", "\"junk\":{\"a\"}", "\"junk\":{\"a\":nonsense}",
+        "\"junk\":\"\\x\"", "\"junk\":\"\\u12g4\"",
+    };
+    McpEnvelope env;
+    for(const char *m : bad)
+        ASSERT(!Parse(env, String("{\"type\":\"tool_call\",\"tool\":\"t\",") + m + "}"));
+    ASSERT(Parse(env, "{\"type\":\"tool_call\",\"tool\":\"t\",\"junk\":[-0.5e+3,true,false,null,\"\\u00e9\\n\",{}]}"));
+}
@@ -0,0 +1,167 @@
+#include "test_server.h"
+
+static int Code(const Value& reply) { return reply["error"]["code"]; }
+
+static String RpcCall(const Value& id, const String& tool, const String& args)
+{
+    return "{\"jsonrpc\":\"2.0\"," + (id.IsVoid() ? String() : "\"id\":" + StoreAsJson(id) + ",") +
+           "\"method\":\"tools/call\",\"params\":{\"name\":\"" + tool + "\",\"arguments\":" + args + "}}";
+}
+
+TEST(JsonRpc_ErrorCodes)
+{
+    TestServer server;
+    server.Tool("echo", [](const Value& args) { return args; });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    Value r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"tools/call\",\"params\":{\"name\":"); // cut short
+    ASSERT(r["jsonrpc"] == "2.0" && Code(r) == -32700 && IsNull(r["id"]));
+    r = c.Call("{\"type\":\"tool_call\",");     // no "jsonrpc" in it: the legacy error
+    ASSERT(r["type"] == "error" && IsNull(r["jsonrpc"]));
+
+    r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":2}");
+    ASSERT(Code(r) == -32600 && (int)r["id"] == 2);
+    r = c.Call("{\"jsonrpc\":\"1.0\",\"id\":3,\"method\":\"ping\"}");
+    ASSERT(Code(r) == -32600 && (int)r["id"] == 3);
+    r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":4,\"method\":\"no/such\"}");
+    ASSERT(Code(r) == -32601 && (int)r["id"] == 4);
+    r = c.Call(RpcCall(5, "missing", "{}"));
+    ASSERT(Code(r) == -32602 && (int)r["id"] == 5);
+    r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":6,\"method\":\"tools/call\",\"params\":{}}");
+    ASSERT(Code(r) == -32602 && (int)r["id"] == 6);
+
+    r = c.Call(RpcCall(7, "echo", "{\"v\":\"x\"}"));
+    ASSERT(IsNull(r["error"]) && r["result"]["isError"] == false);
+    ASSERT(ParseJSON(r["result"]["content"][0]["text"].ToString())["v"] == "x");
+}
+
+TEST(JsonRpc_NotificationsGetNoReply)
+{
+    TestServer server;
+    std::atomic<int> calls(0);
+    server.Tool("count", [&](const Value&) { calls++; return Value(); });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    c.SendText(RpcCall(Value(), "count", "{}"));
+    c.SendText(RpcCall(Value(), "missing", "{}"));              // failures are not reported either
+    c.SendText("{\"jsonrpc\":\"2.0\",\"method\":\"no/such\"}");
+    c.SendText("{\"jsonrpc\":\"2.0\",\"method\":\"notifications/initialized\"}");
+    Value r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":\"last\",\"method\":\"ping\"}");
+    ASSERT(r["id"] == "last" && r["result"].Is<ValueMap>());
+    for(int i = 0; i < 500 && !calls; i++)
+        Sleep(10);
+    ASSERT(calls == 1);
+    ASSERT(c.Next(300).IsVoid());                               // the tool ran, but nothing came
+}
+
+TEST(JsonRpc_IdsEchoedInCompletionOrder)
+{
+    TestServer server;
+    server.Tool("sleep", [](const Value& args) { Sleep((int)args["ms"]); return args["ms"]; });
+    server.Tool("echo", [](const Value& args) { return args; });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    c.SendText(RpcCall("slow", "sleep", "{\"ms\":300}"));
+    c.SendText(RpcCall(7, "sleep", "{\"ms\":0}"));
+    c.SendText(RpcCall("x", "sleep", "{\"ms\":0}"));
+    Value a = c.Next(), b = c.Next(), s = c.Next();
+    ASSERT(IsNumber(a["id"]) ? (int)a["id"] == 7 && b["id"] == "x" : a["id"] == "x" && (int)b["id"] == 7);
+    ASSERT(s["id"] == "slow" && s["result"]["content"][0]["text"] == "300");
+
+    Value r = c.Call("{\"type\":\"tool_call\",\"tool\":\"echo\",\"id\":\"L1\",\"args\":{\"v\":1}}");
+    ASSERT(r["type"] == "tool_response" && r["id"] == "L1" && (int)r["result"]["v"] == 1);
+}
+
+static void BatchTools(TestServer& server)
+{
+    server.Tool("sleep", [](const Value& args) { Sleep((int)args["ms"]); return args["ms"]; });
+    server.Tool("echo", [](const Value& args) { return args; });
+}
+
+TEST(Batch_RepliesInRequestOrder)
+{
+    TestServer server;
+    BatchTools(server);
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    Value r = c.Call("[" + RpcCall(1, "sleep", "{\"ms\":200}") + "," + RpcCall(2, "sleep", "{\"ms\":0}") + "," +
+                     RpcCall(3, "missing", "{}") + "]");
+    ASSERT(r.Is<ValueArray>() && r.GetCount() == 3);
+    ASSERT((int)r[0]["id"] == 1 && r[0]["result"]["content"][0]["text"] == "200");
+    ASSERT((int)r[1]["id"] == 2 && (int)r[2]["id"] == 3 && Code(r[2]) == -32602);
+
+    r = c.Call("{\"type\":\"batch\",\"calls\":[{\"tool\":\"sleep\",\"args\":{\"ms\":200}},{\"tool\":\"echo\",\"args\":{\"v\":2}},"
+               "{\"tool\":\"missing\"},{\"args\":{}}]}");
+    ASSERT(r["type"] == "batch_response" && r["results"].GetCount() == 4);
+    ASSERT((int)r["results"][0]["result"] == 200 && (int)r["results"][1]["result"]["v"] == 2);
+    ASSERT(IsString(r["results"][2]["error"]) && IsString(r["results"][3]["error"])); // per item
+}
+
+TEST(Batch_Empty)
+{
+    TestServer server;
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    Value r = c.Call("[]");
+    ASSERT(r.Is<ValueMap>() && Code(r) == -32600 && IsNull(r["id"]));
+    r = c.Call("{\"type\":\"batch\",\"calls\":[]}");
+    ASSERT(r["type"] == "error");
+}
+
+TEST(Batch_MixedNotifications)
+{
+    TestServer server;
+    BatchTools(server);
+    std::atomic<int> calls(0);
+    server.Tool("count", [&](const Value&) { calls++; return Value(); });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    Value r = c.Call("[" + RpcCall(Value(), "count", "{}") + "," + RpcCall("a", "echo", "{\"v\":1}") + "," +
+                     RpcCall(Value(), "missing", "{}") + ",5]");
+    ASSERT(r.Is<ValueArray>() && r.GetCount() == 2);           // the notifications leave no trace
+    ASSERT(r[0]["id"] == "a" && Code(r[1]) == -32600 && IsNull(r[1]["id"]));
+    ASSERT(calls == 1);
+
+    c.SendText("[" + RpcCall(Value(), "count", "{}") + "," + RpcCall(Value(), "count", "{}") + "]");
+    r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":9,\"method\":\"ping\"}");
+    ASSERT((int)r["id"] == 9);                                  // nothing for the all-notification batch
+    for(int i = 0; i < 500 && calls < 3; i++)
+        Sleep(10);
+    ASSERT(calls == 3 && c.Next(300).IsVoid());
+}
+
+TEST(Batch_StreamedLegacy)
+{
+    TestServer server;
+    BatchTools(server);
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    c.SendText("{\"type\":\"batch\",\"stream\":true,\"calls\":[{\"tool\":\"sleep\",\"args\":{\"ms\":300}},"
+               "{\"tool\":\"sleep\",\"args\":{\"ms\":0}},{\"tool\":\"missing\"}]}");
+    Index<int> seen;
+    for(int i = 0; i < 3; i++) { // each item as it completes, the slow one last
+        Value item = c.Next();
+        ASSERT(item["type"] == "batch_item");
+        int index = item["index"];
+        seen.FindAdd(index);
+        ASSERT(index == 2 ? IsString(item["error"]) : !IsNull(item["result"]));
+        ASSERT(i < 2 ? index != 0 : index == 0);
+    }
+    ASSERT(seen.GetCount() == 3);
+    Value done = c.Next();
+    ASSERT(done["type"] == "batch_done" && (int)done["count"] == 3);
+}
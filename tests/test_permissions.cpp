@@ -17,7 +17,9 @@ TEST(Permissions_DefaultFlagsFalse)
 TEST(Permissions_EnableSpecific)
 {
     McpServer server(1234,1);
-    server.GetPermissions().allowReadFiles = true;
+    Permissions p;
+    p.allowReadFiles = true;
+    server.SetPermissions(p);
     ASSERT(server.GetPermissions().allowReadFiles);
     ASSERT(!server.GetPermissions().allowWriteFiles);
     ASSERT(SimulateToolCall(server, &Permissions::allowReadFiles, "ReadFile"));
@@ -27,8 +29,10 @@ TEST(Permissions_EnableSpecific)
 TEST(Permissions_EnableMultiple)
 {
     McpServer server(1234,1);
-    server.GetPermissions().allowWriteFiles = true;
-    server.GetPermissions().allowCreateDirs = true;
+    Permissions p;
+    p.allowWriteFiles = true;
+    p.allowCreateDirs = true;
+    server.SetPermissions(p);
     ASSERT(server.GetPermissions().allowWriteFiles);
     ASSERT(server.GetPermissions().allowCreateDirs);
     ASSERT(!server.GetPermissions().allowReadFiles);
@@ -40,20 +44,23 @@ TEST(Permissions_EnableMultiple)
 TEST(Permissions_AllEnabled)
 {
     McpServer server(1234,1);
-    Permissions& perms = server.GetPermissions();
+    Permissions perms;
     perms.allowReadFiles=true; perms.allowWriteFiles=true; perms.allowDeleteFiles=true;
     perms.allowRenameFiles=true; perms.allowCreateDirs=true; perms.allowSearchDirs=true;
     perms.allowExec=true; perms.allowNetworkAccess=true; perms.allowExternalStorage=true;
     perms.allowChangeAttributes=true; perms.allowIPC=true;
+    server.SetPermissions(perms);
     ASSERT(SimulateToolCall(server, &Permissions::allowReadFiles, "Read"));
     ASSERT(SimulateToolCall(server, &Permissions::allowExec, "Exec"));
 }
 
-TEST(Permissions_ModifyViaReference)
+TEST(Permissions_ReturnedAsCopy)
 {
     McpServer server(1234,1);
-    Permissions& ref = server.GetPermissions();
-    ref.allowNetworkAccess = true;
+    Permissions copy = server.GetPermissions();
+    copy.allowNetworkAccess = true;
+    ASSERT(!server.GetPermissions().allowNetworkAccess);        // takes effect only when set
+    server.SetPermissions(copy);
     ASSERT(server.GetPermissions().allowNetworkAccess);
     ASSERT(SimulateToolCall(server, &Permissions::allowNetworkAccess, "Network"));
 }
@@ -94,3 +94,23 @@ TEST(Sandbox_TrickyPathEscape)
     ASSERT(threw);
     DeleteFolderDeep(root);
 }
+
+TEST(Sandbox_SetRootsReplacesWhole)
+{
+    McpServer server(1234, 1);
+    String a = NormalizePath(GetExeFolder() + "/test_sandbox_set_a");
+    String b = NormalizePath(GetExeFolder() + "/test_sandbox_set_b");
+    server.AddSandboxRoot(a);
+    Vector<String> roots;
+    roots << b << b << "";                      // duplicates and empty ones dropped
+    server.SetSandboxRoots(roots);
+    ASSERT(server.GetSandboxRoots().GetCount() == 1 && server.GetSandboxRoots()[0] == b);
+    server.EnforceSandbox(AppendFileName(b, "file.txt"));
+    bool threw = false;
+    try {
+        server.EnforceSandbox(AppendFileName(a, "file.txt"));
+    } catch(...) {
+        threw = true;
+    }
+    ASSERT(threw);
+}
@@ -0,0 +1,113 @@
+#ifndef TEST_SERVER_H
+#define TEST_SERVER_H
+#include "../include/McpServer.h"
+#include "test_helpers.h"
+
+// An McpServer on a loopback port, driven by its own reactor and tool threads,
+// and a client talking to it over a real socket.
+struct TestServer : McpServer {
+    TestServer(int tool_threads = 4) : McpServer(0, "/mcp") {
+        logCallback = [](const String&) {};
+        SetToolThreads(tool_threads);
+    }
+    ~TestServer() { StopServer(); }
+
+    void Start() {
+        for(int i = 0; i < 20 && !IsListening(); i++) { // a random port, in case one is taken
+            SetPort(20000 + Random(30000));
+            StartServer();
+        }
+        ASSERT(IsListening());
+    }
+    void Tool(const String& name, ToolFunc f, bool light = false) {
+        ToolDefinition def;
+        def.func = f;
+        def.thread_safe = true;
+        def.light = light;
+        AddTool(name, def);
+        EnableTool(name);
+    }
+    String GetUrl() const { return "ws://127.0.0.1:" + AsString(GetPort()) + GetPathPrefix(); }
+};
+
+struct TestClient : Upp::Ws::Client {
+    BiVector<Value> got;
+
+    bool Open(const TestServer& server) {
+        WhenText = [this](String s) { got.AddTail(ParseJSON(s)); };
+        return Connect(server.GetUrl()) && Next()["type"] == "manifest";
+    }
+    Value Next(int timeout_ms = 5000) { // the next message, void if none came in time
+        int start = msecs();
+        while(got.IsEmpty() && !IsClosed() && msecs(start) < timeout_ms)
+            if(!Pump())
+                break;
+            else
+            if(got.IsEmpty())
+                Sleep(1);
+        return got.GetCount() ? got.PopHead() : Value();
+    }
+    void  Send(const String& json) { SendText(json); Pump(); } // out now, the caller may not read for a while
+    Value Call(const String& json) { SendText(json); return Next(); }
+};
+
+// A bare Ws::Server on its own thread that echoes every message back, for the
+// transport tests below McpServer. Counts WhenClose calls per accepted endpoint.
+struct EchoServer : Upp::Ws::Server {
+    Thread thread;
+    std::atomic<bool> stop{false};
+    Mutex  lock;
+    Vector<int> closes;              // per endpoint, in accept order
+    int    port = 0;
+
+    ~EchoServer() { Stop(); }
+
+    bool Start(bool tls = false, const String& cert = "", const String& key = "") {
+        for(int i = 0; i < 20 && IsFinished(); i++)
+            Listen(port = 20000 + Random(30000), "/", tls, cert, key);
+        return !IsFinished() && Run();
+    }
+    bool StartUnix(const String& socket_path) { return ListenUnix(socket_path) && Run(); }
+    bool Run() {
+        WhenAccept = [this](Upp::Ws::Endpoint& ep) {
+            int id;
+            {
+                Mutex::Lock __(lock);
+                id = closes.GetCount();
+                closes.Add(0);
+            }
+            Upp::Ws::Endpoint *p = &ep;
+            ep.WhenText = [p](String s) { p->SendText(s); };
+            ep.WhenBinary = [p](String s) { p->SendBinary(s); };
+            ep.WhenClose = [this, id](int, const String&) { Mutex::Lock __(lock); closes[id]++; return true; };
+        };
+        thread.Run([this] { while(!stop) Wait(50); });
+        return true;
+    }
+    void Stop() { stop = true; Wake(); thread.Wait(); Close(); }
+    int  Accepted()      { Mutex::Lock __(lock); return closes.GetCount(); }
+    int  Closes(int id)  { Mutex::Lock __(lock); return id < closes.GetCount() ? closes[id] : -1; }
+    String GetUrl(bool tls = false) const { return String(tls ? "wss" : "ws") + "://127.0.0.1:" + AsString(port) + "/"; }
+};
+
+struct EchoClient : Upp::Ws::Client {
+    BiVector<String> got;
+
+    EchoClient() {
+        WhenText = [this](String s) { got.AddTail(s); };
+        WhenBinary = [this](String s) { got.AddTail(s); };
+    }
+    String Next(int timeout_ms = 5000) { // the next message, void if none came in time
+        int start = msecs();
+        while(got.IsEmpty() && !IsClosed() && msecs(start) < timeout_ms)
+            if(!Pump())
+                break;
+            else
+            if(got.IsEmpty())
+                Sleep(1);
+        return got.GetCount() ? got.PopHead() : String::GetVoid();
+    }
+    String Echo(const String& text) { SendText(text); return Next(); }
+};
+
+#endif // TEST_SERVER_H
@@ -0,0 +1,112 @@
+#include "test_server.h"
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+static bool MakeCert(const String& cert, const String& key) // self-signed, for 127.0.0.1
+{
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *kc = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    bool ok = kc && EVP_PKEY_keygen_init(kc) > 0 &&
+              EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kc, NID_X9_62_prime256v1) > 0 &&
+              EVP_PKEY_keygen(kc, &pkey) > 0;
+    EVP_PKEY_CTX_free(kc);
+    X509 *x = ok ? X509_new() : NULL;
+    if(x) {
+        ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+        X509_set_pubkey(x, pkey);
+        X509_NAME *name = X509_get_subject_name(x);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const byte *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(x, name);
+        ok = X509_sign(x, pkey, EVP_sha256()) > 0;
+        BIO *b = BIO_new_file(cert, "w");
+        ok = ok && b && PEM_write_bio_X509(b, x);
+        BIO_free(b);
+        b = BIO_new_file(key, "w");
+        ok = ok && b && PEM_write_bio_PrivateKey(b, pkey, NULL, NULL, 0, NULL, NULL);
+        BIO_free(b);
+        X509_free(x);
+    }
+    EVP_PKEY_free(pkey);
+    return ok;
+}
+
+// A bare OpenSSL client, so the session can be kept and offered again. Upgrades
+// to WebSocket, which also reads the TLS 1.3 ticket sent ahead of the 101.
+static SSL_SESSION *TlsUpgrade(SSL_CTX *ctx, int port, SSL_SESSION *offer, bool& resumed)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    timeval tv = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    SSL_SESSION *got = NULL;
+    if(connect(fd, (sockaddr *)&a, sizeof(a)) == 0) {
+        SSL *ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        if(offer)
+            SSL_set_session(ssl, offer);
+        const char *req = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+        char buf[512];
+        int n;
+        if(SSL_connect(ssl) == 1 && SSL_write(ssl, req, (int)strlen(req)) > 0 &&
+           (n = SSL_read(ssl, buf, sizeof(buf) - 1)) > 0 && (buf[n] = 0, strstr(buf, " 101 "))) {
+            resumed = SSL_session_reused(ssl);
+            got = SSL_get1_session(ssl);
+        }
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    close(fd);
+    return got;
+}
+
+TEST(Tls_RoundTripAndLargeMessage)
+{
+    String cert = GetTempFileName("cert"), key = GetTempFileName("key");
+    ASSERT(MakeCert(cert, key));
+    EchoServer server;
+    ASSERT(server.Start(true, cert, key));
+    EchoClient c;
+    ASSERT(c.Connect(server.GetUrl(true)) && c.IsTls());
+    ASSERT(c.Echo("secure") == "secure");
+
+    String big;                                                 // a dozen 16 KB records each way
+    for(int i = 0; i < 200 << 10; i++)
+        big.Cat('a' + i % 26);
+    ASSERT(c.Echo(big) == big);
+    ASSERT(server.TlsHandshakes() == 1 && server.TlsResumed() == 0);
+    server.Stop();
+    FileDelete(cert);
+    FileDelete(key);
+}
+
+TEST(Tls_ReconnectResumesSession)
+{
+    String cert = GetTempFileName("cert"), key = GetTempFileName("key");
+    ASSERT(MakeCert(cert, key));
+    EchoServer server;
+    ASSERT(server.Start(true, cert, key));
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    ASSERT(ctx);
+
+    bool resumed = true;
+    SSL_SESSION *first = TlsUpgrade(ctx, server.port, NULL, resumed);
+    ASSERT(first && !resumed);
+    ASSERT(server.TlsHandshakes() == 1 && server.TlsResumed() == 0);
+    SSL_SESSION *second = TlsUpgrade(ctx, server.port, first, resumed);
+    ASSERT(second && resumed);                                  // the abbreviated handshake
+    ASSERT(server.TlsHandshakes() == 1 && server.TlsResumed() == 1);
+
+    SSL_SESSION_free(first);
+    SSL_SESSION_free(second);
+    SSL_CTX_free(ctx);
+    server.Stop();
+    FileDelete(cert);
+    FileDelete(key);
+}
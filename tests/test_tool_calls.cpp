@@ -0,0 +1,345 @@
+#include "test_server.h"
+
+static bool WaitFor(std::function<bool()> cond, int timeout_ms = 5000)
+{
+    int start = msecs();
+    while(!cond() && msecs(start) < timeout_ms)
+        Sleep(5);
+    return cond();
+}
+
+static String LegacyCall(const String& tool)
+{
+    return "{\"type\":\"tool_call\",\"tool\":\"" + tool + "\"}";
+}
+
+TEST(Schedule_FloodDoesNotDelayOtherClients)
+{
+    TestServer server(1);
+    std::atomic<int> started(0);
+    server.Tool("slow", [&](const Value&) -> Value { started++; Sleep(200); return "slow"; });
+    server.Tool("quick", [](const Value&) -> Value { return "quick"; });
+    server.Start();
+    TestClient a, b;
+    ASSERT(a.Open(server) && b.Open(server));
+
+    for(int i = 0; i < 10; i++)
+        a.Send(LegacyCall("slow"));
+    ASSERT(WaitFor([&] { return started == 1; }));
+    int start = msecs();
+    Value r = b.Call(LegacyCall("quick"));
+    ASSERT(r["result"] == "quick");
+    ASSERT(msecs(start) < 1000);                                // behind a turn or two of a, not all ten
+    ASSERT(started < 10);
+}
+
+TEST(Schedule_MaxConcurrentIsNeverExceeded)
+{
+    TestServer server(4);
+    std::atomic<int> running(0), peak(0);
+    ToolDefinition def;
+    def.thread_safe = true;
+    def.max_concurrent = 2;
+    def.func = [&](const Value&) -> Value {
+        int n = ++running;
+        for(int p = peak; n > p && !peak.compare_exchange_weak(p, n);)
+            ;
+        Sleep(50);
+        running--;
+        return Value();
+    };
+    server.AddTool("capped", def);
+    server.EnableTool("capped");
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    for(int i = 0; i < 8; i++)
+        c.SendText(LegacyCall("capped"));
+    for(int i = 0; i < 8; i++)
+        ASSERT(c.Next()["type"] == "tool_response");
+    ASSERT(peak == 2);
+}
+
+TEST(Schedule_LightCallOvertakesQueuedHeavyOnes)
+{
+    TestServer server(1);
+    std::atomic<bool> release(false), busy(false);
+    server.Tool("block", [&](const Value&) -> Value { busy = true; while(!release) Sleep(1); return "block"; });
+    server.Tool("heavy", [](const Value&) -> Value { Sleep(20); return "heavy"; });
+    server.Tool("light", [](const Value&) -> Value { return "light"; }, true);
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    c.Send(LegacyCall("block"));
+    ASSERT(WaitFor([&] { return (bool)busy; }));                // the only worker is taken
+    for(int i = 0; i < 3; i++)
+        c.Send(LegacyCall("heavy"));
+    c.Send(LegacyCall("light"));                                // queued last
+    release = true;
+    ASSERT(c.Next()["result"] == "block");
+    ASSERT(c.Next()["result"] == "light");                      // but picked first
+    for(int i = 0; i < 3; i++)
+        ASSERT(c.Next()["result"] == "heavy");
+}
+
+TEST(Schedule_ParkedQueueWakesWhenCallFinishes)
+{
+    TestServer server(2);
+    std::atomic<bool> release(false);
+    std::atomic<int> started(0);
+    ToolDefinition def;                                         // not thread_safe: one call at a time
+    def.func = [&](const Value&) -> Value { started++; while(!release) Sleep(1); return "serial"; };
+    server.AddTool("serial", def);
+    server.EnableTool("serial");
+    server.Tool("other", [](const Value&) -> Value { return "other"; });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    c.Send(LegacyCall("serial"));
+    ASSERT(WaitFor([&] { return started == 1; }));
+    c.Send(LegacyCall("serial"));                               // parked behind the running one
+    Value r = c.Call(LegacyCall("other"));                      // the idle worker is not held up by it
+    ASSERT(r["result"] == "other" && started == 1);
+
+    release = true;                                             // finishing the first wakes the second
+    ASSERT(c.Next()["result"] == "serial");
+    ASSERT(c.Next()["result"] == "serial" && started == 2);
+}
+
+TEST(Worker_ReplyPostedBackToReactor)
+{
+    TestServer server(4);
+    Mutex lock;
+    Thread::Id reactor = 0;
+    Index<Thread::Id> workers;
+    server.logCallback = [&](const String& m) {                 // the reactor logs each accept
+        if(m.StartsWith("OnWsAccept")) {
+            Mutex::Lock __(lock);
+            reactor = Thread::GetCurrentId();
+        }
+    };
+    server.Tool("where", [&](const Value& args) -> Value {
+        Sleep(20);                                              // long enough for the calls to overlap
+        Mutex::Lock __(lock);
+        workers.FindAdd(Thread::GetCurrentId());
+        return args["i"];
+    });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    for(int i = 0; i < 8; i++)
+        c.SendText("{\"type\":\"tool_call\",\"tool\":\"where\",\"id\":\"w" + AsString(i) + "\",\"args\":{\"i\":" + AsString(i) + "}}");
+    Index<int> got;
+    for(int i = 0; i < 8; i++) {
+        Value r = c.Next();
+        ASSERT(r["type"] == "tool_response" && r["id"] == "w" + AsString((int)r["result"]));
+        got.FindAdd(r["result"]);
+    }
+    ASSERT(got.GetCount() == 8 && c.Next(300).IsVoid());        // each reply once, none lost
+    Mutex::Lock __(lock);
+    ASSERT(reactor != 0 && workers.GetCount() > 1 && workers.Find(reactor) < 0);
+}
+
+TEST(Worker_ReplyDroppedWhenClientGone)
+{
+    TestServer server(2);
+    std::atomic<bool> release(false), closed(false);
+    std::atomic<int> running(0), done(0);
+    server.logCallback = [&](const String& m) { if(m.Find("closed. Code:") >= 0) closed = true; };
+    server.Tool("hold", [&](const Value&) -> Value {             // ignores the cancel, outlives its client
+        running++;
+        while(!release)
+            Sleep(1);
+        done++;
+        return "late";
+    });
+    server.Tool("echo", [](const Value& args) { return args; });
+    server.Start();
+    {
+        TestClient c;
+        ASSERT(c.Open(server));
+        c.Send(LegacyCall("hold"));
+        ASSERT(WaitFor([&] { return running == 1; }));
+    }
+    ASSERT(WaitFor([&] { return (bool)closed; }));              // reaped in the same pass
+    TestClient d;                                               // may well get the old endpoint's address
+    ASSERT(d.Open(server));
+    release = true;
+    ASSERT(WaitFor([&] { return done == 1; }));
+    ASSERT(d.Next(300).IsVoid());                               // the late reply went nowhere
+    Value r = d.Call("{\"type\":\"tool_call\",\"tool\":\"echo\",\"args\":{\"v\":1}}");
+    ASSERT(r["type"] == "tool_response" && (int)r["result"]["v"] == 1);
+}
+
+TEST(Worker_UnsafeToolRunsOneAtATime)
+{
+    TestServer server(4);
+    std::atomic<int> running(0), peak(0), calls(0);
+    ToolDefinition def;                                         // thread_safe is false by default
+    def.func = [&](const Value&) -> Value {
+        int n = ++running;
+        for(int p = peak; n > p && !peak.compare_exchange_weak(p, n);)
+            ;
+        Sleep(10);
+        running--;
+        calls++;
+        return Value();
+    };
+    server.AddTool("unsafe", def);
+    server.EnableTool("unsafe");
+    server.Start();
+    TestClient a, b;
+    ASSERT(a.Open(server) && b.Open(server));
+
+    for(int i = 0; i < 4; i++) {                                // from two clients, so from two queues
+        a.Send(LegacyCall("unsafe"));
+        b.Send(LegacyCall("unsafe"));
+    }
+    for(int i = 0; i < 4; i++)
+        ASSERT(a.Next()["type"] == "tool_response" && b.Next()["type"] == "tool_response");
+    ASSERT(calls == 8 && peak == 1);
+}
+
+TEST(Cancel_DeadlineExceeded)
+{
+    TestServer server;
+    server.Tool("spin", [](const Value&) -> Value {
+        for(;;) {
+            McpServer::CurrentCancel().Check();
+            Sleep(5);
+        }
+    });
+    ToolDefinition def;
+    def.func = [](const Value&) -> Value { for(;;) { McpServer::CurrentCancel().Check(); Sleep(5); } };
+    def.thread_safe = true;
+    def.timeout_ms = 100;                                       // the tool's own default
+    server.AddTool("spin_100", def);
+    server.EnableTool("spin_100");
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    int start = msecs();
+    Value r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"tools/call\",\"params\":{\"name\":\"spin\",\"arguments\":{},\"timeout_ms\":100}}");
+    ASSERT((int)r["id"] == 1 && r["result"]["isError"] == true && r["result"]["content"][0]["text"] == "Deadline exceeded.");
+    ASSERT(msecs(start) >= 100 && msecs(start) < 3000);
+
+    r = c.Call("{\"type\":\"tool_call\",\"tool\":\"spin\",\"timeout_ms\":100}");
+    ASSERT(r["type"] == "error" && r["message"] == "Deadline exceeded.");
+    r = c.Call("{\"type\":\"tool_call\",\"tool\":\"spin_100\"}");
+    ASSERT(r["type"] == "error" && r["message"] == "Deadline exceeded.");
+}
+
+TEST(Cancel_ByRequestIdReachesRunningCall)
+{
+    TestServer server;
+    std::atomic<int> running(0), stopped(0);
+    server.Tool("wait", [&](const Value&) -> Value {
+        running++;
+        while(!McpServer::CurrentCancel().IsCancelled())
+            Sleep(5);
+        stopped++;
+        McpServer::CurrentCancel().Check();
+        return Value();
+    });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    c.Send("{\"jsonrpc\":\"2.0\",\"id\":7,\"method\":\"tools/call\",\"params\":{\"name\":\"wait\"}}");
+    c.Send("{\"jsonrpc\":\"2.0\",\"id\":8,\"method\":\"tools/call\",\"params\":{\"name\":\"wait\"}}");
+    ASSERT(WaitFor([&] { return running == 2; }));
+    c.Send("{\"jsonrpc\":\"2.0\",\"method\":\"notifications/cancelled\",\"params\":{\"requestId\":7}}");
+    ASSERT(WaitFor([&] { return stopped == 1; }));
+    Value r = c.Call("{\"jsonrpc\":\"2.0\",\"id\":\"p\",\"method\":\"ping\"}");
+    ASSERT(r["id"] == "p" && c.Next(300).IsVoid());            // a cancelled request gets no response
+    ASSERT(stopped == 1);                                       // 8 is still running
+
+    c.Send("{\"type\":\"tool_call\",\"tool\":\"wait\",\"id\":\"L\"}");
+    ASSERT(WaitFor([&] { return running == 3; }));
+    r = c.Call("{\"type\":\"cancel\",\"id\":\"L\"}");
+    ASSERT(r["type"] == "error" && r["message"] == "Cancelled." && r["id"] == "L");
+    ASSERT(stopped == 2);
+
+    {
+        TestClient d;
+        ASSERT(d.Open(server));
+        d.Send("{\"type\":\"tool_call\",\"tool\":\"wait\"}");
+        ASSERT(WaitFor([&] { return running == 4; }));
+    }                                                           // the connection drops, so does its call
+    ASSERT(WaitFor([&] { return stopped == 3; }));
+}
+
+TEST(Stream_BlocksOnFullWindowAndResumes)
+{
+    const int CHUNK = 64 << 10, COUNT = 1024;                   // 64 MB, far more than the socket buffers hold
+    TestServer server;
+    server.SetWaterMarks(256 << 10, 64 << 10);
+    std::atomic<int64> written(0);
+    ToolDefinition def;
+    def.thread_safe = true;
+    def.stream = [&](const Value&, ToolSink& sink) -> Value {
+        String chunk('x', CHUNK);
+        for(int i = 0; i < COUNT; i++) {
+            if(!sink.Write(chunk))
+                return "aborted";
+            written += CHUNK;
+        }
+        return "done";
+    };
+    server.AddTool("flood", def);
+    server.EnableTool("flood");
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+
+    c.Send("{\"type\":\"tool_call\",\"tool\":\"flood\",\"stream\":true}");
+    Sleep(1000);                                                // not reading: the kernel buffers fill, then the window
+    int64 stalled = written;
+    Sleep(300);
+    ASSERT(written == stalled && stalled < (int64)CHUNK * COUNT);
+
+    int seq = 0;                                                // reading drains the queue below low water, the tool goes on
+    int64 got = 0;
+    for(;;) {
+        Value m = c.Next();
+        if(m["type"] != "tool_chunk") {
+            ASSERT(m["type"] == "tool_response" && m["result"] == "done");
+            break;
+        }
+        ASSERT((int)m["seq"] == seq++);
+        got += m["data"].ToString().GetCount();
+    }
+    ASSERT(seq == COUNT && got == (int64)CHUNK * COUNT);
+}
+
+TEST(Stream_SinkFailsAfterDisconnect)
+{
+    TestServer server;
+    std::atomic<int> refused(0);
+    ToolDefinition def;
+    def.thread_safe = true;
+    def.stream = [&](const Value&, ToolSink& sink) -> Value {
+        String chunk('y', 64 << 10);
+        while(sink.Write(chunk))
+            ;
+        refused++;
+        return Value();
+    };
+    server.AddTool("endless", def);
+    server.EnableTool("endless");
+    server.Start();
+    {
+        TestClient c;
+        ASSERT(c.Open(server));
+        c.Send("{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"tools/call\",\"params\":{\"name\":\"endless\",\"stream\":true}}");
+        Value m = c.Next();
+        ASSERT(m["method"] == "notifications/tool_chunk" && (int)m["params"]["requestId"] == 1);
+        ASSERT(!refused);
+    }                                                           // gone while the tool is writing
+    ASSERT(WaitFor([&] { return refused == 1; }));
+}
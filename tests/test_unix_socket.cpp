@@ -0,0 +1,74 @@
+#include "test_server.h"
+
+#ifdef PLATFORM_LINUX
+
+static String SocketPath(const char *name) // short enough for sun_path, and not there yet
+{
+    String path = "/tmp/mcp_test_" + AsString(getpid()) + "_" + name + ".sock";
+    unlink(path);
+    return path;
+}
+
+TEST(Unix_RoundTripAndOwnerOnlyMode)
+{
+    String path = SocketPath("rt");
+    mode_t mask = umask(022);
+    EchoServer server;
+    server.AllowUid(getuid());
+    ASSERT(server.StartUnix(path));
+    ASSERT(umask(mask) == 022);                                 // ListenUnix left the process umask alone
+    struct stat st;
+    ASSERT(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && (st.st_mode & 0777) == 0640);
+
+    EchoClient c;
+    ASSERT(c.ConnectUnix(path) && c.Echo("local") == "local");
+    server.Stop();
+    ASSERT(lstat(path, &st) < 0 && errno == ENOENT);            // removed on Close()
+}
+
+TEST(Unix_OtherUidClosedAtAccept)
+{
+    String path = SocketPath("uid");
+    EchoServer server;
+    server.AllowUid(getuid() + 1);                              // SO_PEERCRED will not match us
+    ASSERT(server.StartUnix(path));
+    EchoClient c;
+    ASSERT(!c.ConnectUnix(path));
+    ASSERT(server.Rejected() == 1 && server.Accepted() == 0);
+}
+
+TEST(Unix_StaleSocketReplacedLiveOneKept)
+{
+    String path = SocketPath("stale");
+    {
+        sockaddr_un sun;                                        // a previous run that died: bound, nobody listening
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        memcpy(sun.sun_path, ~path, path.GetCount());
+        int s = socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT(s >= 0 && bind(s, (sockaddr *)&sun, sizeof(sun)) == 0);
+        close(s);
+    }
+    EchoServer server;
+    ASSERT(server.StartUnix(path));
+
+    Upp::Ws::Server second;                                     // the socket of a running server is not taken over
+    ASSERT(!second.ListenUnix(path));
+    EchoClient c;
+    ASSERT(c.ConnectUnix(path) && c.Echo("still mine") == "still mine");
+    second.Close();                                             // nor removed by the one that failed
+    EchoClient d;
+    ASSERT(d.ConnectUnix(path) && d.Echo("again") == "again");
+}
+
+TEST(Unix_OtherFileLeftAlone)
+{
+    String path = SocketPath("file");
+    ASSERT(SaveFile(path, "not a socket"));
+    Upp::Ws::Server server;
+    ASSERT(!server.ListenUnix(path));
+    ASSERT(LoadFile(path) == "not a socket");
+    FileDelete(path);
+}
+
+#endif
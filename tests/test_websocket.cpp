@@ -0,0 +1,522 @@
+#include "../include/McpServer.h"
+#include <Core/Core.h>
+#include "test_helpers.h"
+#include "test_server.h"
+
+using namespace Upp::Ws;
+
+static String Drain(ByteRing& r)
+{
+    String out;
+    while(!r.IsEmpty()) {
+        const byte *p;
+        int n = r.GetChunk(p);
+        out.Cat((const char *)p, n);
+        r.Consume(n);
+    }
+    return out;
+}
+
+TEST(ByteRing_PutConsume)
+{
+    ByteRing r;
+    r.Put("hello", 5);
+    r.Put(" world", 6);
+    ASSERT(r.GetCount() == 11);
+    r.Consume(6);
+    ASSERT(Drain(r) == "world");
+    ASSERT(r.IsEmpty());
+}
+
+TEST(ByteRing_WrapAndPeek)
+{
+    ByteRing r;
+    String a('a', 3000), b('b', 2000);
+    r.Put(~a, a.GetCount());
+    int cap = r.GetCapacity();
+    r.Consume(2500);
+    r.Put(~b, b.GetCount()); // wraps around the end of the storage
+    ASSERT(r.GetCapacity() == cap);
+    const byte *p = r.Peek(r.GetCount());
+    ASSERT(String((const char *)p, r.GetCount()) == String('a', 500) + b);
+}
+
+TEST(ByteRing_GrowKeepsOrder)
+{
+    ByteRing r;
+    String expect;
+    for(int i = 0; i < 1000; i++) {
+        String s = AsString(i) + ";";
+        r.Put(~s, s.GetCount());
+        expect << s;
+        if(i % 3 == 0) {
+            r.Consume(1);
+            expect.Remove(0, 1);
+        }
+    }
+    ASSERT(Drain(r) == expect);
+}
+
+TEST(ByteRing_WriteSpaceIsContiguous)
+{
+    ByteRing r;
+    String a('x', 4000);
+    r.Put(~a, a.GetCount());
+    r.Consume(3900);
+    int len;
+    byte *w = r.GetWriteSpace(1000, len);
+    ASSERT(len >= 1000);
+    memset(w, 'y', 1000);
+    r.Commit(1000);
+    ASSERT(Drain(r) == String('x', 100) + String('y', 1000));
+}
+
+TEST(Frame_DecodeHeaderAndUnmaskInPlace)
+{
+    const byte key[4] = { 0x11, 0x22, 0x33, 0x44 };
+    String text = "{\"type\":\"tool_call\"}";
+    String raw;
+    raw.Cat(0x81);
+    raw.Cat(0x80 | text.GetCount());
+    raw.Cat((const char *)key, 4);
+    for(int i = 0; i < text.GetCount(); i++)
+        raw.Cat(text[i] ^ key[i & 3]);
+
+    Buffer<byte> b(raw.GetCount());
+    memcpy(~b, ~raw, raw.GetCount());
+    Frame f;
+    ASSERT(f.DecodeHeader(~b, 1) == 0); // incomplete header
+    int hdr = f.DecodeHeader(~b, raw.GetCount());
+    ASSERT(hdr == 6);
+    ASSERT(f.fin && f.opcode == Frame::TEXT && f.masked && f.len == text.GetCount());
+    f.Unmask(~b + hdr, f.len);
+    ASSERT(String((const char *)~b + hdr, f.len) == text);
+}
+
+TEST(MaskBytes_MatchesBytewiseXor)
+{
+    const byte key[4] = { 0xA5, 0x01, 0x7F, 0xC3 };
+    for(int n = 0; n < 300; n += 7) {
+        Buffer<byte> data(n + 3), expect(n + 3);
+        for(int i = 0; i < n + 3; i++)
+            data[i] = expect[i] = (byte)Random();
+        for(int i = 0; i < n; i++)
+            expect[i + 3] ^= key[i & 3];
+        MaskBytes(~data + 3, n, key); // unaligned start
+        ASSERT(memcmp(~data, ~expect, n + 3) == 0);
+    }
+}
+
+TEST(OutQueue_SharesLargeSegments)
+{
+    OutQueue q;
+    String big('z', 100000);
+    q.Add("\x81\x7f");
+    q.Add(big);
+    ASSERT(q.GetCount() == 100002);
+    q.Consume(1);
+    const byte *p;
+    ASSERT(q.GetChunk(p) == 1 && *p == 0x7f);
+    q.Consume(1 + 500);
+    ASSERT(q.GetChunk(p) == 99500);
+    ASSERT((const char *)p == ~big + 500); // no copy was made
+    q.Consume(99500);
+    ASSERT(q.IsEmpty());
+}
+
+TEST(Deflate_NegotiateOffer)
+{
+    DeflateOptions ours;
+    ours.enabled = true;
+    ours.server_max_window_bits = 12;
+    DeflateOptions agreed;
+    String response;
+    // first offer asks for a window zlib cannot do, second one is fine
+    ASSERT(ours.Negotiate("permessage-deflate; server_max_window_bits=8, "
+                          "permessage-deflate; client_max_window_bits; server_no_context_takeover",
+                          agreed, response));
+    ASSERT(agreed.server_no_context_takeover && !agreed.client_no_context_takeover);
+    ASSERT(agreed.server_max_window_bits == 12);
+    ASSERT(response == "permessage-deflate; server_no_context_takeover; server_max_window_bits=12");
+
+    DeflateOptions client, client_agreed;
+    client.enabled = true;
+    ASSERT(client.Accept(response, client_agreed));
+    ASSERT(client_agreed.server_no_context_takeover && client_agreed.server_max_window_bits == 12);
+
+    DeflateOptions off;
+    ASSERT(!off.Negotiate("permessage-deflate", agreed, response));
+}
+
+struct ZEndpoint : Endpoint { // the deflate half of an endpoint, server side
+    ZEndpoint(bool no_takeover) {
+        deflate.enabled = deflate_on = true;
+        deflate.server_no_context_takeover = deflate.client_no_context_takeover = no_takeover;
+    }
+    using Endpoint::Compress;
+    using Endpoint::Decompress;
+    z_stream *Deflater() const { return tx_z; }
+    z_stream *Inflater() const { return rx_z; }
+};
+
+static String JsonText(int n) // compressible, but not a single repeated byte
+{
+    String s = "[";
+    for(int i = 0; s.GetCount() < n; i++)
+        s << "{\"id\":" << i << ",\"name\":\"item " << i % 7 << "\"},";
+    s.Trim(s.GetCount() - 1);
+    return s + "]";
+}
+
+TEST(Deflate_CompressDecompressBothModes)
+{
+    String msg = JsonText(8000);
+    for(bool no_takeover : { false, true }) {
+        ZEndpoint tx(no_takeover), rx(no_takeover);
+        String a, b, out;
+        ASSERT(tx.Compress(msg, a) && a.GetCount() < msg.GetCount() / 4);
+        ASSERT(a.GetCount() < 4 || memcmp(~a + a.GetCount() - 4, "\x00\x00\xff\xff", 4)); // sync marker dropped
+        ASSERT(!!tx.Deflater() == !no_takeover); // kept for the next message, or back in the pool
+        ASSERT(tx.Compress(msg, b));
+        if(no_takeover)
+            ASSERT(b == a);                      // each message starts from scratch
+        else
+            ASSERT(b.GetCount() < a.GetCount() / 4); // the second refers back to the first
+
+        ASSERT(rx.Decompress((const byte *)~a, a.GetCount(), out, true, 1 << 20) && out == msg);
+        ASSERT(!!rx.Inflater() == !no_takeover);
+        ASSERT(rx.Decompress((const byte *)~b, b.GetCount(), out, true, 1 << 20) && out == msg);
+    }
+}
+
+TEST(Deflate_PoolAndInflateCap)
+{
+    z_stream *z = NULL;
+    {
+        ZEndpoint ep(false);
+        String out;
+        ASSERT(ep.Compress("x", out) && (z = ep.Deflater()));
+    }                                            // given back on destruction
+    ASSERT(ZPool::GetDeflater(15, Z_DEFAULT_COMPRESSION) == z); // and lent out again
+    ZPool::Release(z, true, 15, Z_DEFAULT_COMPRESSION);
+
+    ZEndpoint tx(true), rx(true);
+    String bomb, out;
+    ASSERT(tx.Compress(String('a', 8 << 20), bomb) && bomb.GetCount() < 64 << 10);
+    ASSERT(!rx.Decompress((const byte *)~bomb, bomb.GetCount(), out, true, 1 << 20));
+    ASSERT(out.GetCount() >= 1 << 20 && out.GetCount() < 2 << 20); // stopped at the limit, not at 8 MB
+}
+
+struct FeedEndpoint : Endpoint { // frames go straight into the receive buffer
+    void Feed(const String& s) { inbuf.Put(~s, s.GetCount()); ParseFrames(); }
+    int  Upgrade(const String& s, const String& path) { inbuf.Put(~s, s.GetCount()); return HandshakeServer(path); }
+    String Output() { // everything queued so far
+        String r;
+        const byte *p;
+        while(int n = outbuf.GetChunk(p)) {
+            r.Cat((const char *)p, n);
+            outbuf.Consume(n);
+        }
+        return r;
+    }
+};
+
+static String MakeFrame(int opcode, const String& payload, bool fin)
+{
+    Frame f;
+    f.opcode = opcode;
+    f.fin = fin;
+    f.payload = payload;
+    return f.Encode(true);
+}
+
+TEST(Fragments_ReassembledAroundControlFrame)
+{
+    FeedEndpoint ep;
+    String got;
+    ep.WhenText = [&](const String& s) { got = s; };
+    ep.Feed(MakeFrame(Frame::TEXT, "{\"jsonrpc\":", false));
+    ep.Feed(MakeFrame(Frame::PING, "x", true)); // control frames may be interleaved
+    ASSERT(got.IsEmpty() && ep.HasPending());
+    ep.Feed(MakeFrame(Frame::CONT, "\"2.0\"}", true));
+    ASSERT(got == "{\"jsonrpc\":\"2.0\"}");
+    ep.Feed(MakeFrame(Frame::CONT, "stray", true)); // nothing to continue
+    ASSERT(ep.IsClosed());
+}
+
+TEST(Fragments_StreamedAndLimited)
+{
+    FeedEndpoint ep;
+    String got;
+    int pieces = 0, lasts = 0;
+    ep.WhenFragment = [&](int opcode, const char *s, int n, bool last) {
+        ASSERT(opcode == Frame::BINARY);
+        got.Cat(s, n);
+        pieces++;
+        lasts += last;
+    };
+    String data;
+    for(int i = 0; i < 10000; i++)
+        data.Cat('a' + i % 26);
+    String raw = MakeFrame(Frame::BINARY, data, true);
+    ep.Feed(raw.Left(5000));  // handed over before the frame is complete
+    ASSERT(pieces == 1 && lasts == 0);
+    ep.Feed(raw.Mid(5000));
+    ASSERT(got == data && lasts == 1);
+
+    FeedEndpoint small;
+    small.MaxMessageSize(1000);
+    small.Feed(MakeFrame(Frame::TEXT, String('x', 600), false));
+    ASSERT(!small.IsClosed());
+    small.Feed(MakeFrame(Frame::CONT, String('x', 600), true));
+    ASSERT(small.IsClosed() && small.HasPending()); // 1009 close frame queued
+}
+
+static String UpgradeRequest(const String& path)
+{
+    return "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+}
+
+TEST(Upgrade_RequestSplitAcrossReads)
+{
+    String req = UpgradeRequest("/mcp/?client=1");
+    FeedEndpoint ep;
+    for(int i = 0; i < req.GetCount() - 1; i++) // a byte per read, the blank line split too
+        ASSERT(ep.Upgrade(req.Mid(i, 1), "/mcp") == 0);
+    ASSERT(ep.Upgrade(req.Right(1), "/mcp") == 1);
+    String out = ep.Output();
+    ASSERT(out.StartsWith("HTTP/1.1 101 "));
+    ASSERT(out.Find("\r\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") >= 0); // RFC 6455 sample
+    ASSERT(!ep.IsClosed());
+}
+
+TEST(Upgrade_WrongPathIs404)
+{
+    FeedEndpoint ep;
+    ASSERT(ep.Upgrade(UpgradeRequest("/other"), "/mcp") == -1);
+    ASSERT(ep.Output().StartsWith("HTTP/1.1 404 ") && ep.IsClosed());
+    FeedEndpoint prefix;
+    ASSERT(prefix.Upgrade(UpgradeRequest("/mcpx"), "/mcp") == -1);
+    ASSERT(prefix.Output().StartsWith("HTTP/1.1 404 "));
+}
+
+TEST(Upgrade_OversizedHeadersAre431)
+{
+    FeedEndpoint ep;
+    ASSERT(ep.Upgrade("GET /mcp HTTP/1.1\r\nX-Pad: " + String('a', 8000), "/mcp") == 0);
+    ASSERT(ep.Upgrade(String('a', 9000), "/mcp") == -1); // no blank line in the first 16 KB
+    ASSERT(ep.Output().StartsWith("HTTP/1.1 431 ") && ep.IsClosed());
+}
+
+TEST(Backpressure_PausesAboveHighWater)
+{
+    FeedEndpoint ep;
+    ep.WaterMarks(100, 50);
+    String pings;
+    for(int i = 0; i < 3; i++)
+        pings << MakeFrame(Frame::PING, String('p', 60), true);
+    ep.Feed(pings);
+    // the second pong crosses the mark, the third ping is left unread
+    ASSERT(ep.IsPaused() && ep.QueueDepth() == 2 * 62);
+}
+
+TEST(PreparedText_SameBytesAsSendText)
+{
+    String text = "{\"type\":\"manifest\",\"tools\":{\"" + String('t', 200) + "\":{}}}";
+    String frame = Endpoint::PrepareText(text);
+    Frame f;
+    ASSERT(f.DecodeHeader((const byte *)~frame, frame.GetCount()) == 4); // 16-bit length
+    ASSERT(f.fin && f.opcode == Frame::TEXT && !f.masked && f.len == text.GetCount());
+    ASSERT(frame.Mid(4) == text);
+    FeedEndpoint a, b;
+    a.SendText(text);
+    ASSERT(b.SendPrepared(text, frame));
+    ASSERT(a.QueueDepth() == frame.GetCount() && b.QueueDepth() == frame.GetCount());
+}
+
+TEST(Flush_CoalescesRepliesIntoOneWrite)
+{
+    TestServer server(0);                       // tools run inline, the replies are queued in the same pass
+    server.Tool("echo", [](const Value& args) { return args; });
+    server.Start();
+    TestClient c;
+    ASSERT(c.Open(server));
+    int64 saved = server.GetWritesSaved();
+    for(int i = 0; i < 20; i++) // one write from us, so the server reads them in one pass
+        c.SendText("{\"type\":\"tool_call\",\"tool\":\"echo\",\"args\":{\"i\":" + AsString(i) + "}}");
+    for(int i = 0; i < 20; i++)
+        ASSERT((int)c.Next()["result"]["i"] == i);
+    ASSERT(server.GetWritesSaved() - saved >= 10); // 20 replies, 1 write when the request came in whole
+}
+
+TEST(Reap_ManyDroppedInOnePass)
+{
+    const int N = 40;
+    EchoServer server;
+    ASSERT(server.Start());
+    Array<EchoClient> c;
+    for(int i = 0; i < N; i++)                  // one at a time, so accept order is ours
+        ASSERT(c.Add().Connect(server.GetUrl()) && c[i].Echo("hi") == "hi");
+    ASSERT(server.Accepted() == N);
+
+    Vector<int> drop;                           // spread over the list, first and last included
+    for(int i = N - 1; i >= 0; i -= 3)
+        drop.Add(i);
+    for(int i : drop)
+        c[i].Close(1000);
+    for(int i : drop)                           // out together, so the server reaps them in one pass
+        c[i].Pump();
+    int start = msecs();
+    for(int i : drop)
+        while(server.Closes(i) == 0 && msecs(start) < 5000)
+            Sleep(5);
+
+    for(int i = 0; i < N; i++)
+        if(FindIndex(drop, i) >= 0)
+            ASSERT(server.Closes(i) == 1);
+        else {
+            ASSERT(c[i].Echo("again " + AsString(i)) == "again " + AsString(i));
+            ASSERT(server.Closes(i) == 0);
+        }
+    Sleep(100);                                 // a second report would come with the next passes
+    for(int i : drop)
+        ASSERT(server.Closes(i) == 1);
+}
+
+TEST(Deflate_LoopbackBothModes)
+{
+    String msg = JsonText(8000);
+    for(bool no_takeover : { false, true }) {
+        DeflateOptions o;
+        o.enabled = true;
+        o.server_no_context_takeover = o.client_no_context_takeover = no_takeover;
+        EchoServer server;
+        server.Deflate(o);
+        ASSERT(server.Start());
+        EchoClient c;
+        c.Deflate(o);
+        ASSERT(c.Connect(server.GetUrl()) && c.IsDeflating());
+        Vector<int> wire;
+        for(int i = 0; i < 3; i++) {
+            uint64 tx = c.TxBytes(), rx = c.RxBytes();
+            ASSERT(c.Echo(msg) == msg);
+            ASSERT(c.RxBytes() - rx < (uint64)msg.GetCount() / 4);
+            wire.Add(int(c.TxBytes() - tx));
+        }
+        if(no_takeover)
+            ASSERT(wire[1] == wire[0] && wire[2] == wire[0]);
+        else
+            ASSERT(wire[1] < wire[0] / 4 && wire[2] < wire[0] / 4);
+    }
+}
+
+TEST(Deflate_OversizedInflateClosed1009)
+{
+    DeflateOptions o;
+    o.enabled = true;
+    EchoServer server;
+    server.Deflate(o).MaxMessageSize(1 << 20);
+    ASSERT(server.Start());
+    EchoClient c;
+    c.Deflate(o);
+    int code = 0;
+    c.WhenClose = [&](int why, const String&) { code = why; return true; };
+    ASSERT(c.Connect(server.GetUrl()) && c.IsDeflating());
+    ASSERT(c.SendText(String('a', 8 << 20)));    // a few KB on the wire
+    ASSERT(c.Next().IsVoid() && c.IsClosed() && code == 1009);
+    int start = msecs();
+    while(server.Closes(0) == 0 && msecs(start) < 5000)
+        Sleep(5);
+    ASSERT(server.Closes(0) == 1);
+
+    EchoClient d;                                // the server itself is fine
+    d.Deflate(o);
+    ASSERT(d.Connect(server.GetUrl()) && d.Echo("small") == "small");
+}
+
+TEST(TimerWheel_FiresInOrderAcrossLevels)
+{
+    TimerWheel w;
+    int now = msecs();
+    TimerWheel::Node a, b, c, d;
+    Vector<TimerWheel::Node *> fired;
+    w.Schedule(a, 100, now);
+    w.Schedule(b, 10000, now);      // needs a cascade from the second level
+    w.Schedule(c, 3600 * 1000, now);
+    w.Schedule(d, 200, now);
+    d.Cancel();
+    ASSERT(w.GetTimeout(now) > 0 && w.GetTimeout(now) <= 192);
+    for(int t = 0; t <= 3601 * 1000; t += 50)
+        w.Advance(now + t, [&](TimerWheel::Node& n) {
+            ASSERT(&n != &b || t >= 10000);
+            fired.Add(&n);
+        });
+    ASSERT(fired.GetCount() == 3 && fired[0] == &a && fired[1] == &b && fired[2] == &c);
+    ASSERT(w.GetTimeout(now) == -1);
+}
+
+#ifdef PLATFORM_LINUX
+TEST(ShmChannel_WrapsAndReportsFull)
+{
+    ShmChannel srv, cl;
+    Vector<int> fds;
+    ASSERT(srv.Create(1));          // rounded up to the 64 KB minimum
+    srv.GetFds(fds);
+    ASSERT(cl.Attach(dup(fds[0]), dup(fds[1]), dup(fds[2])));
+    String big('x', 20000), msg;
+    int sent = 0;
+    while(cl.Send(~big, big.GetCount()))
+        sent++;
+    ASSERT(sent == 3);              // a fourth would have to wrap into space still in use
+    for(int i = 0; i < 10; i++) {  // keeps crossing the end of the ring
+        ASSERT(srv.Receive(msg) && msg == big);
+        ASSERT(cl.Send(~big, big.GetCount()));
+    }
+    ASSERT(!cl.Send(~big, cl.GetMaxMessage() + 1));
+    ASSERT(srv.HasInput() && !srv.Sleep());
+}
+
+TEST(ShmChannel_RejectsRecordsPastTheRing)
+{
+    const int DATA = 4096, CAP = 65536; // ShmChannel layout: header page, then the client -> server ring
+    for(int wrap = 0; wrap < 2; wrap++) {
+        ShmChannel srv, cl;
+        Vector<int> fds;
+        ASSERT(srv.Create(1));
+        srv.GetFds(fds);
+        ASSERT(cl.Attach(dup(fds[0]), dup(fds[1]), dup(fds[2])));
+        byte *mem = (byte *)mmap(NULL, DATA + 2 * CAP, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        ASSERT(mem != MAP_FAILED);
+        String msg;
+        int pos = 0;
+        if(wrap) { // move the ring to 16 bytes before its end
+            ASSERT(cl.Send(~String('a', 32760), 32760) && srv.Receive(msg));
+            ASSERT(cl.Send(~String('b', 32748), 32748) && srv.Receive(msg));
+            pos = CAP - 16;
+        }
+        ASSERT(cl.Send("hi", 2));
+        *(uint32 *)(mem + DATA + pos) = wrap ? 100 : 0x7ffffff0; // crosses the end / beyond any message
+        ASSERT(!srv.Receive(msg) && srv.IsBroken());
+        ASSERT(!srv.Receive(msg));
+        munmap(mem, DATA + 2 * CAP);
+    }
+}
+#endif
+
+#ifdef WS_URING
+TEST(Uring_FileRoundTripInChunks)
+{
+    Uring ring;
+    if(!ring.Open(8))
+        return;                     // kernel without io_uring (or filtered): callers fall back
+    String data;
+    for(int i = 0; i < 3 << 20; i++)  // a dozen chunks, more than fit in flight at once
+        data.Cat('a' + i % 23);
+    String path = GetTempFileName("uring");
+    ASSERT(ring.SaveFile(path, data));
+    ASSERT(ring.LoadFile(path) == data);
+    DeleteFile(path);
+    ASSERT(ring.LoadFile(path).IsVoid());
+}
+#endif